@@ -0,0 +1,238 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Compares the sparse Cholesky (SimplicialLDLT) and the block-Jacobi PCG linear
+// solvers on synthetic bundle adjustment problems of increasing size.
+// Each run is executed in a child process so that the peak resident memory
+// of one solver does not hide the other.
+
+#include<iostream>
+#include<iomanip>
+#include<cstdlib>
+#include<vector>
+#include<chrono>
+
+#include<unistd.h>
+#include<sys/wait.h>
+#include<sys/resource.h>
+
+#include "Thirdparty/g2o/g2o/core/block_solver.h"
+#include "Thirdparty/g2o/g2o/core/optimization_algorithm_levenberg.h"
+#include "Thirdparty/g2o/g2o/core/robust_kernel_impl.h"
+#include "Thirdparty/g2o/g2o/solvers/linear_solver_eigen.h"
+#include "Thirdparty/g2o/g2o/solvers/linear_solver_pcg.h"
+#include "Thirdparty/g2o/g2o/types/types_six_dof_expmap.h"
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+const double fx = 500.0, fy = 500.0, cx = 320.0, cy = 240.0;
+const int nPointsPerKF = 150;
+
+double Gaussian(double sigma)
+{
+    // Box-Muller
+    double u1 = (rand()+1.0)/(RAND_MAX+2.0);
+    double u2 = (rand()+1.0)/(RAND_MAX+2.0);
+    return sigma*sqrt(-2.0*log(u1))*cos(2.0*M_PI*u2);
+}
+
+// Cameras move along a loop, looking outwards at a cylindrical wall of points.
+void BuildProblem(g2o::SparseOptimizer &optimizer, const int nKFs)
+{
+    srand(0);
+
+    const double radius = nKFs*0.3/(2.0*M_PI);
+    const double wall = radius+8.0;
+
+    vector<g2o::SE3Quat> vTcw(nKFs);
+    for(int i=0; i<nKFs; i++)
+    {
+        const double theta = 2.0*M_PI*i/nKFs;
+        // Camera z axis points radially outwards
+        Eigen::Vector3d z(cos(theta),sin(theta),0);
+        Eigen::Vector3d y(0,0,-1);
+        Eigen::Vector3d x = y.cross(z);
+        Eigen::Matrix3d Rwc;
+        Rwc.col(0) = x; Rwc.col(1) = y; Rwc.col(2) = z;
+        Eigen::Vector3d twc = radius*z;
+        vTcw[i] = g2o::SE3Quat(Rwc.transpose(),-Rwc.transpose()*twc);
+
+        g2o::VertexSE3Expmap* vSE3 = new g2o::VertexSE3Expmap();
+        g2o::SE3Quat noise(Eigen::Quaterniond(1,Gaussian(0.005),Gaussian(0.005),Gaussian(0.005)).normalized(),
+                           Eigen::Vector3d(Gaussian(0.05),Gaussian(0.05),Gaussian(0.05)));
+        vSE3->setEstimate(i==0 ? vTcw[i] : noise*vTcw[i]);
+        vSE3->setId(i);
+        vSE3->setFixed(i==0);
+        optimizer.addVertex(vSE3);
+    }
+
+    const float thHuber2D = sqrt(5.99);
+    int id = nKFs;
+    for(int i=0; i<nKFs; i++)
+    {
+        const double theta0 = 2.0*M_PI*i/nKFs;
+        for(int j=0; j<nPointsPerKF; j++)
+        {
+            const double theta = theta0 + Gaussian(0.1)*2.0*M_PI/nKFs*5.0;
+            const Eigen::Vector3d Xw(wall*cos(theta),wall*sin(theta),Gaussian(2.0));
+
+            vector<int> vObs;
+            vector<Eigen::Vector2d> vUV;
+            for(int k=i-8; k<=i+8; k++)
+            {
+                const int kf = (k+nKFs)%nKFs;
+                const Eigen::Vector3d Xc = vTcw[kf].map(Xw);
+                if(Xc(2)<0.1)
+                    continue;
+                const double u = fx*Xc(0)/Xc(2)+cx;
+                const double v = fy*Xc(1)/Xc(2)+cy;
+                if(u<0 || u>=2*cx || v<0 || v>=2*cy)
+                    continue;
+                vObs.push_back(kf);
+                vUV.push_back(Eigen::Vector2d(u+Gaussian(1.0),v+Gaussian(1.0)));
+            }
+
+            if(vObs.size()<2)
+                continue;
+
+            g2o::VertexSBAPointXYZ* vPoint = new g2o::VertexSBAPointXYZ();
+            vPoint->setEstimate(Xw+Eigen::Vector3d(Gaussian(0.1),Gaussian(0.1),Gaussian(0.1)));
+            vPoint->setId(id);
+            vPoint->setMarginalized(true);
+            optimizer.addVertex(vPoint);
+
+            for(size_t k=0; k<vObs.size(); k++)
+            {
+                g2o::EdgeSE3ProjectXYZ* e = new g2o::EdgeSE3ProjectXYZ();
+                e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
+                e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(vObs[k])));
+                e->setMeasurement(vUV[k]);
+                e->setInformation(Eigen::Matrix2d::Identity());
+                g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
+                e->setRobustKernel(rk);
+                rk->setDelta(thHuber2D);
+                e->fx = fx;
+                e->fy = fy;
+                e->cx = cx;
+                e->cy = cy;
+                optimizer.addEdge(e);
+            }
+
+            id++;
+        }
+    }
+}
+
+void RunSolver(const int nKFs, const bool bPCG, const int nIterations)
+{
+    // Workers of the PCG matrix-vector products, as in the Optimizer
+    ORB_SLAM2::ThreadPool threadPool;
+
+    g2o::SparseOptimizer optimizer;
+    g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
+    if(bPCG)
+    {
+        g2o::LinearSolverPCG<g2o::BlockSolver_6_3::PoseMatrixType>* linearSolverPCG =
+                new g2o::LinearSolverPCG<g2o::BlockSolver_6_3::PoseMatrixType>();
+        linearSolverPCG->setParallelFor([&threadPool](int n, const std::function<void(int)> &f)
+        {
+            threadPool.ParallelFor(n,f);
+        });
+        linearSolver = linearSolverPCG;
+    }
+    else
+        linearSolver = new g2o::LinearSolverEigen<g2o::BlockSolver_6_3::PoseMatrixType>();
+    g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
+    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+    optimizer.setAlgorithm(solver);
+    optimizer.setComputeBatchStatistics(true);
+
+    BuildProblem(optimizer,nKFs);
+
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    optimizer.initializeOptimization();
+    optimizer.optimize(nIterations);
+    chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+    double tOptimization = chrono::duration_cast<chrono::duration<double> >(t2 - t1).count();
+
+    size_t maxNNZ = 0;
+    int nLinearIterations = 0;
+    const g2o::BatchStatisticsContainer &stats = optimizer.batchStatistics();
+    for(size_t i=0; i<stats.size(); i++)
+    {
+        maxNNZ = max(maxNNZ,stats[i].choleskyNNZ);
+        nLinearIterations += stats[i].iterationsLinearSolver;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+
+    cout << setw(8) << nKFs << setw(10) << optimizer.vertices().size()-nKFs
+         << setw(10) << (bPCG ? "PCG" : "Cholesky")
+         << setw(12) << fixed << setprecision(3) << tOptimization
+         << setw(14) << maxNNZ
+         << setw(12) << (bPCG ? nLinearIterations : 0)
+         << setw(12) << usage.ru_maxrss/1024
+         << setw(16) << setprecision(1) << optimizer.activeRobustChi2() << endl;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc > 3)
+    {
+        cerr << endl << "Usage: ./ba_solvers [max_keyframes] [iterations]" << endl;
+        return 1;
+    }
+
+    const int nMaxKFs = argc > 1 ? atoi(argv[1]) : 1600;
+    const int nIterations = argc > 2 ? atoi(argv[2]) : 10;
+
+    cout << setw(8) << "KFs" << setw(10) << "points" << setw(10) << "solver"
+         << setw(12) << "time [s]" << setw(14) << "factor NNZ" << setw(12) << "CG iters"
+         << setw(12) << "RSS [MB]" << setw(16) << "final chi2" << endl;
+
+    for(int nKFs=100; nKFs<=nMaxKFs; nKFs*=2)
+    {
+        for(int s=0; s<2; s++)
+        {
+            cout.flush();
+            pid_t pid = fork();
+            if(pid==0)
+            {
+                RunSolver(nKFs,s==1,nIterations);
+                _exit(0);
+            }
+            else if(pid>0)
+            {
+                int status;
+                waitpid(pid,&status,0);
+            }
+            else
+            {
+                cerr << "fork failed" << endl;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
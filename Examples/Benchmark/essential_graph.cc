@@ -0,0 +1,225 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Compares the flat and the hierarchical essential graph solvers on synthetic
+// Sim3 pose graphs of 10k, 50k and 100k keyframes. The trajectory runs several
+// laps around a circle. The previous laps were corrected by earlier loops and
+// are only slightly perturbed, the last lap is obtained by chaining the noisy
+// spanning tree edges so it drifts as odometry does until the loop closes.
+// Each run is executed in a child process to report its peak resident memory.
+
+#include<iostream>
+#include<iomanip>
+#include<cstdlib>
+#include<vector>
+#include<chrono>
+
+#include<unistd.h>
+#include<sys/wait.h>
+#include<sys/resource.h>
+
+#include "Optimizer.h"
+#include "ThreadPool.h"
+
+using namespace std;
+using namespace ORB_SLAM2;
+
+const int nKFsPerLap = 2000;
+const int nLoopEdgeStep = 20;
+
+double Gaussian(double sigma)
+{
+    // Box-Muller
+    double u1 = (rand()+1.0)/(RAND_MAX+2.0);
+    double u2 = (rand()+1.0)/(RAND_MAX+2.0);
+    return sigma*sqrt(-2.0*log(u1))*cos(2.0*M_PI*u2);
+}
+
+g2o::Sim3 Noise(double sigmaR, double sigmat, double sigmas)
+{
+    return g2o::Sim3(Eigen::Quaterniond(1,Gaussian(sigmaR),Gaussian(sigmaR),Gaussian(sigmaR)).normalized(),
+                     Eigen::Vector3d(Gaussian(sigmat),Gaussian(sigmat),Gaussian(sigmat)),
+                     exp(Gaussian(sigmas)));
+}
+
+// vScw of the graph is the drifted initial guess, vGTScw the ground truth
+void BuildGraph(const int N, Optimizer::EssentialGraph &graph, vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > &vGTScw)
+{
+    srand(0);
+
+    const double radius = nKFsPerLap*0.3/(2.0*M_PI);
+    vGTScw.resize(N);
+    for(int i=0; i<N; i++)
+    {
+        const double theta = 2.0*M_PI*i/nKFsPerLap;
+        // Camera z axis points along the trajectory
+        Eigen::Vector3d z(-sin(theta),cos(theta),0);
+        Eigen::Vector3d y(0,0,-1);
+        Eigen::Vector3d x = y.cross(z);
+        Eigen::Matrix3d Rwc;
+        Rwc.col(0) = x; Rwc.col(1) = y; Rwc.col(2) = z;
+        Eigen::Vector3d twc(radius*cos(theta),radius*sin(theta),0.1*i/nKFsPerLap);
+        vGTScw[i] = g2o::Sim3(Rwc.transpose(),-Rwc.transpose()*twc,1.0);
+    }
+
+    // Only tested for NULL by the solvers
+    static char placeholder;
+    graph.vpKFs.assign(N,reinterpret_cast<KeyFrame*>(&placeholder));
+    graph.vScw.resize(N);
+    graph.vEdges.clear();
+    graph.vEdgeMeasurements.clear();
+    graph.nLoopKFid = 0;
+    graph.bFixScale = false;
+
+    for(int i=1; i<N; i++)
+    {
+        // Spanning tree and covisibility edges with the previous keyframes
+        for(int k=1; k<=4 && k<=i; k++)
+        {
+            graph.vEdges.push_back(make_pair((unsigned long)(i-k),(unsigned long)i));
+            graph.vEdgeMeasurements.push_back(Noise(0.001,0.005,0.002)*vGTScw[i]*vGTScw[i-k].inverse());
+        }
+
+        // Loop edges with the previous laps
+        if(i%nLoopEdgeStep==0)
+        {
+            for(int j=i-nKFsPerLap; j>=0; j-=nKFsPerLap)
+            {
+                graph.vEdges.push_back(make_pair((unsigned long)j,(unsigned long)i));
+                graph.vEdgeMeasurements.push_back(Noise(0.001,0.005,0.002)*vGTScw[i]*vGTScw[j].inverse());
+            }
+        }
+    }
+
+    // Odometry in the last lap: chain the spanning tree edges (the first edge of each keyframe)
+    const int nLastLap = max(N-nKFsPerLap,1);
+    graph.vScw[0] = vGTScw[0];
+    for(int i=1; i<nLastLap; i++)
+        graph.vScw[i] = Noise(0.0005,0.002,0.001)*vGTScw[i];
+    for(size_t e=0, i=nLastLap; e<graph.vEdges.size() && i<(size_t)N; e++)
+    {
+        if(graph.vEdges[e].second!=i || graph.vEdges[e].first!=i-1)
+            continue;
+        graph.vScw[i] = graph.vEdgeMeasurements[e]*graph.vScw[i-1];
+        i++;
+    }
+}
+
+double Chi2(const Optimizer::EssentialGraph &graph)
+{
+    double chi2 = 0;
+    for(size_t e=0; e<graph.vEdges.size(); e++)
+    {
+        const g2o::Sim3 error = graph.vEdgeMeasurements[e]*graph.vCorrectedScw[graph.vEdges[e].first]*
+                                graph.vCorrectedScw[graph.vEdges[e].second].inverse();
+        chi2 += error.log().squaredNorm();
+    }
+    return chi2;
+}
+
+double PositionRMSE(const Optimizer::EssentialGraph &graph, const vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > &vGTScw)
+{
+    double sum = 0;
+    for(size_t i=0; i<vGTScw.size(); i++)
+    {
+        const Eigen::Vector3d Ow = graph.vCorrectedScw[i].inverse().translation();
+        const Eigen::Vector3d OwGT = vGTScw[i].inverse().translation();
+        sum += (Ow-OwGT).squaredNorm();
+    }
+    return sqrt(sum/vGTScw.size());
+}
+
+void RunSolver(const int N, const int nSubmapSize)
+{
+    Optimizer::EssentialGraph graph;
+    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vGTScw;
+    BuildGraph(N,graph,vGTScw);
+
+    ThreadPool threadPool;
+
+    // The flat solver runs on the calling thread
+    int nThreads = 1;
+    int nCycles = 1;
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    if(nSubmapSize>0)
+    {
+        nThreads = threadPool.Size();
+        nCycles = Optimizer::SolveEssentialGraphHierarchical(graph,nSubmapSize,&threadPool);
+    }
+    else
+        Optimizer::SolveEssentialGraphFlat(graph);
+    chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+    double tOptimization = chrono::duration_cast<chrono::duration<double> >(t2 - t1).count();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+
+    cout << setw(8) << N << setw(10) << graph.vEdges.size()
+         << setw(14) << (nSubmapSize>0 ? "hierarchical" : "flat")
+         << setw(9) << nThreads << setw(8) << nCycles
+         << setw(12) << fixed << setprecision(3) << tOptimization
+         << setw(12) << usage.ru_maxrss/1024
+         << setw(14) << setprecision(2) << Chi2(graph)
+         << setw(12) << setprecision(3) << PositionRMSE(graph,vGTScw) << endl;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc > 3)
+    {
+        cerr << endl << "Usage: ./essential_graph [max_keyframes] [submap_size]" << endl;
+        return 1;
+    }
+
+    const int nMaxKFs = argc > 1 ? atoi(argv[1]) : 100000;
+    const int nSubmapSize = argc > 2 ? atoi(argv[2]) : 200;
+
+    cout << setw(8) << "KFs" << setw(10) << "edges" << setw(14) << "solver"
+         << setw(9) << "threads" << setw(8) << "cycles"
+         << setw(12) << "time [s]" << setw(12) << "RSS [MB]"
+         << setw(14) << "final chi2" << setw(12) << "RMSE [m]" << endl;
+
+    const int vSizes[] = {10000, 50000, 100000};
+    for(int n=0; n<3 && vSizes[n]<=nMaxKFs; n++)
+    {
+        for(int s=0; s<2; s++)
+        {
+            cout.flush();
+            pid_t pid = fork();
+            if(pid==0)
+            {
+                RunSolver(vSizes[n],s==1 ? nSubmapSize : 0);
+                _exit(0);
+            }
+            else if(pid>0)
+            {
+                int status;
+                waitpid(pid,&status,0);
+            }
+            else
+            {
+                cerr << "fork failed" << endl;
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
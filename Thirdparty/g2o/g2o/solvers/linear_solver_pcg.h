@@ -0,0 +1,285 @@
+// g2o - General Graph Optimization
+// Copyright (C) 2011 R. Kuemmerle, G. Grisetti, W. Burgard
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef G2O_LINEAR_SOLVER_PCG_H
+#define G2O_LINEAR_SOLVER_PCG_H
+
+#include "../core/linear_solver.h"
+#include "../core/batch_stats.h"
+#include "../stuff/timeutil.h"
+
+#include "../core/eigen_types.h"
+
+#include <vector>
+#include <utility>
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+
+namespace g2o {
+
+/**
+ * \brief linear solver using preconditioned conjugate gradient
+ *
+ * The preconditioner is the block-Jacobi matrix, i.e., the inverse of the
+ * diagonal blocks of A. Contrary to the Cholesky based solvers no factor
+ * is ever formed, memory stays linear in the number of non-zero blocks of A.
+ * The sparse block matrix-vector product and the preconditioner are computed
+ * block row by block row, each row written by a single task. The tasks run
+ * through the function given to setParallelFor, serially if none is given.
+ */
+template <typename MatrixType>
+class LinearSolverPCG : public LinearSolver<MatrixType>
+{
+  public:
+    //! parallelFor(n, f) calls f(i) for every i in [0,n) and returns when all calls are done
+    typedef std::function<void(int, const std::function<void(int)>&)> ParallelForFunction;
+
+    LinearSolverPCG() :
+      LinearSolver<MatrixType>(),
+      _tolerance(1e-6), _absoluteTolerance(false), _maxIter(-1),
+      _residual(-1.0), _iterations(0), _minParallelBlocks(256)
+    {
+    }
+
+    virtual ~LinearSolverPCG()
+    {
+    }
+
+    virtual bool init()
+    {
+      _residual = -1.0;
+      _iterations = 0;
+      return true;
+    }
+
+    bool solve(const SparseBlockMatrix<MatrixType>& A, double* x, double* b)
+    {
+      const int n = A.rows();
+      assert(n > 0 && "Hessian has 0 rows/cols");
+      assert(n == A.cols() && "Matrix A is not square");
+
+      double t=get_monotonic_time();
+      buildBlockRows(A);
+      if (! buildPreconditioner(A))
+        return false;
+
+      VectorXD::MapType xvec(x, n);
+      VectorXD::ConstMapType bvec(b, n);
+      xvec.setZero();
+
+      // r = b - A*x = b, z = M^{-1} r, p = z
+      VectorXD r = bvec;
+      VectorXD z(n), p(n), q(n);
+      applyPreconditioner(r, z);
+      p = z;
+      double rz = r.dot(z);
+
+      const double bnorm2 = bvec.squaredNorm();
+      const double threshold = _absoluteTolerance ? _tolerance * _tolerance : _tolerance * _tolerance * bnorm2;
+      const int maxIter = _maxIter < 0 ? n : _maxIter;
+
+      double rnorm2 = bnorm2;
+      int iteration = 0;
+      while (iteration < maxIter && rnorm2 > threshold) {
+        multiply(p, q);
+        double pq = p.dot(q);
+        if (pq <= 0.) // A is not positive definite along p
+          break;
+        double alpha = rz / pq;
+        xvec += alpha * p;
+        r -= alpha * q;
+        rnorm2 = r.squaredNorm();
+        ++iteration;
+        if (rnorm2 <= threshold)
+          break;
+        applyPreconditioner(r, z);
+        double rzNew = r.dot(z);
+        double beta = rzNew / rz;
+        rz = rzNew;
+        p = z + beta * p;
+      }
+
+      _residual = std::sqrt(rnorm2);
+      _iterations = iteration;
+
+      G2OBatchStatistics* globalStats = G2OBatchStatistics::globalStats();
+      if (globalStats) {
+        globalStats->timeLinearSolver = get_monotonic_time() - t;
+        globalStats->iterationsLinearSolver = iteration;
+        globalStats->choleskyNNZ = 0;
+      }
+
+      return true;
+    }
+
+    //! return the tolerance for terminating PCG
+    double tolerance() const { return _tolerance;}
+    //! set the tolerance for terminating PCG
+    void setTolerance(double tolerance) { _tolerance = tolerance;}
+
+    //! if true the tolerance is compared against |r|, otherwise against |r|/|b|
+    bool absoluteTolerance() const { return _absoluteTolerance;}
+    void setAbsoluteTolerance(bool absoluteTolerance) { _absoluteTolerance = absoluteTolerance;}
+
+    //! maximum number of PCG iterations, -1 means the dimension of the system
+    int maxIterations() const { return _maxIter;}
+    void setMaxIterations(int maxIter) { _maxIter = maxIter;}
+
+    //! run the block rows in parallel through parallelFor, systems below minBlocks block rows stay serial
+    void setParallelFor(const ParallelForFunction& parallelFor, int minBlocks = 256) { _parallelFor = parallelFor; _minParallelBlocks = minBlocks;}
+
+    //! norm of the residual and number of iterations of the last call to solve
+    double residual() const { return _residual;}
+    int iterations() const { return _iterations;}
+
+  protected:
+    typedef std::vector< MatrixType, Eigen::aligned_allocator<MatrixType> > MatrixVector;
+
+    /**
+     * one entry of a block row: the block column it multiplies and the block
+     * itself. Only the upper triangle of A is stored, the blocks below the
+     * diagonal are taken transposed from their upper counterpart.
+     */
+    struct RowEntry {
+      int col;
+      const MatrixType* block;
+      bool transposed;
+    };
+    typedef std::vector<RowEntry> RowEntries;
+
+    double _tolerance;
+    bool _absoluteTolerance;
+    int _maxIter;
+    double _residual;
+    int _iterations;
+
+    ParallelForFunction _parallelFor;
+    int _minParallelBlocks;
+
+    std::vector<RowEntries> _blockRows;
+    std::vector<int> _blockBase;
+    MatrixVector _diagInverse;
+
+    void buildBlockRows(const SparseBlockMatrix<MatrixType>& A)
+    {
+      const int numBlocks = A.blockCols().size();
+      _blockRows.resize(numBlocks);
+      _blockBase.resize(numBlocks);
+      for (int i = 0; i < numBlocks; ++i) {
+        _blockRows[i].clear();
+        _blockBase[i] = A.colBaseOfBlock(i);
+      }
+
+      for (int c = 0; c < numBlocks; ++c) {
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        for (typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.begin(); it != column.end(); ++it) {
+          const int r = it->first;
+          if (r > c) // only upper triangle
+            break;
+          RowEntry upper = {c, it->second, false};
+          _blockRows[r].push_back(upper);
+          if (r != c) {
+            RowEntry lower = {r, it->second, true};
+            _blockRows[c].push_back(lower);
+          }
+        }
+      }
+    }
+
+    bool buildPreconditioner(const SparseBlockMatrix<MatrixType>& A)
+    {
+      const int numBlocks = A.blockCols().size();
+      _diagInverse.resize(numBlocks);
+      for (int c = 0; c < numBlocks; ++c) {
+        const typename SparseBlockMatrix<MatrixType>::IntBlockMap& column = A.blockCols()[c];
+        typename SparseBlockMatrix<MatrixType>::IntBlockMap::const_iterator it = column.find(c);
+        if (it == column.end())
+          return false;
+        const MatrixType& D = *(it->second);
+        _diagInverse[c] = D.inverse();
+      }
+      return true;
+    }
+
+    //! call f(i) for every block row i, in chunks of consecutive rows
+    void forEachBlockRow(int numBlocks, const std::function<void(int)>& f) const
+    {
+      if (!_parallelFor || numBlocks < _minParallelBlocks) {
+        for (int i = 0; i < numBlocks; ++i)
+          f(i);
+        return;
+      }
+      const int chunk = 64;
+      const int numChunks = (numBlocks + chunk - 1) / chunk;
+      _parallelFor(numChunks, [&](int c) {
+        const int end = std::min(numBlocks, (c + 1) * chunk);
+        for (int i = c * chunk; i < end; ++i)
+          f(i);
+      });
+    }
+
+    void applyPreconditioner(const VectorXD& src, VectorXD& dest) const
+    {
+      const int numBlocks = _diagInverse.size();
+      forEachBlockRow(numBlocks, [&](int i) {
+        const MatrixType& Dinv = _diagInverse[i];
+        const int base = blockBase(i);
+        dest.segment(base, Dinv.rows()) = Dinv * src.segment(base, Dinv.cols());
+      });
+    }
+
+    //! dest = A * src, each block row is computed independently
+    void multiply(const VectorXD& src, VectorXD& dest) const
+    {
+      const int numBlocks = _blockRows.size();
+      forEachBlockRow(numBlocks, [&](int i) {
+        const RowEntries& row = _blockRows[i];
+        const int rowBase = blockBase(i);
+        const int rowDim = _diagInverse[i].rows();
+        typename VectorXD::SegmentReturnType destSegment = dest.segment(rowBase, rowDim);
+        destSegment.setZero();
+        for (typename RowEntries::const_iterator it = row.begin(); it != row.end(); ++it) {
+          const MatrixType& m = *(it->block);
+          const int colBase = blockBase(it->col);
+          if (it->transposed)
+            destSegment.noalias() += m.transpose() * src.segment(colBase, m.rows());
+          else
+            destSegment.noalias() += m * src.segment(colBase, m.cols());
+        }
+      });
+    }
+
+    int blockBase(int i) const
+    {
+      return _blockBase[i];
+    }
+};
+
+} // end namespace
+
+#endif
@@ -83,6 +83,10 @@ public:
     // and fill variables of the MapPoint to be used by the tracking
     bool isInFrustum(MapPoint* pMP, float viewingCosLimit);
 
+    // Same as isInFrustum for a batch of MapPoints. The geometry of the points is gathered
+    // in contiguous arrays and tested in branch-free loops. Returns the number of points in the frustum.
+    int AreInFrustum(const vector<MapPoint*> &vpMPs, float viewingCosLimit);
+
     // Compute the cell of a keypoint (return false if outside the grid)
     bool PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY);
 
@@ -206,6 +210,11 @@ private:
     cv::Mat mtcw;
     cv::Mat mRwc;
     cv::Mat mOw; //==mtwc
+
+    // Fixed-size copies of the above, used in the per-point hot paths
+    cv::Matx33f mRcw33f;
+    cv::Vec3f mtcw3f;
+    cv::Vec3f mOw3f;
 };
 
 }// namespace ORB_SLAM
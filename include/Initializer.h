@@ -21,6 +21,7 @@
 #define INITIALIZER_H
 
 #include<opencv2/opencv.hpp>
+#include<Eigen/Core>
 #include "Frame.h"
 
 
@@ -48,12 +49,15 @@ private:
     void FindHomography(vector<bool> &vbMatchesInliers, float &score, cv::Mat &H21);
     void FindFundamental(vector<bool> &vbInliers, float &score, cv::Mat &F21);
 
-    cv::Mat ComputeH21(const vector<cv::Point2f> &vP1, const vector<cv::Point2f> &vP2);
-    cv::Mat ComputeF21(const vector<cv::Point2f> &vP1, const vector<cv::Point2f> &vP2);
+    // Minimal solvers on 8 normalized correspondences, points are the columns of P1 and P2
+    Eigen::Matrix3f ComputeH21(const Eigen::Matrix<float,2,8> &P1, const Eigen::Matrix<float,2,8> &P2);
+    Eigen::Matrix3f ComputeF21(const Eigen::Matrix<float,2,8> &P1, const Eigen::Matrix<float,2,8> &P2);
 
-    float CheckHomography(const cv::Mat &H21, const cv::Mat &H12, vector<bool> &vbMatchesInliers, float sigma);
+    // Scoring stops as soon as the hypothesis cannot reach bestScore, the partial score is returned
+    float CheckHomography(const Eigen::Matrix3f &H21, const Eigen::Matrix3f &H12, vector<int> &vbMatchesInliers,
+                          float sigma, float bestScore);
 
-    float CheckFundamental(const cv::Mat &F21, vector<bool> &vbMatchesInliers, float sigma);
+    float CheckFundamental(const Eigen::Matrix3f &F21, vector<int> &vbMatchesInliers, float sigma, float bestScore);
 
     bool ReconstructF(vector<bool> &vbMatchesInliers, cv::Mat &F21, cv::Mat &K,
                       cv::Mat &R21, cv::Mat &t21, vector<cv::Point3f> &vP3D, vector<bool> &vbTriangulated, float minParallax, int minTriangulated);
@@ -82,6 +86,10 @@ private:
     vector<Match> mvMatches12;
     vector<bool> mvbMatched1;
 
+    // Coordinates of the matched keypoints (structure of arrays for the hypothesis scoring)
+    vector<float> mvMatchesU1, mvMatchesV1;
+    vector<float> mvMatchesU2, mvMatchesV2;
+
     // Calibration
     cv::Mat mK;
 
@@ -28,8 +28,11 @@
 #include "ORBextractor.h"
 #include "Frame.h"
 #include "KeyFrameDatabase.h"
+#include "SeqLock.h"
+#include "SlabAllocator.h"
 
 #include <mutex>
+#include <atomic>
 
 
 namespace ORB_SLAM2
@@ -45,6 +48,11 @@ class KeyFrame
 public:
     KeyFrame(Frame &F, Map* pMap, KeyFrameDatabase* pKFDB);
 
+    // KeyFrames are allocated from slabs (see SlabAllocator)
+    static void* operator new(size_t nSize);
+    static void operator delete(void* p, size_t nSize);
+    static SlabAllocator<KeyFrame>& GetAllocator();
+
     // Pose functions
     void SetPose(const cv::Mat &Tcw);
     cv::Mat GetPose();
@@ -54,12 +62,22 @@ public:
     cv::Mat GetRotation();
     cv::Mat GetTranslation();
 
+    // Lock-free, allocation-free versions of the pose functions
+    cv::Matx44f GetPose44f();
+    cv::Matx44f GetPoseInverse44f();
+    cv::Matx33f GetRotation33f();
+    cv::Vec3f GetTranslation3f();
+    cv::Vec3f GetCameraCenter3f();
+
     // Bag of Words Representation
     void ComputeBoW();
 
     // Covisibility graph functions
+    // Weights are kept up to date by the MapPoints when observations are added or erased (see UpdateWeight).
+    // The ordered neighbor lists are sorted lazily, on the first query after a change.
     void AddConnection(KeyFrame* pKF, const int &weight);
     void EraseConnection(KeyFrame* pKF);
+    void UpdateWeight(KeyFrame* pKF, const int &nDelta);
     void UpdateConnections();
     void UpdateBestCovisibles();
     std::set<KeyFrame *> GetConnectedKeyFrames();
@@ -76,6 +94,10 @@ public:
     KeyFrame* GetParent();
     bool hasChild(KeyFrame* pKF);
 
+    // Incremented when the MapPoint matches, the covisibility or the spanning tree links change.
+    // Lock free, Tracking reuses its local map while the index of the local keyframes is the same.
+    unsigned long GetChangeIdx();
+
     // Loop Edges
     void AddLoopEdge(KeyFrame* pKF);
     std::set<KeyFrame*> GetLoopEdges();
@@ -105,6 +127,11 @@ public:
     void SetBadFlag();
     bool isBad();
 
+    // Free BoW and grid of a bad keyframe, called by the map once no thread references it.
+    // Threads must drop their bad keyframes before a quiescent state (see Map::QuiescentState),
+    // the matching functions do not check for released data.
+    void ReleaseMatchingData();
+
     // Compute Scene Depth (q=2 median). Used in monocular.
     float ComputeSceneMedianDepth(const int q);
 
@@ -116,6 +143,13 @@ public:
         return pKF1->mnId<pKF2->mnId;
     }
 
+    // Higher loop score first, then lower id
+    static bool loopScoreComp(KeyFrame* pKF1, KeyFrame* pKF2){
+        if(pKF1->mLoopScore!=pKF2->mLoopScore)
+            return pKF1->mLoopScore>pKF2->mLoopScore;
+        return pKF1->mnId<pKF2->mnId;
+    }
+
 
     // The following variables are accesed from only 1 thread or never change (no mutex needed).
 public:
@@ -132,6 +166,10 @@ public:
     const float mfGridElementWidthInv;
     const float mfGridElementHeightInv;
 
+    // Slot in the map keyframe array, stable while the keyframe is in the map (-1 if not in the map).
+    // Written by the map only.
+    long int mnMapIdx;
+
     // Variables used by the tracking
     long unsigned int mnTrackReferenceForFrame;
     long unsigned int mnFuseTargetForKF;
@@ -192,12 +230,16 @@ public:
     // The following variables need to be accessed trough a mutex to be thread safe.
 protected:
 
-    // SE3 Pose and camera center
-    cv::Mat Tcw;
-    cv::Mat Twc;
-    cv::Mat Ow;
+    // Layout of mPoseData
+    enum ePoseData{
+        POSE_DATA_TCW=0,    // first three rows of Tcw
+        POSE_DATA_OW=12,    // camera center
+        POSE_DATA_CW=15,    // Stereo middel point. Only for visualization
+        POSE_DATA_SIZE=18
+    };
 
-    cv::Mat Cw; // Stereo middel point. Only for visualization
+    // SE3 Pose and camera center. Written holding mMutexPose, read without locking.
+    SeqLock<float,POSE_DATA_SIZE> mPoseData;
 
     // MapPoints associated to keypoints
     std::vector<MapPoint*> mvpMapPoints;
@@ -213,6 +255,11 @@ protected:
     std::vector<KeyFrame*> mvpOrderedConnectedKeyFrames;
     std::vector<int> mvOrderedWeights;
 
+    // Ordered lists are outdated (mMutexConnections must be locked)
+    bool mbConnectionsDirty;
+    void SetConnectionsDirty();
+    void SortConnections();
+
     // Spanning Tree and Loop Edges
     bool mbFirstConnection;
     KeyFrame* mpParent;
@@ -224,6 +271,8 @@ protected:
     bool mbToBeErased;
     bool mbBad;    
 
+    std::atomic<unsigned long> mnChangeIdx;
+
     float mHalfBaseline; // Only for visualization
 
     Map* mpMap;
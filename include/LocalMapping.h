@@ -26,6 +26,8 @@
 #include "LoopClosing.h"
 #include "Tracking.h"
 #include "KeyFrameDatabase.h"
+#include "ThreadPool.h"
+#include "SPSCQueue.h"
 
 #include <mutex>
 
@@ -40,7 +42,34 @@ class Map;
 class LocalMapping
 {
 public:
-    LocalMapping(Map* pMap, const float bMonocular);
+    // Scheduling of the work of each keyframe. Costs are moving averages in seconds.
+    struct SchedulerStats
+    {
+        // Time budget of the last keyframe (0 if unlimited) and time spent on it
+        float budget;
+        float lastTime;
+
+        float costProcess;
+        float costCulling;
+        float costTriangulation;
+        float costFusion;
+        float costKeyFrameCulling;
+        // Local BA cost per local keyframe and iteration
+        float costLocalBA;
+
+        // Window and iterations of the last local BA (0 keyframes is the full window)
+        int lastBAKeyFrames;
+        int lastBAIterations;
+
+        unsigned long nKeyFrames;
+        unsigned long nOverruns;
+        unsigned long nSkippedBA;
+        unsigned long nDeferredFusions;
+        unsigned long nDeferredCullings;
+        unsigned long nDroppedFusions;
+    };
+
+    LocalMapping(Map* pMap, const float bMonocular, const string &strSettingPath);
 
     void SetLoopCloser(LoopClosing* pLoopCloser);
 
@@ -68,10 +97,14 @@ public:
     bool isFinished();
 
     int KeyframesInQueue(){
-        unique_lock<std::mutex> lock(mMutexNewKFs);
-        return mlNewKeyFrames.size();
+        return mqNewKeyFrames.Size();
     }
 
+    // Depth, backpressure and dwell time of the keyframe queue from the Tracking
+    SPSCQueue<KeyFrame*>::Stats GetQueueStats();
+
+    SchedulerStats GetSchedulerStats();
+
 protected:
 
     bool CheckNewKeyFrames();
@@ -79,10 +112,27 @@ protected:
     void CreateNewMapPoints();
 
     void MapPointCulling();
+
+    // Drop the references to bad MapPoints and signal a quiescent state to the map
+    void DiscardBadMapPoints();
+    void DiscardBadMapPoints(KeyFrame* pKF);
     void SearchInNeighbors();
 
     void KeyFrameCulling();
 
+    void PrintQueueStats();
+
+    // Local BA window and iterations that fit in the remaining time, given the cost per keyframe and iteration
+    void ChooseLocalBA(const int nAvailableKFs, const double remaining, const float cost,
+                       int &nMaxLocalKFs, int &nIterations);
+
+    // Fusion and keyframe culling deferred by the time budget, run when the queue is empty.
+    // DeferFusion returns true if the oldest deferred fusion was dropped.
+    bool DeferFusion(KeyFrame* pKF);
+    void RunDeferredWork();
+
+    void PrintSchedulerStats();
+
     cv::Mat ComputeF12(KeyFrame* &pKF1, KeyFrame* &pKF2);
 
     cv::Mat SkewSymmetricMatrix(const cv::Mat &v);
@@ -100,17 +150,17 @@ protected:
     std::mutex mMutexFinish;
 
     Map* mpMap;
+    int mnMapParticipant;
 
     LoopClosing* mpLoopCloser;
     Tracking* mpTracker;
 
-    std::list<KeyFrame*> mlNewKeyFrames;
+    // Written by the Tracking only, read by this thread only
+    SPSCQueue<KeyFrame*> mqNewKeyFrames;
 
     KeyFrame* mpCurrentKeyFrame;
 
-    std::list<MapPoint*> mlpRecentAddedMapPoints;
-
-    std::mutex mMutexNewKFs;
+    std::vector<MapPoint*> mvpRecentAddedMapPoints;
 
     bool mbAbortBA;
 
@@ -121,6 +171,20 @@ protected:
 
     bool mbAcceptKeyFrames;
     std::mutex mMutexAccept;
+
+    // Workers of the triangulation with the neighbor keyframes
+    ThreadPool mThreadPool;
+
+    // Seconds per keyframe from the settings (0 runs every stage as soon as possible).
+    // The budget is shared by the keyframes waiting in the queue.
+    float mfTimeBudget;
+
+    // Keyframes are only set bad by this thread or with SetErase, isBad is checked before using them
+    std::vector<KeyFrame*> mvpDeferredFuseKFs;
+    KeyFrame* mpDeferredCullingKF;
+
+    SchedulerStats mSchedulerStats;
+    std::mutex mMutexSchedulerStats;
 };
 
 } //namespace ORB_SLAM
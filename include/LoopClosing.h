@@ -28,6 +28,8 @@
 #include "Tracking.h"
 
 #include "KeyFrameDatabase.h"
+#include "ThreadPool.h"
+#include "SPSCQueue.h"
 
 #include <thread>
 #include <mutex>
@@ -105,6 +107,7 @@ protected:
     std::mutex mMutexFinish;
 
     Map* mpMap;
+    int mnMapParticipant;
     Tracking* mpTracker;
 
     KeyFrameDatabase* mpKeyFrameDB;
@@ -112,9 +115,8 @@ protected:
 
     LocalMapping *mpLocalMapper;
 
-    std::list<KeyFrame*> mlpLoopKeyFrameQueue;
-
-    std::mutex mMutexLoopQueue;
+    // Written by the LocalMapping only, read by this thread only
+    SPSCQueue<KeyFrame*> mqLoopKeyFrameQueue;
 
     // Loop detector parameters
     float mnCovisibilityConsistencyTh;
@@ -138,12 +140,17 @@ protected:
     bool mbStopGBA;
     std::mutex mMutexGBA;
     std::thread* mpThreadGBA;
+    // Keyframes moved by the loop corrections not yet refined by a finished Global BA
+    std::set<KeyFrame*> mspGBAPendingKFs;
 
     // Fix scale in the stereo/RGB-D case
     bool mbFixScale;
 
 
     bool mnFullBAIdx;
+
+    // Workers of the loop candidate verification
+    ThreadPool mThreadPool;
 };
 
 } //namespace ORB_SLAM
@@ -23,7 +23,10 @@
 
 #include "MapPoint.h"
 #include "KeyFrame.h"
+#include "MapPointIndex.h"
+#include "SlotArray.h"
 #include <set>
+#include <vector>
 
 #include <mutex>
 
@@ -38,6 +41,9 @@ class KeyFrame;
 class Map
 {
 public:
+    typedef SlotArray<KeyFrame>::Span KeyFrameSpan;
+    typedef SlotArray<MapPoint>::Span MapPointSpan;
+
     Map();
 
     void AddKeyFrame(KeyFrame* pKF);
@@ -48,15 +54,47 @@ public:
     void InformNewBigChange();
     int GetLastBigChangeIdx();
 
+    // Optimizers write their results back between BeginUpdate and EndUpdate (see MapUpdateLock).
+    // The index is odd while an update is being applied, readers that do not hold
+    // mMutexMapUpdate compare it before and after reading poses and positions.
+    void BeginUpdate();
+    void EndUpdate();
+    unsigned long GetUpdateIdx();
+
     std::vector<KeyFrame*> GetAllKeyFrames();
     std::vector<MapPoint*> GetAllMapPoints();
+
+    // Lock free views of the keyframes and map points, without copying them. Objects erased while
+    // iterating might be returned (check isBad), they are not reclaimed before the next quiescent state.
+    KeyFrameSpan GetKeyFrameSpan();
+    MapPointSpan GetMapPointSpan();
     std::vector<MapPoint*> GetReferenceMapPoints();
 
+    // Spatial queries over the map points (see MapPointIndex)
+    std::vector<MapPoint*> GetMapPointsInFrustum(const cv::Mat &Tcw, const float fx, const float fy, const float cx, const float cy,
+                                                 const float minX, const float maxX, const float minY, const float maxY,
+                                                 const float maxDepth);
+    std::vector<MapPoint*> GetMapPointsInRadius(const cv::Mat &x3Dw, const float r);
+    void UpdateMapPointIndex(MapPoint* pMP);
+
     long unsigned int MapPointsInMap();
     long unsigned  KeyFramesInMap();
 
     long unsigned int GetMaxKFid();
 
+    // Deferred reclamation of bad MapPoints and KeyFrames (erased from the map).
+    // Every thread that keeps MapPoint or KeyFrame pointers from one iteration to the next
+    // registers as a participant, and calls QuiescentState once it has dropped its references
+    // to bad MapPoints. Objects are reclaimed when all participants went through a quiescent state
+    // after the object was erased. MapPoints are deleted, KeyFrames only release their matching data
+    // (the pose and the spanning tree are needed to save the trajectory).
+    int RegisterParticipant();
+    void UnregisterParticipant(const int nId);
+    void QuiescentState(const int nId);
+    void Reclaim();
+
+    void PrintMemoryUsage();
+
     void clear();
 
     vector<KeyFrame*> mvpKeyFrameOrigins;
@@ -67,19 +105,54 @@ public:
     std::mutex mMutexPointCreation;
 
 protected:
-    std::set<MapPoint*> mspMapPoints;
-    std::set<KeyFrame*> mspKeyFrames;
+    // Each object stores its slot in mnMapIdx, stable until it is erased from the map.
+    // Written holding mMutexMap.
+    SlotArray<MapPoint> mMapPoints;
+    SlotArray<KeyFrame> mKeyFrames;
 
     std::vector<MapPoint*> mvpReferenceMapPoints;
 
+    // Voxel hash of the map point positions, it has its own mutex
+    MapPointIndex mPointIndex;
+
     long unsigned int mnMaxKFid;
 
+    // Erased objects waiting to be reclaimed, with the epoch at which they were erased
+    std::vector<std::pair<MapPoint*,unsigned long> > mvRetiredMapPoints;
+    std::vector<std::pair<KeyFrame*,unsigned long> > mvRetiredKeyFrames;
+
+    // Bad keyframes whose matching data was already released
+    std::vector<KeyFrame*> mvpReleasedKeyFrames;
+
+    // Epoch of the last quiescent state of each participant (0 if the slot is free)
+    std::vector<unsigned long> mvnParticipantEpochs;
+    unsigned long mnEpoch;
+
+    unsigned long mnReclaimedMapPoints;
+
+    std::mutex mMutexReclaim;
+
     // Index related to a big change in the map (loop closure, global BA)
     int mnBigChangeIdx;
 
+    // Index related to the write back of an optimization (local BA, loop closure, global BA)
+    unsigned long mnUpdateIdx;
+
     std::mutex mMutexMap;
 };
 
+// Takes mMutexMapUpdate while an optimization result is written back to the map
+class MapUpdateLock
+{
+public:
+    MapUpdateLock(Map* pMap);
+    ~MapUpdateLock();
+
+protected:
+    Map* mpMap;
+    std::unique_lock<std::mutex> mLock;
+};
+
 } //namespace ORB_SLAM
 
 #endif // MAP_H
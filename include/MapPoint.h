@@ -24,6 +24,9 @@
 #include"KeyFrame.h"
 #include"Frame.h"
 #include"Map.h"
+#include"SeqLock.h"
+#include"SlabAllocator.h"
+#include"SmallVector.h"
 
 #include<opencv2/core/core.hpp>
 #include<mutex>
@@ -39,17 +42,46 @@ class Frame;
 class MapPoint
 {
 public:
+    // Observations (keyframe, index of the keypoint), sorted by keyframe
+    typedef std::pair<KeyFrame*,size_t> Observation;
+    typedef SmallVector<Observation,8> ObservationList;
+
     MapPoint(const cv::Mat &Pos, KeyFrame* pRefKF, Map* pMap);
     MapPoint(const cv::Mat &Pos,  Map* pMap, Frame* pFrame, const int &idxF);
 
+    // MapPoints are allocated from slabs (see SlabAllocator)
+    static void* operator new(size_t nSize);
+    static void operator delete(void* p, size_t nSize);
+    static SlabAllocator<MapPoint>& GetAllocator();
+
     void SetWorldPos(const cv::Mat &Pos);
     cv::Mat GetWorldPos();
 
     cv::Mat GetNormal();
+
+    // Lock-free, allocation-free versions of GetWorldPos and GetNormal
+    cv::Vec3f GetWorldPos3f();
+    cv::Vec3f GetNormal3f();
+    // Position, normal and distances of the scale invariance region (without the margins
+    // of GetMinDistanceInvariance/GetMaxDistanceInvariance) from one consistent read
+    void GetGeometry(cv::Vec3f &Pos, cv::Vec3f &Normal, float &minDistance, float &maxDistance);
+
     KeyFrame* GetReferenceKeyFrame();
 
     std::map<KeyFrame*,size_t> GetObservations();
+    // Same as GetObservations without heap allocation for up to 8 observations
+    ObservationList GetObservationList();
+    // Calls f(pKF,idx) for each observation without copying them. mMutexFeatures is held:
+    // f must not lock any MapPoint or KeyFrame.
+    template<typename Visitor> void ForEachObservation(Visitor &f)
+    {
+        std::unique_lock<std::mutex> lock(mMutexFeatures);
+        for(ObservationList::const_iterator it=mObservations.begin(), itend=mObservations.end(); it!=itend; it++)
+            f(it->first,it->second);
+    }
     int Observations();
+    // Number of keyframes observing the point at a scale level less or equal than level
+    int ObservationsUpToLevel(const int &level);
 
     void AddObservation(KeyFrame* pKF,size_t idx);
     void EraseObservation(KeyFrame* pKF);
@@ -88,6 +120,14 @@ public:
     long int mnFirstFrame;
     int nObs;
 
+    // Slot in the map point array, stable while the point is in the map (-1 if not in the map).
+    // Written by the map only.
+    long int mnMapIdx;
+
+    // Voxel of the point in the spatial index. Accessed by the MapPointIndex only.
+    long long mnIndexKey;
+    bool mbInIndex;
+
     // Variables used by the tracking
     float mTrackProjX;
     float mTrackProjY;
@@ -114,18 +154,52 @@ public:
 
 protected:    
 
-     // Position in absolute coordinates
-     cv::Mat mWorldPos;
+     // Add nDelta to the covisibility weight between pKF and each of vpKFs
+     static void UpdateCovisibility(KeyFrame* pKF, const std::vector<KeyFrame*> &vpKFs, const int nDelta);
+     // Remove the covisibility between every pair of observations
+     static void EraseCovisibility(const ObservationList &obs);
+
+     // Position of pKF in mObservations, or where to insert it (mMutexFeatures must be locked)
+     ObservationList::iterator FindObservation(KeyFrame* pKF);
+
+     // Maintain the descriptor samples and their distance sums (mMutexFeatures must be locked)
+     void AddDescriptorSample(KeyFrame* pKF, size_t idx);
+     void EraseDescriptorSample(size_t i);
+
+     // Layout of mPosData
+     enum ePosData{
+         POS_DATA_POS=0,
+         POS_DATA_NORMAL=3,
+         POS_DATA_MIN_DISTANCE=6,
+         POS_DATA_MAX_DISTANCE=7,
+         POS_DATA_SIZE=8
+     };
+
+     // Position in absolute coordinates, mean viewing direction and scale invariance distances
+     // (see POS_DATA_*). Written holding mMutexPos, read without locking.
+     SeqLock<float,POS_DATA_SIZE> mPosData;
 
      // Keyframes observing the point and associated index in keyframe
-     std::map<KeyFrame*,size_t> mObservations;
+     ObservationList mObservations;
 
-     // Mean viewing direction
-     cv::Mat mNormalVector;
+     // Number of observations at each scale level, updated with mObservations
+     SmallVector<unsigned short,8> mvnObsPerLevel;
 
      // Best descriptor to fast matching
      cv::Mat mDescriptor;
 
+     // Descriptors of a reservoir sample of at most MAX_DESC_SAMPLES observations, the keyframe
+     // they come from and the sum of the distances of each one to the rest of the sample.
+     // The best descriptor is the one with the smallest sum.
+     // Storage is inline for the first INLINE_DESC_SAMPLES samples (4 words per descriptor), most
+     // points are observed by few keyframes and never allocate.
+     static const size_t MAX_DESC_SAMPLES = 32;
+     static const int INLINE_DESC_SAMPLES = 4;
+     SmallVector<uint64_t,4*INLINE_DESC_SAMPLES> mvDescSamples;
+     SmallVector<KeyFrame*,INLINE_DESC_SAMPLES> mvpDescSampleKFs;
+     SmallVector<int,INLINE_DESC_SAMPLES> mvnDescDistSums;
+     long unsigned int mnDescSeen;
+
      // Reference KeyFrame
      KeyFrame* mpRefKF;
 
@@ -133,14 +207,10 @@ protected:
      int mnVisible;
      int mnFound;
 
-     // Bad flag (we do not currently erase MapPoint from memory)
+     // Bad flag (the MapPoint is deleted by Map::Reclaim once no thread references it)
      bool mbBad;
      MapPoint* mpReplaced;
 
-     // Scale invariance distances
-     float mfMinDistance;
-     float mfMaxDistance;
-
      Map* mpMap;
 
      std::mutex mMutexPos;
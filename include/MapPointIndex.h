@@ -0,0 +1,86 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MAPPOINTINDEX_H
+#define MAPPOINTINDEX_H
+
+#include<vector>
+#include<mutex>
+#include<unordered_map>
+
+#include<opencv2/core/core.hpp>
+
+namespace ORB_SLAM2
+{
+
+class MapPoint;
+
+// Voxel hash of the MapPoint positions. The map inserts and erases the points,
+// MapPoint::SetWorldPos moves them. Queries return candidates at voxel granularity,
+// callers still have to check each point (e.g. with Frame::isInFrustum).
+// Occupied voxels are also grouped in coarse blocks of BLOCK_VOXELS^3 voxels, which
+// frustum queries visit first so that their cost does not grow with the map.
+class MapPointIndex
+{
+public:
+    MapPointIndex(const float fVoxelSize=0.2f);
+
+    void Insert(MapPoint* pMP);
+    void Erase(MapPoint* pMP);
+    // Move the point to the voxel of its current position (nothing if it is not in the index)
+    void Update(MapPoint* pMP);
+    void clear();
+
+    // Points in the voxels that intersect the viewing frustum of a camera with pose Tcw,
+    // calibration fx,fy,cx,cy, image bounds [minX,maxX]x[minY,maxY] and depth up to maxDepth
+    std::vector<MapPoint*> GetPointsInFrustum(const cv::Mat &Tcw, const float fx, const float fy, const float cx, const float cy,
+                                              const float minX, const float maxX, const float minY, const float maxY,
+                                              const float maxDepth);
+
+    // Points at distance at most r of x3Dw
+    std::vector<MapPoint*> GetPointsInRadius(const cv::Mat &x3Dw, const float r);
+
+    size_t VoxelsInIndex();
+
+protected:
+    long long ComputeKey(const cv::Vec3f &x3Dw) const;
+    long long ComputeKey(const int ix, const int iy, const int iz) const;
+    void ComputeCoords(const long long key, int &ix, int &iy, int &iz) const;
+    cv::Vec3f VoxelCenter(const long long key) const;
+    long long ComputeBlockKey(const long long key) const;
+
+    void InsertInVoxel(MapPoint* pMP, const long long key);
+    void EraseFromVoxel(MapPoint* pMP, const long long key);
+
+    float mfVoxelSize;
+    float mfInvVoxelSize;
+
+    std::unordered_map<long long, std::vector<MapPoint*> > mVoxels;
+
+    // Occupied voxels of each block
+    static const int BLOCK_VOXELS = 8;
+    std::unordered_map<long long, std::vector<long long> > mBlocks;
+
+    std::mutex mMutexIndex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // MAPPOINTINDEX_H
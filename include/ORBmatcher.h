@@ -23,6 +23,7 @@
 #define ORBMATCHER_H
 
 #include<vector>
+#include<stdint.h>
 #include<opencv2/core/core.hpp>
 #include<opencv2/features2d/features2d.hpp>
 
@@ -43,6 +44,12 @@ public:
     // Computes the Hamming distance between two ORB descriptors
     static int DescriptorDistance(const cv::Mat &a, const cv::Mat &b);
 
+    // Distances between descriptor a and the nB descriptors stored consecutively in pB.
+    // Each descriptor is given as DESC_WORDS 64 bit words.
+    static void DescriptorDistances(const uint64_t* a, const uint64_t* pB, const int nB, int* pDists);
+
+    static const int DESC_WORDS = 4;
+
     // Search matches between Frame keypoints and projected MapPoints. Returns number of matches
     // Used to track the local map (Tracking)
     int SearchByProjection(Frame &F, const std::vector<MapPoint*> &vpMapPoints, const float th=3);
@@ -79,9 +86,20 @@ public:
     // Project MapPoints into KeyFrame and search for duplicated MapPoints.
     int Fuse(KeyFrame* pKF, const vector<MapPoint *> &vpMapPoints, const float th=3.0);
 
+    // The two phases of Fuse. SearchFuseCandidates only reads the map and stores in vnMatchIdx[i]
+    // the keypoint matched to vpMapPoints[i] (-1 if none), several KeyFrames can be searched in parallel.
+    // FuseCandidates applies the matches, checking them again against the current state of the map.
+    int SearchFuseCandidates(KeyFrame* pKF, const vector<MapPoint *> &vpMapPoints, vector<int> &vnMatchIdx, const float th=3.0);
+    int FuseCandidates(KeyFrame* pKF, const vector<MapPoint *> &vpMapPoints, const vector<int> &vnMatchIdx);
+
     // Project MapPoints into KeyFrame using a given Sim3 and search for duplicated MapPoints.
     int Fuse(KeyFrame* pKF, cv::Mat Scw, const std::vector<MapPoint*> &vpPoints, float th, vector<MapPoint *> &vpReplacePoint);
 
+    // The two phases of the Sim3 Fuse, as above. FuseCandidates adds the new observations and stores in
+    // vpReplacePoint[i] the MapPoint of the KeyFrame that has to be replaced by vpPoints[i].
+    int SearchFuseCandidates(KeyFrame* pKF, cv::Mat Scw, const std::vector<MapPoint*> &vpPoints, float th, vector<int> &vnMatchIdx);
+    int FuseCandidates(KeyFrame* pKF, const std::vector<MapPoint*> &vpPoints, const vector<int> &vnMatchIdx, vector<MapPoint *> &vpReplacePoint);
+
 public:
 
     static const int TH_LOW;
@@ -33,18 +33,53 @@ namespace ORB_SLAM2
 {
 
 class LoopClosing;
+class ThreadPool;
 
 class Optimizer
 {
 public:
+    // Linear solver used inside Levenberg-Marquardt
+    enum eLinearSolver{
+        CHOLESKY=0,
+        PCG=1
+    };
+
+    // Load the linear solver of each optimization from the settings file
+    void static ReadSettings(const string &strSettingPath);
+
+    // The keyframes in vpFixedKF only constrain the optimization, their pose is kept
     void static BundleAdjustment(const std::vector<KeyFrame*> &vpKF, const std::vector<MapPoint*> &vpMP,
                                  int nIterations = 5, bool *pbStopFlag=NULL, const unsigned long nLoopKF=0,
-                                 const bool bRobust = true);
+                                 const bool bRobust = true, const std::vector<KeyFrame*> &vpFixedKF = std::vector<KeyFrame*>());
     void static GlobalBundleAdjustemnt(Map* pMap, int nIterations=5, bool *pbStopFlag=NULL,
                                        const unsigned long nLoopKF=0, const bool bRobust = true);
-    void static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap);
+    // Global BA restricted to the keyframes in vpActiveKFs and their covisible keyframes, with the MapPoints
+    // they see. Keyframes that also see those MapPoints are fixed, the rest of the map is left out.
+    // The whole map is optimized if most keyframes are active.
+    void static IncrementalGlobalBundleAdjustment(Map* pMap, const std::vector<KeyFrame*> &vpActiveKFs, int nIterations=5,
+                                                  bool *pbStopFlag=NULL, const unsigned long nLoopKF=0,
+                                                  const bool bRobust = true);
+    // At most nMaxLocalKFs local keyframes (0 for all), the strongest covisibility links first.
+    // nIterations with the robust kernel, then 2*nIterations without the outliers.
+    void static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap,
+                                      const int nMaxLocalKFs=0, const int nIterations=5);
     int static PoseOptimization(Frame* pFrame);
 
+    // Pose graph over the keyframes, copied from the map so that it can be solved without the map
+    struct EssentialGraph
+    {
+        // Keyframes in the graph (NULL if not) and their pose before the optimization, indexed by id
+        std::vector<KeyFrame*> vpKFs;
+        std::vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vScw;
+        // Poses after the optimization
+        std::vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vCorrectedScw;
+        // Edges (i,j) and their measurement Sji
+        std::vector<std::pair<unsigned long,unsigned long> > vEdges;
+        std::vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vEdgeMeasurements;
+        unsigned long nLoopKFid;
+        bool bFixScale;
+    };
+
     // if bFixScale is true, 6DoF optimization (stereo,rgbd), 7DoF otherwise (mono)
     void static OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* pCurKF,
                                        const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
@@ -52,9 +87,49 @@ public:
                                        const map<KeyFrame *, set<KeyFrame *> > &LoopConnections,
                                        const bool &bFixScale);
 
+    // The three steps of OptimizeEssentialGraph. Build reads the map, which must not change meanwhile.
+    // Solve does not access the map. Apply sets the optimized poses and corrects the MapPoints under the
+    // map update lock, keyframes added after Build follow the correction of their parent.
+    void static BuildEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* pCurKF,
+                                    const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
+                                    const LoopClosing::KeyFrameAndPose &CorrectedSim3,
+                                    const map<KeyFrame *, set<KeyFrame *> > &LoopConnections,
+                                    const bool &bFixScale, EssentialGraph &graph);
+    // Solve dispatches to the hierarchical solver for graphs larger than twice the submap size given in the
+    // settings (Optimizer.EssentialGraph.SubmapSize, 0 disables it, and Optimizer.EssentialGraph.MaxCycles).
+    // The submaps are relaxed in the thread pool if any.
+    void static SolveEssentialGraph(EssentialGraph &graph, ThreadPool* pThreadPool=NULL);
+    void static SolveEssentialGraphFlat(EssentialGraph &graph, const int nIterations=20);
+    // Coarse-to-fine: the keyframes are grouped in connected submaps of nSubmapSize keyframes, a graph between
+    // the submap anchors is optimized and each submap is then relaxed with the neighbouring submaps fixed.
+    // The cycle is repeated until the error converges, at most nMaxCycles times. Returns the cycles run.
+    int static SolveEssentialGraphHierarchical(EssentialGraph &graph, const int nSubmapSize,
+                                               ThreadPool* pThreadPool=NULL, const int nMaxCycles=8);
+    void static ApplyEssentialGraph(Map* pMap, KeyFrame* pCurKF, const EssentialGraph &graph);
+
     // if bFixScale is true, optimize SE3 (stereo,rgbd), Sim3 otherwise (mono)
     static int OptimizeSim3(KeyFrame* pKF1, KeyFrame* pKF2, std::vector<MapPoint *> &vpMatches1,
                             g2o::Sim3 &g2oS12, const float th2, const bool bFixScale);
+
+protected:
+    template<class BlockSolver>
+    static typename BlockSolver::LinearSolverType* CreateLinearSolver(const eLinearSolver eSolver);
+
+    // Workers of the PCG matrix-vector products
+    static ThreadPool& LinearSolverPool();
+
+    // One coarse-to-fine pass of the hierarchical solver starting from the poses vScw
+    void static SolveEssentialGraphCycle(EssentialGraph &graph, const std::vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > &vScw,
+                                         const int nSubmapSize, ThreadPool* pThreadPool);
+    // Sum of the squared residuals of the edges for the poses vScw
+    double static EssentialGraphChi2(const EssentialGraph &graph, const std::vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > &vScw);
+
+    static eLinearSolver meGlobalBASolver;
+    static eLinearSolver meEssentialGraphSolver;
+    static int mnPCGMaxIterations;
+    static double mfPCGTolerance;
+    static int mnEssentialGraphSubmapSize;
+    static int mnEssentialGraphMaxCycles;
 };
 
 } //namespace ORB_SLAM
@@ -52,6 +52,8 @@
 #define PNPSOLVER_H
 
 #include <opencv2/core/core.hpp>
+#include <random>
+#include <Eigen/Core>
 #include "MapPoint.h"
 #include "Frame.h"
 
@@ -71,11 +73,19 @@ class PnPsolver {
 
   cv::Mat iterate(int nIterations, bool &bNoMore, vector<bool> &vbInliers, int &nInliers);
 
+  // Seed of the random generator of RANSAC. Each solver has its own generator,
+  // solvers can run in parallel and the result only depends on the seed.
+  void SetSeed(unsigned long seed);
+
  private:
 
-  void CheckInliers();
+  // Flags the correspondences that are inliers of the pose R|t, returns the number of inliers.
+  int CheckInliers(const double R[3][3], const double t[3], vector<int> &vbInliers);
   bool Refine();
 
+  // P3P pose hypotheses from three correspondences, returns the number of solutions (up to 4).
+  int ComputeMinimalPoses(const int vIndices[3], double Rs[4][3][3], double ts[4][3]);
+
   // Functions from the original EPnP code
   void set_maximum_number_of_correspondences(const int n);
   void reset_correspondences(void);
@@ -93,16 +103,18 @@ class PnPsolver {
 
   void choose_control_points(void);
   void compute_barycentric_coordinates(void);
-  void fill_M(CvMat * M, const int row, const double * alphas, const double u, const double v);
+  void fill_M(double * M1, double * M2, const double * alphas, const double u, const double v);
   void compute_ccs(const double * betas, const double * ut);
   void compute_pcs(void);
 
   void solve_for_sign(void);
 
-  void find_betas_approx_1(const CvMat * L_6x10, const CvMat * Rho, double * betas);
-  void find_betas_approx_2(const CvMat * L_6x10, const CvMat * Rho, double * betas);
-  void find_betas_approx_3(const CvMat * L_6x10, const CvMat * Rho, double * betas);
-  void qr_solve(CvMat * A, CvMat * b, CvMat * X);
+  void find_betas_approx_1(const Eigen::Matrix<double, 6, 10, Eigen::RowMajor> & L_6x10,
+                           const Eigen::Matrix<double, 6, 1> & Rho, double * betas);
+  void find_betas_approx_2(const Eigen::Matrix<double, 6, 10, Eigen::RowMajor> & L_6x10,
+                           const Eigen::Matrix<double, 6, 1> & Rho, double * betas);
+  void find_betas_approx_3(const Eigen::Matrix<double, 6, 10, Eigen::RowMajor> & L_6x10,
+                           const Eigen::Matrix<double, 6, 1> & Rho, double * betas);
 
   double dot(const double * v1, const double * v2);
   double dist2(const double * p1, const double * p2);
@@ -110,9 +122,11 @@ class PnPsolver {
   void compute_rho(double * rho);
   void compute_L_6x10(const double * ut, double * l_6x10);
 
-  void gauss_newton(const CvMat * L_6x10, const CvMat * Rho, double current_betas[4]);
+  void gauss_newton(const Eigen::Matrix<double, 6, 10, Eigen::RowMajor> & L_6x10,
+                    const Eigen::Matrix<double, 6, 1> & Rho, double current_betas[4]);
   void compute_A_and_b_gauss_newton(const double * l_6x10, const double * rho,
-				    double cb[4], CvMat * A, CvMat * b);
+				    double cb[4], Eigen::Matrix<double, 6, 4, Eigen::RowMajor> & A,
+				    Eigen::Matrix<double, 6, 1> & b);
 
   double compute_R_and_t(const double * ut, const double * betas,
 			 double R[3][3], double t[3]);
@@ -136,12 +150,15 @@ class PnPsolver {
 
   vector<MapPoint*> mvpMapPointMatches;
 
-  // 2D Points
-  vector<cv::Point2f> mvP2D;
+  // 2D Points (structure of arrays for the inlier check)
+  vector<float> mvU2D;
+  vector<float> mvV2D;
   vector<float> mvSigma2;
 
   // 3D Points
-  vector<cv::Point3f> mvP3Dw;
+  vector<float> mvX3Dw;
+  vector<float> mvY3Dw;
+  vector<float> mvZ3Dw;
 
   // Index in Frame
   vector<size_t> mvKeyPointIndices;
@@ -150,26 +167,26 @@ class PnPsolver {
   double mRi[3][3];
   double mti[3];
   cv::Mat mTcwi;
-  vector<bool> mvbInliersi;
+  vector<int> mvbInliersi;
   int mnInliersi;
 
+  // Inliers of the P3P solution being checked
+  vector<int> mvbHypothesisInliers;
+
   // Current Ransac State
   int mnIterations;
-  vector<bool> mvbBestInliers;
+  vector<int> mvbBestInliers;
   int mnBestInliers;
   cv::Mat mBestTcw;
 
   // Refined
   cv::Mat mRefinedTcw;
-  vector<bool> mvbRefinedInliers;
+  vector<int> mvbRefinedInliers;
   int mnRefinedInliers;
 
   // Number of Correspondences
   int N;
 
-  // Indices for random selection [0 .. N-1]
-  vector<size_t> mvAllIndices;
-
   // RANSAC probability
   double mRansacProb;
 
@@ -188,6 +205,9 @@ class PnPsolver {
   // RANSAC Minimun Set used at each iteration
   int mRansacMinSet;
 
+  // RANSAC random generator
+  std::mt19937 mRng;
+
   // Max square error associated with scale level. Max error = th*th*sigma(level)*sigma(level)
   vector<float> mvMaxError;
 
@@ -0,0 +1,234 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include<vector>
+#include<atomic>
+#include<mutex>
+#include<condition_variable>
+#include<chrono>
+#include<cstddef>
+
+namespace ORB_SLAM2
+{
+
+// Bounded single-producer/single-consumer ring buffer. Push and Pop never take a lock,
+// the mutex is only used to sleep in Push (queue full) and Wait (queue empty).
+// Consumer operations (Pop, Wait, ForEach, Clear) may be called from another thread while the
+// consumer is parked, if the caller synchronizes the handoff (e.g. LocalMapping stop/release).
+// Items are timestamped when pushed to measure how long they wait in the queue.
+template<typename T>
+class SPSCQueue
+{
+public:
+    struct Stats
+    {
+        unsigned long nPushed;
+        unsigned long nPopped;
+        // Times the producer found the queue full and had to wait
+        unsigned long nFullWaits;
+        size_t nSize;
+        size_t nMaxSize;
+        size_t nCapacity;
+        // Time between Push and Pop in seconds
+        double meanDwell;
+        double maxDwell;
+    };
+
+    // The capacity is rounded up to a power of two
+    SPSCQueue(const size_t nCapacity):mnHead(0),mnTail(0),mnWaiters(0),mnPushed(0),mnPopped(0),mnFullWaits(0),
+        mnMaxSize(0),mnTotalDwell(0),mnMaxDwell(0)
+    {
+        size_t n=1;
+        while(n<nCapacity)
+            n*=2;
+        mvData.resize(n);
+        mvPushTime.resize(n);
+        mnMask = n-1;
+    }
+
+    // Producer. Returns false if the queue is full.
+    bool TryPush(const T &item)
+    {
+        const size_t h = mnHead.load(std::memory_order_relaxed);
+        const size_t t = mnTail.load(std::memory_order_acquire);
+        if(h-t>mnMask)
+            return false;
+
+        mvData[h&mnMask] = item;
+        mvPushTime[h&mnMask] = Now();
+        mnHead.store(h+1,std::memory_order_release);
+
+        mnPushed.fetch_add(1,std::memory_order_relaxed);
+        if(h+1-t>mnMaxSize.load(std::memory_order_relaxed))
+            mnMaxSize.store(h+1-t,std::memory_order_relaxed);
+
+        Notify();
+        return true;
+    }
+
+    // Producer. Waits while the queue is full.
+    void Push(const T &item)
+    {
+        if(TryPush(item))
+            return;
+
+        mnFullWaits.fetch_add(1,std::memory_order_relaxed);
+        while(!TryPush(item))
+            WaitFor([this]{return Size()<=mnMask;},std::chrono::milliseconds(1));
+    }
+
+    // Consumer. Returns false if the queue is empty.
+    bool TryPop(T &item)
+    {
+        const size_t t = mnTail.load(std::memory_order_relaxed);
+        const size_t h = mnHead.load(std::memory_order_acquire);
+        if(t==h)
+            return false;
+
+        item = mvData[t&mnMask];
+        const long long dwell = Now()-mvPushTime[t&mnMask];
+        mvData[t&mnMask] = T();
+        mnTail.store(t+1,std::memory_order_release);
+
+        mnPopped.fetch_add(1,std::memory_order_relaxed);
+        mnTotalDwell.fetch_add(dwell,std::memory_order_relaxed);
+        if(dwell>mnMaxDwell.load(std::memory_order_relaxed))
+            mnMaxDwell.store(dwell,std::memory_order_relaxed);
+
+        Notify();
+        return true;
+    }
+
+    // Consumer. Waits at most timeout for the queue to be non empty. Returns true if it is.
+    template<typename Rep, typename Period>
+    bool Wait(const std::chrono::duration<Rep,Period> &timeout)
+    {
+        return WaitFor([this]{return !Empty();},timeout);
+    }
+
+    // Consumer. Calls f(item) on the queued items, oldest first, without removing them.
+    template<typename F> void ForEach(F f)
+    {
+        const size_t t = mnTail.load(std::memory_order_relaxed);
+        const size_t h = mnHead.load(std::memory_order_acquire);
+        for(size_t i=t; i!=h; i++)
+            f(mvData[i&mnMask]);
+    }
+
+    // Consumer. Drops the queued items.
+    void Clear()
+    {
+        T item;
+        while(TryPop(item));
+    }
+
+    size_t Size() const
+    {
+        const size_t t = mnTail.load(std::memory_order_acquire);
+        const size_t h = mnHead.load(std::memory_order_acquire);
+        return h-t;
+    }
+
+    bool Empty() const
+    {
+        return Size()==0;
+    }
+
+    size_t Capacity() const
+    {
+        return mnMask+1;
+    }
+
+    Stats GetStats() const
+    {
+        Stats stats;
+        stats.nPushed = mnPushed.load(std::memory_order_relaxed);
+        stats.nPopped = mnPopped.load(std::memory_order_relaxed);
+        stats.nFullWaits = mnFullWaits.load(std::memory_order_relaxed);
+        stats.nSize = Size();
+        stats.nMaxSize = mnMaxSize.load(std::memory_order_relaxed);
+        stats.nCapacity = Capacity();
+        stats.meanDwell = stats.nPopped>0 ? 1e-9*mnTotalDwell.load(std::memory_order_relaxed)/stats.nPopped : 0.0;
+        stats.maxDwell = 1e-9*mnMaxDwell.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+protected:
+    static long long Now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Wake up the other side if it sleeps. The fence pairs with the one in WaitFor:
+    // either the sleeper sees the new index or this side sees the sleeper.
+    void Notify()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(mnWaiters.load(std::memory_order_relaxed)>0)
+        {
+            std::unique_lock<std::mutex> lock(mMutexWait);
+            mCondWait.notify_all();
+        }
+    }
+
+    template<typename Predicate, typename Rep, typename Period>
+    bool WaitFor(Predicate pred, const std::chrono::duration<Rep,Period> &timeout)
+    {
+        if(pred())
+            return true;
+
+        std::unique_lock<std::mutex> lock(mMutexWait);
+        mnWaiters.fetch_add(1,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const bool b = mCondWait.wait_for(lock,timeout,pred);
+        mnWaiters.fetch_sub(1,std::memory_order_relaxed);
+        return b;
+    }
+
+    std::vector<T> mvData;
+    std::vector<long long> mvPushTime;
+    size_t mnMask;
+
+    // Written by the producer and by the consumer respectively, kept on separate cache lines
+    char mPad0[64];
+    std::atomic<size_t> mnHead;
+    char mPad1[64];
+    std::atomic<size_t> mnTail;
+    char mPad2[64];
+    std::atomic<int> mnWaiters;
+
+    std::atomic<unsigned long> mnPushed;
+    std::atomic<unsigned long> mnPopped;
+    std::atomic<unsigned long> mnFullWaits;
+    std::atomic<size_t> mnMaxSize;
+    std::atomic<long long> mnTotalDwell;
+    std::atomic<long long> mnMaxDwell;
+
+    std::mutex mMutexWait;
+    std::condition_variable mCondWait;
+};
+
+} //namespace ORB_SLAM
+
+#endif // SPSCQUEUE_H
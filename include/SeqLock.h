@@ -0,0 +1,79 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include<atomic>
+
+namespace ORB_SLAM2
+{
+
+// Sequence lock over N values of type T.
+// Readers never take a lock: they copy the values and retry if a write happened meanwhile.
+// Writers must be serialized by the caller (e.g. holding a mutex).
+template<typename T, int N>
+class SeqLock
+{
+public:
+    SeqLock():mnSeq(0)
+    {
+        for(int i=0; i<N; i++)
+            mData[i].store(T(0),std::memory_order_relaxed);
+    }
+
+    void Write(const T* pData)
+    {
+        const unsigned int seq = mnSeq.load(std::memory_order_relaxed);
+        mnSeq.store(seq+1,std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        for(int i=0; i<N; i++)
+            mData[i].store(pData[i],std::memory_order_relaxed);
+
+        mnSeq.store(seq+2,std::memory_order_release);
+    }
+
+    void Read(T* pData) const
+    {
+        while(true)
+        {
+            const unsigned int seq = mnSeq.load(std::memory_order_acquire);
+            if(seq & 1)
+                continue;
+
+            for(int i=0; i<N; i++)
+                pData[i] = mData[i].load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(mnSeq.load(std::memory_order_relaxed)==seq)
+                return;
+        }
+    }
+
+protected:
+    std::atomic<unsigned int> mnSeq;
+    std::atomic<T> mData[N];
+};
+
+} //namespace ORB_SLAM
+
+#endif // SEQLOCK_H
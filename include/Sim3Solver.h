@@ -24,6 +24,8 @@
 
 #include <opencv2/opencv.hpp>
 #include <vector>
+#include <random>
+#include <Eigen/Core>
 
 #include "KeyFrame.h"
 
@@ -48,18 +50,18 @@ public:
     cv::Mat GetEstimatedTranslation();
     float GetEstimatedScale();
 
+    // Seed of the random generator of RANSAC. Each solver has its own generator,
+    // solvers can run in parallel and the result only depends on the seed.
+    void SetSeed(unsigned long seed);
 
-protected:
 
-    void ComputeCentroid(cv::Mat &P, cv::Mat &Pr, cv::Mat &C);
+protected:
 
-    void ComputeSim3(cv::Mat &P1, cv::Mat &P2);
+    // Points are the columns of P1 and P2
+    void ComputeSim3(const Eigen::Matrix3f &P1, const Eigen::Matrix3f &P2);
 
     void CheckInliers();
 
-    void Project(const std::vector<cv::Mat> &vP3Dw, std::vector<cv::Mat> &vP2D, cv::Mat Tcw, cv::Mat K);
-    void FromCameraToImage(const std::vector<cv::Mat> &vP3Dc, std::vector<cv::Mat> &vP2D, cv::Mat K);
-
 
 protected:
 
@@ -67,32 +69,36 @@ protected:
     KeyFrame* mpKF1;
     KeyFrame* mpKF2;
 
-    std::vector<cv::Mat> mvX3Dc1;
-    std::vector<cv::Mat> mvX3Dc2;
+    // 3D points in the camera frames (structure of arrays for the inlier check)
+    std::vector<float> mvX3Dc1, mvY3Dc1, mvZ3Dc1;
+    std::vector<float> mvX3Dc2, mvY3Dc2, mvZ3Dc2;
     std::vector<MapPoint*> mvpMapPoints1;
     std::vector<MapPoint*> mvpMapPoints2;
     std::vector<MapPoint*> mvpMatches12;
     std::vector<size_t> mvnIndices1;
-    std::vector<size_t> mvSigmaSquare1;
-    std::vector<size_t> mvSigmaSquare2;
-    std::vector<size_t> mvnMaxError1;
-    std::vector<size_t> mvnMaxError2;
+    std::vector<float> mvnMaxError1;
+    std::vector<float> mvnMaxError2;
 
     int N;
     int mN1;
 
     // Current Estimation
-    cv::Mat mR12i;
-    cv::Mat mt12i;
+    Eigen::Matrix3f mR12i;
+    Eigen::Vector3f mt12i;
     float ms12i;
-    cv::Mat mT12i;
-    cv::Mat mT21i;
-    std::vector<bool> mvbInliersi;
+    Eigen::Matrix3f msR12i;
+    Eigen::Matrix3f msR21i;
+    Eigen::Vector3f mt21i;
+    std::vector<int> mvbInliersi;
     int mnInliersi;
 
+    // Squared reprojection errors of the current estimation in KF1 and KF2
+    std::vector<float> mvErr1;
+    std::vector<float> mvErr2;
+
     // Current Ransac State
     int mnIterations;
-    std::vector<bool> mvbBestInliers;
+    std::vector<int> mvbBestInliers;
     int mnBestInliers;
     cv::Mat mBestT12;
     cv::Mat mBestRotation;
@@ -102,12 +108,9 @@ protected:
     // Scale is fixed to 1 in the stereo/RGBD case
     bool mbFixScale;
 
-    // Indices for random selection
-    std::vector<size_t> mvAllIndices;
-
     // Projections
-    std::vector<cv::Mat> mvP1im1;
-    std::vector<cv::Mat> mvP2im2;
+    std::vector<float> mvU1im1, mvV1im1;
+    std::vector<float> mvU2im2, mvV2im2;
 
     // RANSAC probability
     double mRansacProb;
@@ -118,13 +121,16 @@ protected:
     // RANSAC max iterations
     int mRansacMaxIts;
 
+    // RANSAC random generator
+    std::mt19937 mRng;
+
     // Threshold inlier/outlier. e = dist(Pi,T_ij*Pj)^2 < 5.991*mSigma2
     float mTh;
     float mSigma2;
 
     // Calibration
-    cv::Mat mK1;
-    cv::Mat mK2;
+    float mfx1, mfy1, mcx1, mcy1;
+    float mfx2, mfy2, mcx2, mcy2;
 
 };
 
@@ -0,0 +1,120 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SLABALLOCATOR_H
+#define SLABALLOCATOR_H
+
+#include<vector>
+#include<mutex>
+#include<new>
+#include<cstddef>
+#include<type_traits>
+
+namespace ORB_SLAM2
+{
+
+// Fixed-size object allocator used by the class operator new/delete of KeyFrame and MapPoint.
+// Objects are carved from slabs of N consecutive slots, so objects created together
+// (e.g. the points triangulated from one keyframe) are contiguous in memory.
+// Freed slots are recycled through a free list, slabs are released on destruction.
+template<typename T, size_t N=1024>
+class SlabAllocator
+{
+public:
+    SlabAllocator():mpFreeList(NULL),mnAllocated(0){}
+
+    ~SlabAllocator()
+    {
+        for(typename std::vector<Slot*>::iterator vit=mvpSlabs.begin(), vend=mvpSlabs.end(); vit!=vend; vit++)
+            delete [] *vit;
+    }
+
+    void* Allocate(size_t nSize)
+    {
+        // Derived classes do not fit in a slot
+        if(nSize!=sizeof(T))
+            return ::operator new(nSize);
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        if(!mpFreeList)
+        {
+            Slot* pSlab = new Slot[N];
+            for(size_t i=0; i<N-1; i++)
+                pSlab[i].pNext = &pSlab[i+1];
+            pSlab[N-1].pNext = NULL;
+            mpFreeList = pSlab;
+            mvpSlabs.push_back(pSlab);
+        }
+
+        Slot* pSlot = mpFreeList;
+        mpFreeList = pSlot->pNext;
+        mnAllocated++;
+        return pSlot;
+    }
+
+    void Deallocate(void* p, size_t nSize)
+    {
+        if(!p)
+            return;
+
+        if(nSize!=sizeof(T))
+        {
+            ::operator delete(p);
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(mMutex);
+        Slot* pSlot = static_cast<Slot*>(p);
+        pSlot->pNext = mpFreeList;
+        mpFreeList = pSlot;
+        mnAllocated--;
+    }
+
+    // Number of live objects
+    size_t Allocated()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        return mnAllocated;
+    }
+
+    // Number of slots reserved in slabs (live + free)
+    size_t Capacity()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        return mvpSlabs.size()*N;
+    }
+
+protected:
+    union Slot
+    {
+        Slot* pNext;
+        typename std::aligned_storage<sizeof(T),alignof(T)>::type storage;
+    };
+
+    std::vector<Slot*> mvpSlabs;
+    Slot* mpFreeList;
+    size_t mnAllocated;
+
+    std::mutex mMutex;
+};
+
+} //namespace ORB_SLAM
+
+#endif // SLABALLOCATOR_H
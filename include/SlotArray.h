@@ -0,0 +1,172 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SLOTARRAY_H
+#define SLOTARRAY_H
+
+#include<vector>
+#include<atomic>
+#include<cstddef>
+#include<cassert>
+
+namespace ORB_SLAM2
+{
+
+// Array of object pointers with stable slots, used by the Map to store its KeyFrames and MapPoints.
+// Insert returns the slot of the object, which does not change until the object is erased.
+// Erased slots are recycled through a free list. Storage grows in chunks that are never moved,
+// so readers iterate a Span without locking while a writer inserts and erases.
+// Writers (Insert, Erase, Clear) must be serialized by the caller.
+template<typename T, size_t CHUNK_SIZE=4096, size_t MAX_CHUNKS=4096>
+class SlotArray
+{
+public:
+    SlotArray():mnSize(0),mnCount(0)
+    {
+        for(size_t i=0; i<MAX_CHUNKS; i++)
+            mvpChunks[i] = NULL;
+    }
+
+    ~SlotArray()
+    {
+        for(size_t i=0; i<MAX_CHUNKS; i++)
+            delete [] mvpChunks[i];
+    }
+
+    size_t Insert(T* p)
+    {
+        size_t nSlot;
+        if(!mvnFreeSlots.empty())
+        {
+            nSlot = mvnFreeSlots.back();
+            mvnFreeSlots.pop_back();
+        }
+        else
+        {
+            nSlot = mnSize.load(std::memory_order_relaxed);
+            const size_t nChunk = nSlot/CHUNK_SIZE;
+            assert(nChunk<MAX_CHUNKS);
+            if(!mvpChunks[nChunk])
+            {
+                std::atomic<T*>* pChunk = new std::atomic<T*>[CHUNK_SIZE];
+                for(size_t i=0; i<CHUNK_SIZE; i++)
+                    pChunk[i].store(NULL,std::memory_order_relaxed);
+                mvpChunks[nChunk] = pChunk;
+            }
+        }
+
+        At(nSlot).store(p,std::memory_order_release);
+        if(nSlot>=mnSize.load(std::memory_order_relaxed))
+            mnSize.store(nSlot+1,std::memory_order_release);
+        mnCount++;
+        return nSlot;
+    }
+
+    void Erase(const size_t nSlot)
+    {
+        At(nSlot).store(NULL,std::memory_order_release);
+        mvnFreeSlots.push_back(nSlot);
+        mnCount--;
+    }
+
+    void Clear()
+    {
+        const size_t n = mnSize.load(std::memory_order_relaxed);
+        for(size_t i=0; i<n; i++)
+            At(i).store(NULL,std::memory_order_relaxed);
+        mnSize.store(0,std::memory_order_release);
+        mvnFreeSlots.clear();
+        mnCount = 0;
+    }
+
+    // Number of objects (same thread or lock as the writer)
+    size_t Count() const {return mnCount;}
+
+    // Object in a slot, NULL if the slot is free
+    T* Get(const size_t nSlot) const
+    {
+        return At(nSlot).load(std::memory_order_acquire);
+    }
+
+    // Objects in the slots used when the span was taken, free slots are skipped.
+    // An object erased while iterating might still be returned.
+    class Span
+    {
+    public:
+        class const_iterator
+        {
+        public:
+            const_iterator(const SlotArray* pArray, const size_t nSlot, const size_t nEnd):
+                mpArray(pArray),mnSlot(nSlot),mnEnd(nEnd),mpCurrent(NULL){Skip();}
+
+            T* operator*() const {return mpCurrent;}
+            const_iterator& operator++(){mnSlot++; Skip(); return *this;}
+            bool operator==(const const_iterator &other) const {return mnSlot==other.mnSlot;}
+            bool operator!=(const const_iterator &other) const {return mnSlot!=other.mnSlot;}
+
+        protected:
+            void Skip()
+            {
+                for(; mnSlot<mnEnd; mnSlot++)
+                {
+                    mpCurrent = mpArray->Get(mnSlot);
+                    if(mpCurrent)
+                        return;
+                }
+            }
+
+            const SlotArray* mpArray;
+            size_t mnSlot;
+            size_t mnEnd;
+            T* mpCurrent;
+        };
+
+        Span(const SlotArray* pArray, const size_t nSize):mpArray(pArray),mnSize(nSize){}
+
+        const_iterator begin() const {return const_iterator(mpArray,0,mnSize);}
+        const_iterator end() const {return const_iterator(mpArray,mnSize,mnSize);}
+
+    protected:
+        const SlotArray* mpArray;
+        size_t mnSize;
+    };
+
+    Span GetSpan() const
+    {
+        return Span(this,mnSize.load(std::memory_order_acquire));
+    }
+
+protected:
+    std::atomic<T*>& At(const size_t nSlot) const
+    {
+        return mvpChunks[nSlot/CHUNK_SIZE][nSlot%CHUNK_SIZE];
+    }
+
+    std::atomic<T*>* mvpChunks[MAX_CHUNKS];
+
+    // One past the highest slot ever used (free slots included)
+    std::atomic<size_t> mnSize;
+
+    std::vector<size_t> mvnFreeSlots;
+    size_t mnCount;
+};
+
+} //namespace ORB_SLAM
+
+#endif // SLOTARRAY_H
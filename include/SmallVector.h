@@ -0,0 +1,134 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SMALLVECTOR_H
+#define SMALLVECTOR_H
+
+#include<cstddef>
+#include<algorithm>
+
+namespace ORB_SLAM2
+{
+
+// Vector with inline storage for the first N elements, heap memory is only used beyond N.
+// Intended for small collections of plain values (e.g. the observations of a MapPoint).
+template<typename T, int N>
+class SmallVector
+{
+public:
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    SmallVector():mpData(mInline),mnSize(0),mnCapacity(N){}
+
+    SmallVector(const SmallVector &other):mpData(mInline),mnSize(0),mnCapacity(N)
+    {
+        reserve(other.mnSize);
+        std::copy(other.begin(),other.end(),mpData);
+        mnSize = other.mnSize;
+    }
+
+    SmallVector& operator=(const SmallVector &other)
+    {
+        if(this!=&other)
+        {
+            mnSize = 0;
+            reserve(other.mnSize);
+            std::copy(other.begin(),other.end(),mpData);
+            mnSize = other.mnSize;
+        }
+        return *this;
+    }
+
+    ~SmallVector()
+    {
+        if(mpData!=mInline)
+            delete [] mpData;
+    }
+
+    iterator begin(){return mpData;}
+    iterator end(){return mpData+mnSize;}
+    const_iterator begin() const {return mpData;}
+    const_iterator end() const {return mpData+mnSize;}
+
+    size_t size() const {return mnSize;}
+    bool empty() const {return mnSize==0;}
+    void clear(){mnSize=0;}
+
+    T& operator[](size_t i){return mpData[i];}
+    const T& operator[](size_t i) const {return mpData[i];}
+    T& front(){return mpData[0];}
+    const T& front() const {return mpData[0];}
+
+    void reserve(size_t n)
+    {
+        if(n<=mnCapacity)
+            return;
+        T* pData = new T[n];
+        std::copy(mpData,mpData+mnSize,pData);
+        if(mpData!=mInline)
+            delete [] mpData;
+        mpData = pData;
+        mnCapacity = n;
+    }
+
+    void push_back(const T &value)
+    {
+        if(mnSize==mnCapacity)
+            reserve(2*mnCapacity);
+        mpData[mnSize++] = value;
+    }
+
+    iterator insert(iterator pos, const T &value)
+    {
+        const size_t i = pos-mpData;
+        if(mnSize==mnCapacity)
+            reserve(2*mnCapacity);
+        std::copy_backward(mpData+i,mpData+mnSize,mpData+mnSize+1);
+        mpData[i] = value;
+        mnSize++;
+        return mpData+i;
+    }
+
+    void pop_back(){mnSize--;}
+
+    void resize(size_t n)
+    {
+        reserve(n);
+        mnSize = n;
+    }
+
+    iterator erase(iterator pos)
+    {
+        std::copy(pos+1,mpData+mnSize,pos);
+        mnSize--;
+        return pos;
+    }
+
+protected:
+    T mInline[N];
+    T* mpData;
+    size_t mnSize;
+    size_t mnCapacity;
+};
+
+} //namespace ORB_SLAM
+
+#endif // SMALLVECTOR_H
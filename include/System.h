@@ -118,6 +118,7 @@ public:
 
     // Information from most recent processed frame
     // You can call this right after TrackMonocular (or stereo or RGBD)
+    // Bad MapPoints are deleted (see Map::Reclaim), the returned pointers are only valid until the next call to Track.
     int GetTrackingState();
     std::vector<MapPoint*> GetTrackedMapPoints();
     std::vector<cv::KeyPoint> GetTrackedKeyPointsUn();
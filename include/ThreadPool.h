@@ -0,0 +1,72 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include<vector>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<functional>
+#include<atomic>
+
+namespace ORB_SLAM2
+{
+
+// Fixed set of worker threads running parallel loops. The calling thread takes part in the loop.
+// Calls from several threads are serialized, a task must not call ParallelFor on the same pool.
+class ThreadPool
+{
+public:
+    // nThreads is the total number of threads running a loop (calling thread included),
+    // 0 uses the number of hardware threads
+    ThreadPool(const int nThreads=0);
+    ~ThreadPool();
+
+    // Call f(i) for every i in [0,n). Returns when all calls are done.
+    void ParallelFor(const int n, const std::function<void(int)> &f);
+
+    int Size();
+
+protected:
+    void Run();
+    void Work(const std::function<void(int)> &f, const int n);
+
+    std::vector<std::thread> mvThreads;
+
+    // Current loop
+    const std::function<void(int)>* mpTask;
+    int mnTaskSize;
+    std::atomic<int> mnNextIdx;
+    unsigned long mnGeneration;
+    int mnActive;
+    bool mbFinish;
+
+    std::mutex mMutex;
+    std::condition_variable mCondWork;
+    std::condition_variable mCondDone;
+
+    std::mutex mMutexCall;
+};
+
+} //namespace ORB_SLAM
+
+#endif // THREADPOOL_H
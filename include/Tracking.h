@@ -37,6 +37,7 @@
 #include "Initializer.h"
 #include "MapDrawer.h"
 #include "System.h"
+#include "ThreadPool.h"
 
 #include <mutex>
 
@@ -115,6 +116,9 @@ public:
 
     void Reset();
 
+    // Average time spent updating the local map and how often it was reused
+    void PrintLocalMapStats();
+
 protected:
 
     // Main tracking function. It is independent of the input sensor.
@@ -128,6 +132,9 @@ protected:
     void CreateInitialMapMonocular();
 
     void CheckReplacedInLastFrame();
+
+    // Drop the references to bad MapPoints and KeyFrames and signal a quiescent state to the map
+    void DiscardBadMapPoints();
     bool TrackReferenceKeyFrame();
     void UpdateLastFrame();
     bool TrackWithMotionModel();
@@ -136,11 +143,16 @@ protected:
 
     void UpdateLocalMap();
     void UpdateLocalPoints();
-    void UpdateLocalKeyFrames();
+    // Returns false if the local keyframes are the same as in the last frame
+    bool UpdateLocalKeyFrames();
 
     bool TrackLocalMap();
     void SearchLocalPoints();
 
+    // Pose optimization of the current frame against one consistent state of the map.
+    // Returns the number of inliers.
+    int OptimizePose();
+
     bool NeedNewKeyFrame();
     void CreateNewKeyFrame();
 
@@ -169,6 +181,17 @@ protected:
     KeyFrame* mpReferenceKF;
     std::vector<KeyFrame*> mvpLocalKeyFrames;
     std::vector<MapPoint*> mvpLocalMapPoints;
+
+    // The local map is rebuilt only if the keyframes voted by the tracked points
+    // or one of the local keyframes (see KeyFrame::GetChangeIdx) changed since the last frame
+    std::vector<KeyFrame*> mvpLastVotedKeyFrames;
+    std::vector<unsigned long> mvnLocalKeyFrameChangeIdx;
+    bool mbLocalMapFromIndex;
+
+    // Local map update statistics
+    double mfLocalMapTime;
+    int mnLocalMapUpdates;
+    int mnLocalMapReused;
     
     // System
     System* mpSystem;
@@ -180,6 +203,7 @@ protected:
 
     //Map
     Map* mpMap;
+    int mnMapParticipant;
 
     //Calibration matrix
     cv::Mat mK;
@@ -210,6 +234,13 @@ protected:
     //Motion Model
     cv::Mat mVelocity;
 
+    // Pose of the reference keyframe in the map state of the last pose optimization
+    KeyFrame* mpPoseRefKF;
+    cv::Mat mTwrPose;
+
+    // Workers for the relocalization candidates
+    ThreadPool mThreadPool;
+
     //Color order (true RGB, false BGR, ignored if grayscale)
     bool mbRGB;
 
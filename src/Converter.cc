@@ -123,6 +123,14 @@ Eigen::Matrix<double,3,1> Converter::toVector3d(const cv::Point3f &cvPoint)
     return v;
 }
 
+Eigen::Matrix<double,3,1> Converter::toVector3d(const cv::Vec3f &cvVector)
+{
+    Eigen::Matrix<double,3,1> v;
+    v << cvVector(0), cvVector(1), cvVector(2);
+
+    return v;
+}
+
 Eigen::Matrix<double,3,3> Converter::toMatrix3d(const cv::Mat &cvMat3)
 {
     Eigen::Matrix<double,3,3> M;
@@ -264,6 +264,10 @@ void Frame::UpdatePoseMatrices()
     mRwc = mRcw.t();
     mtcw = mTcw.rowRange(0,3).col(3);
     mOw = -mRcw.t()*mtcw;
+
+    mRcw33f = mRcw;
+    mtcw3f = mtcw;
+    mOw3f = mOw;
 }
 
 bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit)
@@ -271,13 +275,13 @@ bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit)
     pMP->mbTrackInView = false;
 
     // 3D in absolute coordinates
-    cv::Mat P = pMP->GetWorldPos(); 
+    const cv::Vec3f P = pMP->GetWorldPos3f();
 
     // 3D in camera coordinates
-    const cv::Mat Pc = mRcw*P+mtcw;
-    const float &PcX = Pc.at<float>(0);
-    const float &PcY= Pc.at<float>(1);
-    const float &PcZ = Pc.at<float>(2);
+    const cv::Vec3f Pc = mRcw33f*P+mtcw3f;
+    const float &PcX = Pc(0);
+    const float &PcY= Pc(1);
+    const float &PcZ = Pc(2);
 
     // Check positive depth
     if(PcZ<0.0f)
@@ -296,14 +300,14 @@ bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit)
     // Check distance is in the scale invariance region of the MapPoint
     const float maxDistance = pMP->GetMaxDistanceInvariance();
     const float minDistance = pMP->GetMinDistanceInvariance();
-    const cv::Mat PO = P-mOw;
+    const cv::Vec3f PO = P-mOw3f;
     const float dist = cv::norm(PO);
 
     if(dist<minDistance || dist>maxDistance)
         return false;
 
    // Check viewing angle
-    cv::Mat Pn = pMP->GetNormal();
+    const cv::Vec3f Pn = pMP->GetNormal3f();
 
     const float viewCos = PO.dot(Pn)/dist;
 
@@ -324,6 +328,149 @@ bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit)
     return true;
 }
 
+// Layout of the arrays of AreInFrustum, each array holds one value per MapPoint
+enum eFrustumInput{
+    FRUSTUM_IN_X=0, FRUSTUM_IN_Y, FRUSTUM_IN_Z,
+    FRUSTUM_IN_NX, FRUSTUM_IN_NY, FRUSTUM_IN_NZ,
+    FRUSTUM_IN_MIN_DIST, FRUSTUM_IN_MAX_DIST,
+    FRUSTUM_IN_SIZE
+};
+
+enum eFrustumOutput{
+    FRUSTUM_OUT_U=0, FRUSTUM_OUT_V, FRUSTUM_OUT_INVZ,
+    FRUSTUM_OUT_DIST2, FRUSTUM_OUT_DOT,
+    FRUSTUM_OUT_SIZE
+};
+
+struct FrustumParams
+{
+    float R[9], t[3], O[3];
+    float fx, fy, cx, cy;
+    float minX, maxX, minY, maxY;
+    float viewingCosLimit;
+};
+
+// Projection and visibility test of n points. There are no branches and no sqrt (distances
+// are compared squared) and the arrays do not alias, so the compiler vectorizes the loop.
+static void ProjectInFrustum(const int n, const FrustumParams &p, const float* __restrict pIn, float* __restrict pOut, int* __restrict pbInView)
+{
+    const float r00=p.R[0], r01=p.R[1], r02=p.R[2];
+    const float r10=p.R[3], r11=p.R[4], r12=p.R[5];
+    const float r20=p.R[6], r21=p.R[7], r22=p.R[8];
+    const float t0=p.t[0], t1=p.t[1], t2=p.t[2];
+    const float Ox=p.O[0], Oy=p.O[1], Oz=p.O[2];
+    const float fx=p.fx, fy=p.fy, cx=p.cx, cy=p.cy;
+    const float minX=p.minX, maxX=p.maxX, minY=p.minY, maxY=p.maxY;
+
+    // viewCos>=limit, i.e. dot>=limit*dist, without the square root
+    const float limit2 = p.viewingCosLimit*p.viewingCosLimit;
+    const int bPositiveLimit = p.viewingCosLimit>=0;
+
+    for(int i=0; i<n; i++)
+    {
+        const float X = pIn[FRUSTUM_IN_X*n+i];
+        const float Y = pIn[FRUSTUM_IN_Y*n+i];
+        const float Z = pIn[FRUSTUM_IN_Z*n+i];
+
+        const float PcX = r00*X+r01*Y+r02*Z+t0;
+        const float PcY = r10*X+r11*Y+r12*Z+t1;
+        const float PcZ = r20*X+r21*Y+r22*Z+t2;
+        const float invz = 1.0f/PcZ;
+        const float u = fx*PcX*invz+cx;
+        const float v = fy*PcY*invz+cy;
+
+        const float POx = X-Ox, POy = Y-Oy, POz = Z-Oz;
+        const float dist2 = POx*POx+POy*POy+POz*POz;
+        const float dot = POx*pIn[FRUSTUM_IN_NX*n+i]+POy*pIn[FRUSTUM_IN_NY*n+i]+POz*pIn[FRUSTUM_IN_NZ*n+i];
+        const float minDist = 0.8f*pIn[FRUSTUM_IN_MIN_DIST*n+i];
+        const float maxDist = 1.2f*pIn[FRUSTUM_IN_MAX_DIST*n+i];
+
+        const int bViewAngle = (bPositiveLimit & (dot>=0.0f) & (dot*dot>=limit2*dist2)) |
+                               ((1-bPositiveLimit) & ((dot>=0.0f) | (dot*dot<=limit2*dist2)));
+
+        pOut[FRUSTUM_OUT_U*n+i] = u;
+        pOut[FRUSTUM_OUT_V*n+i] = v;
+        pOut[FRUSTUM_OUT_INVZ*n+i] = invz;
+        pOut[FRUSTUM_OUT_DIST2*n+i] = dist2;
+        pOut[FRUSTUM_OUT_DOT*n+i] = dot;
+        pbInView[i] = (PcZ>=0.0f) & (u>=minX) & (u<=maxX) & (v>=minY) & (v<=maxY) &
+                      (dist2>=minDist*minDist) & (dist2<=maxDist*maxDist) & bViewAngle;
+    }
+}
+
+int Frame::AreInFrustum(const vector<MapPoint*> &vpMPs, float viewingCosLimit)
+{
+    const int n = vpMPs.size();
+    if(n==0)
+        return 0;
+
+    // Gather the geometry of the points
+    vector<float> vIn(FRUSTUM_IN_SIZE*n);
+    for(int i=0; i<n; i++)
+    {
+        cv::Vec3f P, Pn;
+        float minDistance, maxDistance;
+        vpMPs[i]->GetGeometry(P,Pn,minDistance,maxDistance);
+        vIn[FRUSTUM_IN_X*n+i] = P(0);
+        vIn[FRUSTUM_IN_Y*n+i] = P(1);
+        vIn[FRUSTUM_IN_Z*n+i] = P(2);
+        vIn[FRUSTUM_IN_NX*n+i] = Pn(0);
+        vIn[FRUSTUM_IN_NY*n+i] = Pn(1);
+        vIn[FRUSTUM_IN_NZ*n+i] = Pn(2);
+        vIn[FRUSTUM_IN_MIN_DIST*n+i] = minDistance;
+        vIn[FRUSTUM_IN_MAX_DIST*n+i] = maxDistance;
+    }
+
+    FrustumParams params;
+    for(int r=0; r<3; r++)
+    {
+        for(int c=0; c<3; c++)
+            params.R[3*r+c] = mRcw33f(r,c);
+        params.t[r] = mtcw3f(r);
+        params.O[r] = mOw3f(r);
+    }
+    params.fx = fx;
+    params.fy = fy;
+    params.cx = cx;
+    params.cy = cy;
+    params.minX = mnMinX;
+    params.maxX = mnMaxX;
+    params.minY = mnMinY;
+    params.maxY = mnMaxY;
+    params.viewingCosLimit = viewingCosLimit;
+
+    vector<float> vOut(FRUSTUM_OUT_SIZE*n);
+    vector<int> vbInView(n);
+    ProjectInFrustum(n,params,&vIn[0],&vOut[0],&vbInView[0]);
+
+    // Write back the data used by the tracking. The predicted scale is the number of scale
+    // factors below maxDistance/dist (same as MapPoint::PredictScale without the log)
+    int nInView = 0;
+    for(int i=0; i<n; i++)
+    {
+        MapPoint* pMP = vpMPs[i];
+        pMP->mbTrackInView = vbInView[i];
+        if(!vbInView[i])
+            continue;
+
+        const float dist = sqrt(vOut[FRUSTUM_OUT_DIST2*n+i]);
+        const float ratio = vIn[FRUSTUM_IN_MAX_DIST*n+i]/dist;
+        int nPredictedLevel = 0;
+        for(int l=0; l<mnScaleLevels-1; l++)
+            nPredictedLevel += mvScaleFactors[l]<ratio;
+
+        const float u = vOut[FRUSTUM_OUT_U*n+i];
+        pMP->mTrackProjX = u;
+        pMP->mTrackProjXR = u - mbf*vOut[FRUSTUM_OUT_INVZ*n+i];
+        pMP->mTrackProjY = vOut[FRUSTUM_OUT_V*n+i];
+        pMP->mnTrackScaleLevel= nPredictedLevel;
+        pMP->mTrackViewCos = vOut[FRUSTUM_OUT_DOT*n+i]/dist;
+        nInView++;
+    }
+
+    return nInView;
+}
+
 vector<size_t> Frame::GetFeaturesInArea(const float &x, const float  &y, const float  &r, const int minLevel, const int maxLevel) const
 {
     vector<size_t> vIndices;
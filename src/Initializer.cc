@@ -26,10 +26,94 @@
 #include "ORBmatcher.h"
 
 #include<thread>
+#include<Eigen/Dense>
 
 namespace ORB_SLAM2
 {
 
+// Hypotheses are scored by blocks of matches. After each block the scoring stops if
+// the hypothesis cannot beat the best score even with all remaining matches inliers.
+static const int SCORE_BLOCK = 64;
+
+// Symmetric transfer error of the homography for n matches. Writes the score of each
+// match and whether it is an inlier. No branches, so that the loop is vectorized.
+static void HomographyScores(const int n, const float* __restrict u1, const float* __restrict v1,
+                             const float* __restrict u2, const float* __restrict v2,
+                             const float H21[9], const float H12[9], const float th, const float invSigmaSquare,
+                             float* __restrict scores, int* __restrict vbInliers)
+{
+    const float h11 = H21[0], h12 = H21[1], h13 = H21[2];
+    const float h21 = H21[3], h22 = H21[4], h23 = H21[5];
+    const float h31 = H21[6], h32 = H21[7], h33 = H21[8];
+
+    const float h11inv = H12[0], h12inv = H12[1], h13inv = H12[2];
+    const float h21inv = H12[3], h22inv = H12[4], h23inv = H12[5];
+    const float h31inv = H12[6], h32inv = H12[7], h33inv = H12[8];
+
+    for(int i=0; i<n; i++)
+    {
+        // Reprojection error in first image
+        // x2in1 = H12*x2
+        const float w2in1inv = 1.0f/(h31inv*u2[i]+h32inv*v2[i]+h33inv);
+        const float u2in1 = (h11inv*u2[i]+h12inv*v2[i]+h13inv)*w2in1inv;
+        const float v2in1 = (h21inv*u2[i]+h22inv*v2[i]+h23inv)*w2in1inv;
+
+        const float chiSquare1 = ((u1[i]-u2in1)*(u1[i]-u2in1)+(v1[i]-v2in1)*(v1[i]-v2in1))*invSigmaSquare;
+
+        // Reprojection error in second image
+        // x1in2 = H21*x1
+        const float w1in2inv = 1.0f/(h31*u1[i]+h32*v1[i]+h33);
+        const float u1in2 = (h11*u1[i]+h12*v1[i]+h13)*w1in2inv;
+        const float v1in2 = (h21*u1[i]+h22*v1[i]+h23)*w1in2inv;
+
+        const float chiSquare2 = ((u2[i]-u1in2)*(u2[i]-u1in2)+(v2[i]-v1in2)*(v2[i]-v1in2))*invSigmaSquare;
+
+        scores[i] = max(0.0f,th-chiSquare1)+max(0.0f,th-chiSquare2);
+        vbInliers[i] = (chiSquare1<=th) & (chiSquare2<=th);
+    }
+}
+
+// Distance to the epipolar lines of the fundamental matrix for n matches. Writes the score
+// of each match and whether it is an inlier. No branches, so that the loop is vectorized.
+static void FundamentalScores(const int n, const float* __restrict u1, const float* __restrict v1,
+                              const float* __restrict u2, const float* __restrict v2,
+                              const float F21[9], const float th, const float thScore, const float invSigmaSquare,
+                              float* __restrict scores, int* __restrict vbInliers)
+{
+    const float f11 = F21[0], f12 = F21[1], f13 = F21[2];
+    const float f21 = F21[3], f22 = F21[4], f23 = F21[5];
+    const float f31 = F21[6], f32 = F21[7], f33 = F21[8];
+
+    for(int i=0; i<n; i++)
+    {
+        // Reprojection error in second image
+        // l2=F21x1=(a2,b2,c2)
+        const float a2 = f11*u1[i]+f12*v1[i]+f13;
+        const float b2 = f21*u1[i]+f22*v1[i]+f23;
+        const float c2 = f31*u1[i]+f32*v1[i]+f33;
+
+        const float num2 = a2*u2[i]+b2*v2[i]+c2;
+
+        const float chiSquare1 = num2*num2/(a2*a2+b2*b2)*invSigmaSquare;
+
+        // Reprojection error in first image
+        // l1 =x2tF21=(a1,b1,c1)
+        const float a1 = f11*u2[i]+f21*v2[i]+f31;
+        const float b1 = f12*u2[i]+f22*v2[i]+f32;
+        const float c1 = f13*u2[i]+f23*v2[i]+f33;
+
+        const float num1 = a1*u1[i]+b1*v1[i]+c1;
+
+        const float chiSquare2 = num1*num1/(a1*a1+b1*b1)*invSigmaSquare;
+
+        const int bIn1 = chiSquare1<=th;
+        const int bIn2 = chiSquare2<=th;
+
+        scores[i] = (bIn1 ? thScore-chiSquare1 : 0.0f)+(bIn2 ? thScore-chiSquare2 : 0.0f);
+        vbInliers[i] = bIn1 & bIn2;
+    }
+}
+
 Initializer::Initializer(const Frame &ReferenceFrame, float sigma, int iterations)
 {
     mK = ReferenceFrame.mK.clone();
@@ -64,6 +148,20 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
 
     const int N = mvMatches12.size();
 
+    mvMatchesU1.resize(N);
+    mvMatchesV1.resize(N);
+    mvMatchesU2.resize(N);
+    mvMatchesV2.resize(N);
+    for(int i=0; i<N; i++)
+    {
+        const cv::KeyPoint &kp1 = mvKeys1[mvMatches12[i].first];
+        const cv::KeyPoint &kp2 = mvKeys2[mvMatches12[i].second];
+        mvMatchesU1[i] = kp1.pt.x;
+        mvMatchesV1[i] = kp1.pt.y;
+        mvMatchesU2[i] = kp2.pt.x;
+        mvMatchesV2[i] = kp2.pt.y;
+    }
+
     // Indices for minimum set selection
     vector<size_t> vAllIndices;
     vAllIndices.reserve(N);
@@ -131,17 +229,18 @@ void Initializer::FindHomography(vector<bool> &vbMatchesInliers, float &score, c
     cv::Mat T1, T2;
     Normalize(mvKeys1,vPn1, T1);
     Normalize(mvKeys2,vPn2, T2);
-    cv::Mat T2inv = T2.inv();
+    const Eigen::Matrix3f eT1 = Eigen::Map<const Eigen::Matrix<float,3,3,Eigen::RowMajor> >(T1.ptr<float>());
+    const Eigen::Matrix3f eT2inv = Eigen::Map<const Eigen::Matrix<float,3,3,Eigen::RowMajor> >(T2.ptr<float>()).inverse();
 
     // Best Results variables
     score = 0.0;
-    vbMatchesInliers = vector<bool>(N,false);
+    Eigen::Matrix3f bestH21;
+    vector<int> vbBestInliers(N,false);
 
     // Iteration variables
-    vector<cv::Point2f> vPn1i(8);
-    vector<cv::Point2f> vPn2i(8);
-    cv::Mat H21i, H12i;
-    vector<bool> vbCurrentInliers(N,false);
+    Eigen::Matrix<float,2,8> Pn1i, Pn2i;
+    Eigen::Matrix3f H21i, H12i;
+    vector<int> vbCurrentInliers(N,false);
     float currentScore;
 
     // Perform all RANSAC iterations and save the solution with highest score
@@ -152,47 +251,57 @@ void Initializer::FindHomography(vector<bool> &vbMatchesInliers, float &score, c
         {
             int idx = mvSets[it][j];
 
-            vPn1i[j] = vPn1[mvMatches12[idx].first];
-            vPn2i[j] = vPn2[mvMatches12[idx].second];
+            const cv::Point2f &pn1 = vPn1[mvMatches12[idx].first];
+            const cv::Point2f &pn2 = vPn2[mvMatches12[idx].second];
+            Pn1i.col(j) << pn1.x, pn1.y;
+            Pn2i.col(j) << pn2.x, pn2.y;
         }
 
-        cv::Mat Hn = ComputeH21(vPn1i,vPn2i);
-        H21i = T2inv*Hn*T1;
-        H12i = H21i.inv();
+        const Eigen::Matrix3f Hn = ComputeH21(Pn1i,Pn2i);
+        H21i = eT2inv*Hn*eT1;
+        H12i = H21i.inverse();
 
-        currentScore = CheckHomography(H21i, H12i, vbCurrentInliers, mSigma);
+        currentScore = CheckHomography(H21i, H12i, vbCurrentInliers, mSigma, score);
 
         if(currentScore>score)
         {
-            H21 = H21i.clone();
-            vbMatchesInliers = vbCurrentInliers;
+            bestH21 = H21i;
+            vbBestInliers.swap(vbCurrentInliers);
             score = currentScore;
         }
     }
+
+    vbMatchesInliers = vector<bool>(vbBestInliers.begin(),vbBestInliers.end());
+    if(score>0)
+    {
+        H21.create(3,3,CV_32F);
+        Eigen::Map<Eigen::Matrix<float,3,3,Eigen::RowMajor> >(H21.ptr<float>()) = bestH21;
+    }
 }
 
 
 void Initializer::FindFundamental(vector<bool> &vbMatchesInliers, float &score, cv::Mat &F21)
 {
     // Number of putative matches
-    const int N = vbMatchesInliers.size();
+    const int N = mvMatches12.size();
 
     // Normalize coordinates
     vector<cv::Point2f> vPn1, vPn2;
     cv::Mat T1, T2;
     Normalize(mvKeys1,vPn1, T1);
     Normalize(mvKeys2,vPn2, T2);
-    cv::Mat T2t = T2.t();
+    const Eigen::Matrix3f eT1 = Eigen::Map<const Eigen::Matrix<float,3,3,Eigen::RowMajor> >(T1.ptr<float>());
+    const Eigen::Matrix3f eT2t = Eigen::Map<const Eigen::Matrix<float,3,3,Eigen::RowMajor> >(T2.ptr<float>()).transpose();
 
     // Best Results variables
     score = 0.0;
-    vbMatchesInliers = vector<bool>(N,false);
+    Eigen::Matrix3f bestF21;
+    vector<int> vbBestInliers(N,false);
 
     // Iteration variables
-    vector<cv::Point2f> vPn1i(8);
-    vector<cv::Point2f> vPn2i(8);
-    cv::Mat F21i;
-    vector<bool> vbCurrentInliers(N,false);
+    Eigen::Matrix<float,2,8> Pn1i, Pn2i;
+    Eigen::Matrix3f F21i;
+    vector<int> vbCurrentInliers(N,false);
     float currentScore;
 
     // Perform all RANSAC iterations and save the solution with highest score
@@ -203,128 +312,107 @@ void Initializer::FindFundamental(vector<bool> &vbMatchesInliers, float &score,
         {
             int idx = mvSets[it][j];
 
-            vPn1i[j] = vPn1[mvMatches12[idx].first];
-            vPn2i[j] = vPn2[mvMatches12[idx].second];
+            const cv::Point2f &pn1 = vPn1[mvMatches12[idx].first];
+            const cv::Point2f &pn2 = vPn2[mvMatches12[idx].second];
+            Pn1i.col(j) << pn1.x, pn1.y;
+            Pn2i.col(j) << pn2.x, pn2.y;
         }
 
-        cv::Mat Fn = ComputeF21(vPn1i,vPn2i);
+        const Eigen::Matrix3f Fn = ComputeF21(Pn1i,Pn2i);
 
-        F21i = T2t*Fn*T1;
+        F21i = eT2t*Fn*eT1;
 
-        currentScore = CheckFundamental(F21i, vbCurrentInliers, mSigma);
+        currentScore = CheckFundamental(F21i, vbCurrentInliers, mSigma, score);
 
         if(currentScore>score)
         {
-            F21 = F21i.clone();
-            vbMatchesInliers = vbCurrentInliers;
+            bestF21 = F21i;
+            vbBestInliers.swap(vbCurrentInliers);
             score = currentScore;
         }
     }
+
+    vbMatchesInliers = vector<bool>(vbBestInliers.begin(),vbBestInliers.end());
+    if(score>0)
+    {
+        F21.create(3,3,CV_32F);
+        Eigen::Map<Eigen::Matrix<float,3,3,Eigen::RowMajor> >(F21.ptr<float>()) = bestF21;
+    }
 }
 
 
-cv::Mat Initializer::ComputeH21(const vector<cv::Point2f> &vP1, const vector<cv::Point2f> &vP2)
+Eigen::Matrix3f Initializer::ComputeH21(const Eigen::Matrix<float,2,8> &P1, const Eigen::Matrix<float,2,8> &P2)
 {
-    const int N = vP1.size();
-
-    cv::Mat A(2*N,9,CV_32F);
+    // The solution is the eigenvector of AtA with the smallest eigenvalue,
+    // i.e. the right singular vector of A with the smallest singular value
+    Eigen::Matrix<double,9,9> AtA = Eigen::Matrix<double,9,9>::Zero();
+    Eigen::Matrix<double,9,1> a1, a2;
 
-    for(int i=0; i<N; i++)
+    for(int i=0; i<8; i++)
     {
-        const float u1 = vP1[i].x;
-        const float v1 = vP1[i].y;
-        const float u2 = vP2[i].x;
-        const float v2 = vP2[i].y;
-
-        A.at<float>(2*i,0) = 0.0;
-        A.at<float>(2*i,1) = 0.0;
-        A.at<float>(2*i,2) = 0.0;
-        A.at<float>(2*i,3) = -u1;
-        A.at<float>(2*i,4) = -v1;
-        A.at<float>(2*i,5) = -1;
-        A.at<float>(2*i,6) = v2*u1;
-        A.at<float>(2*i,7) = v2*v1;
-        A.at<float>(2*i,8) = v2;
-
-        A.at<float>(2*i+1,0) = u1;
-        A.at<float>(2*i+1,1) = v1;
-        A.at<float>(2*i+1,2) = 1;
-        A.at<float>(2*i+1,3) = 0.0;
-        A.at<float>(2*i+1,4) = 0.0;
-        A.at<float>(2*i+1,5) = 0.0;
-        A.at<float>(2*i+1,6) = -u2*u1;
-        A.at<float>(2*i+1,7) = -u2*v1;
-        A.at<float>(2*i+1,8) = -u2;
+        const double u1 = P1(0,i);
+        const double v1 = P1(1,i);
+        const double u2 = P2(0,i);
+        const double v2 = P2(1,i);
 
-    }
+        a1 << 0.0, 0.0, 0.0, -u1, -v1, -1.0, v2*u1, v2*v1, v2;
+        a2 << u1, v1, 1.0, 0.0, 0.0, 0.0, -u2*u1, -u2*v1, -u2;
 
-    cv::Mat u,w,vt;
+        AtA.noalias() += a1*a1.transpose();
+        AtA.noalias() += a2*a2.transpose();
+    }
 
-    cv::SVDecomp(A,w,u,vt,cv::SVD::MODIFY_A | cv::SVD::FULL_UV);
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double,9,9> > es(AtA);
+    const Eigen::Matrix<double,9,1> h = es.eigenvectors().col(0);
 
-    return vt.row(8).reshape(0, 3);
+    Eigen::Matrix3f H;
+    H << h(0), h(1), h(2),
+         h(3), h(4), h(5),
+         h(6), h(7), h(8);
+    return H;
 }
 
-cv::Mat Initializer::ComputeF21(const vector<cv::Point2f> &vP1,const vector<cv::Point2f> &vP2)
+Eigen::Matrix3f Initializer::ComputeF21(const Eigen::Matrix<float,2,8> &P1, const Eigen::Matrix<float,2,8> &P2)
 {
-    const int N = vP1.size();
-
-    cv::Mat A(N,9,CV_32F);
+    Eigen::Matrix<double,9,9> AtA = Eigen::Matrix<double,9,9>::Zero();
+    Eigen::Matrix<double,9,1> a;
 
-    for(int i=0; i<N; i++)
+    for(int i=0; i<8; i++)
     {
-        const float u1 = vP1[i].x;
-        const float v1 = vP1[i].y;
-        const float u2 = vP2[i].x;
-        const float v2 = vP2[i].y;
-
-        A.at<float>(i,0) = u2*u1;
-        A.at<float>(i,1) = u2*v1;
-        A.at<float>(i,2) = u2;
-        A.at<float>(i,3) = v2*u1;
-        A.at<float>(i,4) = v2*v1;
-        A.at<float>(i,5) = v2;
-        A.at<float>(i,6) = u1;
-        A.at<float>(i,7) = v1;
-        A.at<float>(i,8) = 1;
-    }
+        const double u1 = P1(0,i);
+        const double v1 = P1(1,i);
+        const double u2 = P2(0,i);
+        const double v2 = P2(1,i);
 
-    cv::Mat u,w,vt;
+        a << u2*u1, u2*v1, u2, v2*u1, v2*v1, v2, u1, v1, 1.0;
 
-    cv::SVDecomp(A,w,u,vt,cv::SVD::MODIFY_A | cv::SVD::FULL_UV);
+        AtA.noalias() += a*a.transpose();
+    }
 
-    cv::Mat Fpre = vt.row(8).reshape(0, 3);
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double,9,9> > es(AtA);
+    const Eigen::Matrix<double,9,1> f = es.eigenvectors().col(0);
 
-    cv::SVDecomp(Fpre,w,u,vt,cv::SVD::MODIFY_A | cv::SVD::FULL_UV);
+    Eigen::Matrix3d Fpre;
+    Fpre << f(0), f(1), f(2),
+            f(3), f(4), f(5),
+            f(6), f(7), f(8);
 
-    w.at<float>(2)=0;
+    // Enforce rank 2
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(Fpre, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Eigen::Vector3d w = svd.singularValues();
+    w(2) = 0;
 
-    return  u*cv::Mat::diag(w)*vt;
+    return (svd.matrixU()*w.asDiagonal()*svd.matrixV().transpose()).cast<float>();
 }
 
-float Initializer::CheckHomography(const cv::Mat &H21, const cv::Mat &H12, vector<bool> &vbMatchesInliers, float sigma)
+float Initializer::CheckHomography(const Eigen::Matrix3f &H21, const Eigen::Matrix3f &H12, vector<int> &vbMatchesInliers,
+                                   float sigma, float bestScore)
 {   
     const int N = mvMatches12.size();
 
-    const float h11 = H21.at<float>(0,0);
-    const float h12 = H21.at<float>(0,1);
-    const float h13 = H21.at<float>(0,2);
-    const float h21 = H21.at<float>(1,0);
-    const float h22 = H21.at<float>(1,1);
-    const float h23 = H21.at<float>(1,2);
-    const float h31 = H21.at<float>(2,0);
-    const float h32 = H21.at<float>(2,1);
-    const float h33 = H21.at<float>(2,2);
-
-    const float h11inv = H12.at<float>(0,0);
-    const float h12inv = H12.at<float>(0,1);
-    const float h13inv = H12.at<float>(0,2);
-    const float h21inv = H12.at<float>(1,0);
-    const float h22inv = H12.at<float>(1,1);
-    const float h23inv = H12.at<float>(1,2);
-    const float h31inv = H12.at<float>(2,0);
-    const float h32inv = H12.at<float>(2,1);
-    const float h33inv = H12.at<float>(2,2);
+    float h21[9], h12[9];
+    Eigen::Map<Eigen::Matrix<float,3,3,Eigen::RowMajor> >(h21) = H21;
+    Eigen::Map<Eigen::Matrix<float,3,3,Eigen::RowMajor> >(h12) = H12;
 
     vbMatchesInliers.resize(N);
 
@@ -334,72 +422,32 @@ float Initializer::CheckHomography(const cv::Mat &H21, const cv::Mat &H12, vecto
 
     const float invSigmaSquare = 1.0/(sigma*sigma);
 
-    for(int i=0; i<N; i++)
-    {
-        bool bIn = true;
-
-        const cv::KeyPoint &kp1 = mvKeys1[mvMatches12[i].first];
-        const cv::KeyPoint &kp2 = mvKeys2[mvMatches12[i].second];
-
-        const float u1 = kp1.pt.x;
-        const float v1 = kp1.pt.y;
-        const float u2 = kp2.pt.x;
-        const float v2 = kp2.pt.y;
+    float vScores[SCORE_BLOCK];
 
-        // Reprojection error in first image
-        // x2in1 = H12*x2
-
-        const float w2in1inv = 1.0/(h31inv*u2+h32inv*v2+h33inv);
-        const float u2in1 = (h11inv*u2+h12inv*v2+h13inv)*w2in1inv;
-        const float v2in1 = (h21inv*u2+h22inv*v2+h23inv)*w2in1inv;
-
-        const float squareDist1 = (u1-u2in1)*(u1-u2in1)+(v1-v2in1)*(v1-v2in1);
-
-        const float chiSquare1 = squareDist1*invSigmaSquare;
-
-        if(chiSquare1>th)
-            bIn = false;
-        else
-            score += th - chiSquare1;
-
-        // Reprojection error in second image
-        // x1in2 = H21*x1
-
-        const float w1in2inv = 1.0/(h31*u1+h32*v1+h33);
-        const float u1in2 = (h11*u1+h12*v1+h13)*w1in2inv;
-        const float v1in2 = (h21*u1+h22*v1+h23)*w1in2inv;
-
-        const float squareDist2 = (u2-u1in2)*(u2-u1in2)+(v2-v1in2)*(v2-v1in2);
+    for(int i0=0; i0<N; i0+=SCORE_BLOCK)
+    {
+        const int n = min(SCORE_BLOCK,N-i0);
 
-        const float chiSquare2 = squareDist2*invSigmaSquare;
+        HomographyScores(n,&mvMatchesU1[i0],&mvMatchesV1[i0],&mvMatchesU2[i0],&mvMatchesV2[i0],
+                         h21,h12,th,invSigmaSquare,vScores,&vbMatchesInliers[i0]);
 
-        if(chiSquare2>th)
-            bIn = false;
-        else
-            score += th - chiSquare2;
+        for(int i=0; i<n; i++)
+            score += vScores[i];
 
-        if(bIn)
-            vbMatchesInliers[i]=true;
-        else
-            vbMatchesInliers[i]=false;
+        // Each remaining match adds at most 2*th
+        if(score+2*th*(N-i0-n)<=bestScore)
+            break;
     }
 
     return score;
 }
 
-float Initializer::CheckFundamental(const cv::Mat &F21, vector<bool> &vbMatchesInliers, float sigma)
+float Initializer::CheckFundamental(const Eigen::Matrix3f &F21, vector<int> &vbMatchesInliers, float sigma, float bestScore)
 {
     const int N = mvMatches12.size();
 
-    const float f11 = F21.at<float>(0,0);
-    const float f12 = F21.at<float>(0,1);
-    const float f13 = F21.at<float>(0,2);
-    const float f21 = F21.at<float>(1,0);
-    const float f22 = F21.at<float>(1,1);
-    const float f23 = F21.at<float>(1,2);
-    const float f31 = F21.at<float>(2,0);
-    const float f32 = F21.at<float>(2,1);
-    const float f33 = F21.at<float>(2,2);
+    float f21[9];
+    Eigen::Map<Eigen::Matrix<float,3,3,Eigen::RowMajor> >(f21) = F21;
 
     vbMatchesInliers.resize(N);
 
@@ -410,58 +458,21 @@ float Initializer::CheckFundamental(const cv::Mat &F21, vector<bool> &vbMatchesI
 
     const float invSigmaSquare = 1.0/(sigma*sigma);
 
-    for(int i=0; i<N; i++)
-    {
-        bool bIn = true;
-
-        const cv::KeyPoint &kp1 = mvKeys1[mvMatches12[i].first];
-        const cv::KeyPoint &kp2 = mvKeys2[mvMatches12[i].second];
-
-        const float u1 = kp1.pt.x;
-        const float v1 = kp1.pt.y;
-        const float u2 = kp2.pt.x;
-        const float v2 = kp2.pt.y;
-
-        // Reprojection error in second image
-        // l2=F21x1=(a2,b2,c2)
-
-        const float a2 = f11*u1+f12*v1+f13;
-        const float b2 = f21*u1+f22*v1+f23;
-        const float c2 = f31*u1+f32*v1+f33;
-
-        const float num2 = a2*u2+b2*v2+c2;
+    float vScores[SCORE_BLOCK];
 
-        const float squareDist1 = num2*num2/(a2*a2+b2*b2);
-
-        const float chiSquare1 = squareDist1*invSigmaSquare;
-
-        if(chiSquare1>th)
-            bIn = false;
-        else
-            score += thScore - chiSquare1;
-
-        // Reprojection error in second image
-        // l1 =x2tF21=(a1,b1,c1)
-
-        const float a1 = f11*u2+f21*v2+f31;
-        const float b1 = f12*u2+f22*v2+f32;
-        const float c1 = f13*u2+f23*v2+f33;
-
-        const float num1 = a1*u1+b1*v1+c1;
-
-        const float squareDist2 = num1*num1/(a1*a1+b1*b1);
+    for(int i0=0; i0<N; i0+=SCORE_BLOCK)
+    {
+        const int n = min(SCORE_BLOCK,N-i0);
 
-        const float chiSquare2 = squareDist2*invSigmaSquare;
+        FundamentalScores(n,&mvMatchesU1[i0],&mvMatchesV1[i0],&mvMatchesU2[i0],&mvMatchesV2[i0],
+                          f21,th,thScore,invSigmaSquare,vScores,&vbMatchesInliers[i0]);
 
-        if(chiSquare2>th)
-            bIn = false;
-        else
-            score += thScore - chiSquare2;
+        for(int i=0; i<n; i++)
+            score += vScores[i];
 
-        if(bIn)
-            vbMatchesInliers[i]=true;
-        else
-            vbMatchesInliers[i]=false;
+        // Each remaining match adds at most 2*thScore
+        if(score+2*thScore*(N-i0-n)<=bestScore)
+            break;
     }
 
     return score;
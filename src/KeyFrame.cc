@@ -31,7 +31,7 @@ long unsigned int KeyFrame::nNextId=0;
 KeyFrame::KeyFrame(Frame &F, Map *pMap, KeyFrameDatabase *pKFDB):
     mnFrameId(F.mnId),  mTimeStamp(F.mTimeStamp), mnGridCols(FRAME_GRID_COLS), mnGridRows(FRAME_GRID_ROWS),
     mfGridElementWidthInv(F.mfGridElementWidthInv), mfGridElementHeightInv(F.mfGridElementHeightInv),
-    mnTrackReferenceForFrame(0), mnFuseTargetForKF(0), mnBALocalForKF(0), mnBAFixedForKF(0),
+    mnMapIdx(-1), mnTrackReferenceForFrame(0), mnFuseTargetForKF(0), mnBALocalForKF(0), mnBAFixedForKF(0),
     mnLoopQuery(0), mnLoopWords(0), mnRelocQuery(0), mnRelocWords(0), mnBAGlobalForKF(0),
     fx(F.fx), fy(F.fy), cx(F.cx), cy(F.cy), invfx(F.invfx), invfy(F.invfy),
     mbf(F.mbf), mb(F.mb), mThDepth(F.mThDepth), N(F.N), mvKeys(F.mvKeys), mvKeysUn(F.mvKeysUn),
@@ -40,8 +40,8 @@ KeyFrame::KeyFrame(Frame &F, Map *pMap, KeyFrameDatabase *pKFDB):
     mfLogScaleFactor(F.mfLogScaleFactor), mvScaleFactors(F.mvScaleFactors), mvLevelSigma2(F.mvLevelSigma2),
     mvInvLevelSigma2(F.mvInvLevelSigma2), mnMinX(F.mnMinX), mnMinY(F.mnMinY), mnMaxX(F.mnMaxX),
     mnMaxY(F.mnMaxY), mK(F.mK), mvpMapPoints(F.mvpMapPoints), mpKeyFrameDB(pKFDB),
-    mpORBvocabulary(F.mpORBvocabulary), mbFirstConnection(true), mpParent(NULL), mbNotErase(false),
-    mbToBeErased(false), mbBad(false), mHalfBaseline(F.mb/2), mpMap(pMap)
+    mpORBvocabulary(F.mpORBvocabulary), mbConnectionsDirty(false), mbFirstConnection(true), mpParent(NULL), mbNotErase(false),
+    mbToBeErased(false), mbBad(false), mnChangeIdx(0), mHalfBaseline(F.mb/2), mpMap(pMap)
 {
     mnId=nNextId++;
 
@@ -56,6 +56,22 @@ KeyFrame::KeyFrame(Frame &F, Map *pMap, KeyFrameDatabase *pKFDB):
     SetPose(F.mTcw);    
 }
 
+void* KeyFrame::operator new(size_t nSize)
+{
+    return GetAllocator().Allocate(nSize);
+}
+
+void KeyFrame::operator delete(void* p, size_t nSize)
+{
+    GetAllocator().Deallocate(p,nSize);
+}
+
+SlabAllocator<KeyFrame>& KeyFrame::GetAllocator()
+{
+    static SlabAllocator<KeyFrame> allocator;
+    return allocator;
+}
+
 void KeyFrame::ComputeBoW()
 {
     if(mBowVec.empty() || mFeatVec.empty())
@@ -70,90 +86,185 @@ void KeyFrame::ComputeBoW()
 void KeyFrame::SetPose(const cv::Mat &Tcw_)
 {
     unique_lock<mutex> lock(mMutexPose);
-    Tcw_.copyTo(Tcw);
-    cv::Mat Rcw = Tcw.rowRange(0,3).colRange(0,3);
-    cv::Mat tcw = Tcw.rowRange(0,3).col(3);
-    cv::Mat Rwc = Rcw.t();
-    Ow = -Rwc*tcw;
-
-    Twc = cv::Mat::eye(4,4,Tcw.type());
-    Rwc.copyTo(Twc.rowRange(0,3).colRange(0,3));
-    Ow.copyTo(Twc.rowRange(0,3).col(3));
-    cv::Mat center = (cv::Mat_<float>(4,1) << mHalfBaseline, 0 , 0, 1);
-    Cw = Twc*center;
+    const cv::Matx33f Rcw = Tcw_.rowRange(0,3).colRange(0,3);
+    const cv::Vec3f tcw = Tcw_.rowRange(0,3).col(3);
+    const cv::Matx33f Rwc = Rcw.t();
+    const cv::Vec3f Ow = -(Rwc*tcw);
+    const cv::Vec3f Cw = Rwc*cv::Vec3f(mHalfBaseline,0,0)+Ow;
+
+    float data[POSE_DATA_SIZE];
+    for(int i=0; i<3; i++)
+    {
+        for(int j=0; j<3; j++)
+            data[POSE_DATA_TCW+4*i+j] = Rcw(i,j);
+        data[POSE_DATA_TCW+4*i+3] = tcw(i);
+        data[POSE_DATA_OW+i] = Ow(i);
+        data[POSE_DATA_CW+i] = Cw(i);
+    }
+    mPoseData.Write(data);
 }
 
 cv::Mat KeyFrame::GetPose()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Tcw.clone();
+    return cv::Mat(GetPose44f());
 }
 
 cv::Mat KeyFrame::GetPoseInverse()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Twc.clone();
+    return cv::Mat(GetPoseInverse44f());
 }
 
 cv::Mat KeyFrame::GetCameraCenter()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Ow.clone();
+    return cv::Mat(GetCameraCenter3f());
 }
 
 cv::Mat KeyFrame::GetStereoCenter()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Cw.clone();
+    float data[POSE_DATA_SIZE];
+    mPoseData.Read(data);
+    return (cv::Mat_<float>(3,1) << data[POSE_DATA_CW], data[POSE_DATA_CW+1], data[POSE_DATA_CW+2]);
 }
 
 
 cv::Mat KeyFrame::GetRotation()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Tcw.rowRange(0,3).colRange(0,3).clone();
+    return cv::Mat(GetRotation33f());
 }
 
 cv::Mat KeyFrame::GetTranslation()
 {
-    unique_lock<mutex> lock(mMutexPose);
-    return Tcw.rowRange(0,3).col(3).clone();
+    return cv::Mat(GetTranslation3f());
+}
+
+cv::Matx44f KeyFrame::GetPose44f()
+{
+    float data[POSE_DATA_SIZE];
+    mPoseData.Read(data);
+    const float* T = data+POSE_DATA_TCW;
+    return cv::Matx44f(T[0], T[1], T[2],  T[3],
+                       T[4], T[5], T[6],  T[7],
+                       T[8], T[9], T[10], T[11],
+                       0,    0,    0,     1);
+}
+
+cv::Matx44f KeyFrame::GetPoseInverse44f()
+{
+    float data[POSE_DATA_SIZE];
+    mPoseData.Read(data);
+    const float* T = data+POSE_DATA_TCW;
+    const float* O = data+POSE_DATA_OW;
+    return cv::Matx44f(T[0], T[4], T[8],  O[0],
+                       T[1], T[5], T[9],  O[1],
+                       T[2], T[6], T[10], O[2],
+                       0,    0,    0,     1);
+}
+
+cv::Matx33f KeyFrame::GetRotation33f()
+{
+    float data[POSE_DATA_SIZE];
+    mPoseData.Read(data);
+    const float* T = data+POSE_DATA_TCW;
+    return cv::Matx33f(T[0], T[1], T[2],
+                       T[4], T[5], T[6],
+                       T[8], T[9], T[10]);
+}
+
+cv::Vec3f KeyFrame::GetTranslation3f()
+{
+    float data[POSE_DATA_SIZE];
+    mPoseData.Read(data);
+    const float* T = data+POSE_DATA_TCW;
+    return cv::Vec3f(T[3],T[7],T[11]);
+}
+
+cv::Vec3f KeyFrame::GetCameraCenter3f()
+{
+    float data[POSE_DATA_SIZE];
+    mPoseData.Read(data);
+    return cv::Vec3f(data[POSE_DATA_OW],data[POSE_DATA_OW+1],data[POSE_DATA_OW+2]);
 }
 
 void KeyFrame::AddConnection(KeyFrame *pKF, const int &weight)
 {
-    {
-        unique_lock<mutex> lock(mMutexConnections);
-        if(!mConnectedKeyFrameWeights.count(pKF))
-            mConnectedKeyFrameWeights[pKF]=weight;
-        else if(mConnectedKeyFrameWeights[pKF]!=weight)
-            mConnectedKeyFrameWeights[pKF]=weight;
-        else
-            return;
-    }
+    unique_lock<mutex> lock(mMutexConnections);
+    if(mConnectedKeyFrameWeights.count(pKF) && mConnectedKeyFrameWeights[pKF]==weight)
+        return;
+    mConnectedKeyFrameWeights[pKF]=weight;
+    SetConnectionsDirty();
+}
+
+void KeyFrame::UpdateWeight(KeyFrame *pKF, const int &nDelta)
+{
+    unique_lock<mutex> lock(mMutexConnections);
+    if(mbBad || pKF==this)
+        return;
 
-    UpdateBestCovisibles();
+    // Increments and decrements coming from different MapPoints may arrive in any order,
+    // the weight is only removed when it gets back to 0
+    int &w = mConnectedKeyFrameWeights[pKF];
+    w += nDelta;
+    if(w==0)
+        mConnectedKeyFrameWeights.erase(pKF);
+    SetConnectionsDirty();
 }
 
 void KeyFrame::UpdateBestCovisibles()
 {
     unique_lock<mutex> lock(mMutexConnections);
+    SetConnectionsDirty();
+    SortConnections();
+}
+
+void KeyFrame::SetConnectionsDirty()
+{
+    // The change is published once, until the ordered lists are read again
+    if(!mbConnectionsDirty)
+    {
+        mbConnectionsDirty = true;
+        mnChangeIdx++;
+    }
+}
+
+void KeyFrame::SortConnections()
+{
+    if(!mbConnectionsDirty)
+        return;
+
+    //If the counter is greater than threshold add connection
+    //In case no keyframe counter is over threshold add the one with maximum counter
+    int nmax=0;
+    KeyFrame* pKFmax=NULL;
+    const int th = 15;
+
     vector<pair<int,KeyFrame*> > vPairs;
     vPairs.reserve(mConnectedKeyFrameWeights.size());
     for(map<KeyFrame*,int>::iterator mit=mConnectedKeyFrameWeights.begin(), mend=mConnectedKeyFrameWeights.end(); mit!=mend; mit++)
-       vPairs.push_back(make_pair(mit->second,mit->first));
+    {
+        if(mit->second>nmax)
+        {
+            nmax=mit->second;
+            pKFmax=mit->first;
+        }
+        if(mit->second>=th)
+            vPairs.push_back(make_pair(mit->second,mit->first));
+    }
+
+    if(vPairs.empty() && pKFmax)
+        vPairs.push_back(make_pair(nmax,pKFmax));
 
     sort(vPairs.begin(),vPairs.end());
-    list<KeyFrame*> lKFs;
-    list<int> lWs;
-    for(size_t i=0, iend=vPairs.size(); i<iend;i++)
+
+    const size_t n = vPairs.size();
+    mvpOrderedConnectedKeyFrames.resize(n);
+    mvOrderedWeights.resize(n);
+    for(size_t i=0; i<n; i++)
     {
-        lKFs.push_front(vPairs[i].second);
-        lWs.push_front(vPairs[i].first);
+        mvpOrderedConnectedKeyFrames[n-1-i] = vPairs[i].second;
+        mvOrderedWeights[n-1-i] = vPairs[i].first;
     }
 
-    mvpOrderedConnectedKeyFrames = vector<KeyFrame*>(lKFs.begin(),lKFs.end());
-    mvOrderedWeights = vector<int>(lWs.begin(), lWs.end());    
+    mbConnectionsDirty = false;
 }
 
 set<KeyFrame*> KeyFrame::GetConnectedKeyFrames()
@@ -161,19 +272,22 @@ set<KeyFrame*> KeyFrame::GetConnectedKeyFrames()
     unique_lock<mutex> lock(mMutexConnections);
     set<KeyFrame*> s;
     for(map<KeyFrame*,int>::iterator mit=mConnectedKeyFrameWeights.begin();mit!=mConnectedKeyFrameWeights.end();mit++)
-        s.insert(mit->first);
+        if(mit->second>0)
+            s.insert(mit->first);
     return s;
 }
 
 vector<KeyFrame*> KeyFrame::GetVectorCovisibleKeyFrames()
 {
     unique_lock<mutex> lock(mMutexConnections);
+    SortConnections();
     return mvpOrderedConnectedKeyFrames;
 }
 
 vector<KeyFrame*> KeyFrame::GetBestCovisibilityKeyFrames(const int &N)
 {
     unique_lock<mutex> lock(mMutexConnections);
+    SortConnections();
     if((int)mvpOrderedConnectedKeyFrames.size()<N)
         return mvpOrderedConnectedKeyFrames;
     else
@@ -184,6 +298,7 @@ vector<KeyFrame*> KeyFrame::GetBestCovisibilityKeyFrames(const int &N)
 vector<KeyFrame*> KeyFrame::GetCovisiblesByWeight(const int &w)
 {
     unique_lock<mutex> lock(mMutexConnections);
+    SortConnections();
 
     if(mvpOrderedConnectedKeyFrames.empty())
         return vector<KeyFrame*>();
@@ -201,8 +316,9 @@ vector<KeyFrame*> KeyFrame::GetCovisiblesByWeight(const int &w)
 int KeyFrame::GetWeight(KeyFrame *pKF)
 {
     unique_lock<mutex> lock(mMutexConnections);
-    if(mConnectedKeyFrameWeights.count(pKF))
-        return mConnectedKeyFrameWeights[pKF];
+    map<KeyFrame*,int>::const_iterator mit = mConnectedKeyFrameWeights.find(pKF);
+    if(mit!=mConnectedKeyFrameWeights.end() && mit->second>0)
+        return mit->second;
     else
         return 0;
 }
@@ -210,26 +326,38 @@ int KeyFrame::GetWeight(KeyFrame *pKF)
 void KeyFrame::AddMapPoint(MapPoint *pMP, const size_t &idx)
 {
     unique_lock<mutex> lock(mMutexFeatures);
+    // A bad MapPoint will be reclaimed, it must not be linked again
+    if(pMP && pMP->isBad())
+        pMP = static_cast<MapPoint*>(NULL);
     mvpMapPoints[idx]=pMP;
+    mnChangeIdx++;
 }
 
 void KeyFrame::EraseMapPointMatch(const size_t &idx)
 {
     unique_lock<mutex> lock(mMutexFeatures);
     mvpMapPoints[idx]=static_cast<MapPoint*>(NULL);
+    mnChangeIdx++;
 }
 
 void KeyFrame::EraseMapPointMatch(MapPoint* pMP)
 {
     int idx = pMP->GetIndexInKeyFrame(this);
     if(idx>=0)
+    {
         mvpMapPoints[idx]=static_cast<MapPoint*>(NULL);
+        mnChangeIdx++;
+    }
 }
 
 
 void KeyFrame::ReplaceMapPointMatch(const size_t &idx, MapPoint* pMP)
 {
+    unique_lock<mutex> lock(mMutexFeatures);
+    if(pMP && pMP->isBad())
+        pMP = static_cast<MapPoint*>(NULL);
     mvpMapPoints[idx]=pMP;
+    mnChangeIdx++;
 }
 
 set<MapPoint*> KeyFrame::GetMapPoints()
@@ -288,93 +416,15 @@ MapPoint* KeyFrame::GetMapPoint(const size_t &idx)
 
 void KeyFrame::UpdateConnections()
 {
-    map<KeyFrame*,int> KFcounter;
-
-    vector<MapPoint*> vpMP;
-
-    {
-        unique_lock<mutex> lockMPs(mMutexFeatures);
-        vpMP = mvpMapPoints;
-    }
-
-    //For all map points in keyframe check in which other keyframes are they seen
-    //Increase counter for those keyframes
-    for(vector<MapPoint*>::iterator vit=vpMP.begin(), vend=vpMP.end(); vit!=vend; vit++)
-    {
-        MapPoint* pMP = *vit;
-
-        if(!pMP)
-            continue;
-
-        if(pMP->isBad())
-            continue;
-
-        map<KeyFrame*,size_t> observations = pMP->GetObservations();
-
-        for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
-        {
-            if(mit->first->mnId==mnId)
-                continue;
-            KFcounter[mit->first]++;
-        }
-    }
-
-    // This should not happen
-    if(KFcounter.empty())
-        return;
-
-    //If the counter is greater than threshold add connection
-    //In case no keyframe counter is over threshold add the one with maximum counter
-    int nmax=0;
-    KeyFrame* pKFmax=NULL;
-    int th = 15;
-
-    vector<pair<int,KeyFrame*> > vPairs;
-    vPairs.reserve(KFcounter.size());
-    for(map<KeyFrame*,int>::iterator mit=KFcounter.begin(), mend=KFcounter.end(); mit!=mend; mit++)
-    {
-        if(mit->second>nmax)
-        {
-            nmax=mit->second;
-            pKFmax=mit->first;
-        }
-        if(mit->second>=th)
-        {
-            vPairs.push_back(make_pair(mit->second,mit->first));
-            (mit->first)->AddConnection(this,mit->second);
-        }
-    }
-
-    if(vPairs.empty())
-    {
-        vPairs.push_back(make_pair(nmax,pKFmax));
-        pKFmax->AddConnection(this,nmax);
-    }
+    // The weights are already up to date, sort the neighbors and link to the spanning tree
+    unique_lock<mutex> lockCon(mMutexConnections);
+    SortConnections();
 
-    sort(vPairs.begin(),vPairs.end());
-    list<KeyFrame*> lKFs;
-    list<int> lWs;
-    for(size_t i=0; i<vPairs.size();i++)
+    if(mbFirstConnection && mnId!=0 && !mvpOrderedConnectedKeyFrames.empty())
     {
-        lKFs.push_front(vPairs[i].second);
-        lWs.push_front(vPairs[i].first);
-    }
-
-    {
-        unique_lock<mutex> lockCon(mMutexConnections);
-
-        // mspConnectedKeyFrames = spConnectedKeyFrames;
-        mConnectedKeyFrameWeights = KFcounter;
-        mvpOrderedConnectedKeyFrames = vector<KeyFrame*>(lKFs.begin(),lKFs.end());
-        mvOrderedWeights = vector<int>(lWs.begin(), lWs.end());
-
-        if(mbFirstConnection && mnId!=0)
-        {
-            mpParent = mvpOrderedConnectedKeyFrames.front();
-            mpParent->AddChild(this);
-            mbFirstConnection = false;
-        }
-
+        mpParent = mvpOrderedConnectedKeyFrames.front();
+        mpParent->AddChild(this);
+        mbFirstConnection = false;
     }
 }
 
@@ -382,21 +432,29 @@ void KeyFrame::AddChild(KeyFrame *pKF)
 {
     unique_lock<mutex> lockCon(mMutexConnections);
     mspChildrens.insert(pKF);
+    mnChangeIdx++;
 }
 
 void KeyFrame::EraseChild(KeyFrame *pKF)
 {
     unique_lock<mutex> lockCon(mMutexConnections);
     mspChildrens.erase(pKF);
+    mnChangeIdx++;
 }
 
 void KeyFrame::ChangeParent(KeyFrame *pKF)
 {
     unique_lock<mutex> lockCon(mMutexConnections);
     mpParent = pKF;
+    mnChangeIdx++;
     pKF->AddChild(this);
 }
 
+unsigned long KeyFrame::GetChangeIdx()
+{
+    return mnChangeIdx;
+}
+
 set<KeyFrame*> KeyFrame::GetChilds()
 {
     unique_lock<mutex> lockCon(mMutexConnections);
@@ -463,12 +521,18 @@ void KeyFrame::SetBadFlag()
         }
     }
 
-    for(map<KeyFrame*,int>::iterator mit = mConnectedKeyFrameWeights.begin(), mend=mConnectedKeyFrameWeights.end(); mit!=mend; mit++)
-        mit->first->EraseConnection(this);
-
+    // Erasing the observations decreases the covisibility weights, then remove what is left
     for(size_t i=0; i<mvpMapPoints.size(); i++)
         if(mvpMapPoints[i])
             mvpMapPoints[i]->EraseObservation(this);
+
+    map<KeyFrame*,int> connections;
+    {
+        unique_lock<mutex> lock(mMutexConnections);
+        connections = mConnectedKeyFrameWeights;
+    }
+    for(map<KeyFrame*,int>::iterator mit = connections.begin(), mend=connections.end(); mit!=mend; mit++)
+        mit->first->EraseConnection(this);
     {
         unique_lock<mutex> lock(mMutexConnections);
         unique_lock<mutex> lock1(mMutexFeatures);
@@ -535,13 +599,18 @@ void KeyFrame::SetBadFlag()
             }
 
         mpParent->EraseChild(this);
-        mTcp = Tcw*mpParent->GetPoseInverse();
+        mTcp = GetPose()*mpParent->GetPoseInverse();
         mbBad = true;
+        mnChangeIdx++;
+
+        // A bad keyframe does not reference MapPoints, so that they can be reclaimed
+        fill(mvpMapPoints.begin(),mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
     }
 
 
-    mpMap->EraseKeyFrame(this);
+    // The database reads the BoW vector, erase before the map can release it
     mpKeyFrameDB->erase(this);
+    mpMap->EraseKeyFrame(this);
 }
 
 bool KeyFrame::isBad()
@@ -550,20 +619,19 @@ bool KeyFrame::isBad()
     return mbBad;
 }
 
-void KeyFrame::EraseConnection(KeyFrame* pKF)
+void KeyFrame::ReleaseMatchingData()
 {
-    bool bUpdate = false;
-    {
-        unique_lock<mutex> lock(mMutexConnections);
-        if(mConnectedKeyFrameWeights.count(pKF))
-        {
-            mConnectedKeyFrameWeights.erase(pKF);
-            bUpdate=true;
-        }
-    }
+    unique_lock<mutex> lock(mMutexFeatures);
+    DBoW2::BowVector().swap(mBowVec);
+    DBoW2::FeatureVector().swap(mFeatVec);
+    vector< vector <vector<size_t> > >().swap(mGrid);
+}
 
-    if(bUpdate)
-        UpdateBestCovisibles();
+void KeyFrame::EraseConnection(KeyFrame* pKF)
+{
+    unique_lock<mutex> lock(mMutexConnections);
+    if(mConnectedKeyFrameWeights.erase(pKF))
+        SetConnectionsDirty();
 }
 
 vector<size_t> KeyFrame::GetFeaturesInArea(const float &x, const float &y, const float &r) const
@@ -621,10 +689,9 @@ cv::Mat KeyFrame::UnprojectStereo(int i)
         const float v = mvKeys[i].pt.y;
         const float x = (u-cx)*z*invfx;
         const float y = (v-cy)*z*invfy;
-        cv::Mat x3Dc = (cv::Mat_<float>(3,1) << x, y, z);
-
-        unique_lock<mutex> lock(mMutexPose);
-        return Twc.rowRange(0,3).colRange(0,3)*x3Dc+Twc.rowRange(0,3).col(3);
+        const cv::Matx44f Twc = GetPoseInverse44f();
+        const cv::Vec3f x3Dw = Twc.get_minor<3,3>(0,0)*cv::Vec3f(x,y,z)+cv::Vec3f(Twc(0,3),Twc(1,3),Twc(2,3));
+        return cv::Mat(x3Dw);
     }
     else
         return cv::Mat();
@@ -636,9 +703,8 @@ float KeyFrame::ComputeSceneMedianDepth(const int q)
     cv::Mat Tcw_;
     {
         unique_lock<mutex> lock(mMutexFeatures);
-        unique_lock<mutex> lock2(mMutexPose);
         vpMapPoints = mvpMapPoints;
-        Tcw_ = Tcw.clone();
+        Tcw_ = GetPose();
     }
 
     vector<float> vDepths;
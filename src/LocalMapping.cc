@@ -24,14 +24,32 @@
 #include "Optimizer.h"
 
 #include<mutex>
+#include<chrono>
+#include<limits>
 
 namespace ORB_SLAM2
 {
 
-LocalMapping::LocalMapping(Map *pMap, const float bMonocular):
+LocalMapping::LocalMapping(Map *pMap, const float bMonocular, const string &strSettingPath):
     mbMonocular(bMonocular), mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
-    mbAbortBA(false), mbStopped(false), mbStopRequested(false), mbNotStop(false), mbAcceptKeyFrames(true)
+    mqNewKeyFrames(32), mbAbortBA(false), mbStopped(false), mbStopRequested(false), mbNotStop(false), mbAcceptKeyFrames(true),
+    mpDeferredCullingKF(static_cast<KeyFrame*>(NULL))
 {
+    mnMapParticipant = mpMap->RegisterParticipant();
+
+    cv::FileStorage fSettings(strSettingPath, cv::FileStorage::READ);
+
+    // Missing entry is read as 0, no budget
+    float fTimeBudget = fSettings["LocalMapping.TimeBudget"];
+    mfTimeBudget = max(fTimeBudget,0.0f)/1000.0f;
+
+    cout << endl << "Local Mapping Parameters: " << endl;
+    if(mfTimeBudget>0)
+        cout << "- Time budget per keyframe: " << fTimeBudget << " ms" << endl;
+    else
+        cout << "- Time budget per keyframe: unlimited" << endl;
+
+    mSchedulerStats = SchedulerStats();
 }
 
 void LocalMapping::SetLoopCloser(LoopClosing* pLoopCloser)
@@ -44,6 +62,17 @@ void LocalMapping::SetTracker(Tracking *pTracker)
     mpTracker=pTracker;
 }
 
+static double Now()
+{
+    return chrono::duration_cast<chrono::duration<double> >(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Exponential moving average of the cost of a stage
+static void UpdateCost(float &cost, const double t)
+{
+    cost = cost>0 ? 0.8f*cost+0.2f*t : t;
+}
+
 void LocalMapping::Run()
 {
 
@@ -57,19 +86,48 @@ void LocalMapping::Run()
         // Check if there are keyframes in the queue
         if(CheckNewKeyFrames())
         {
+            // The keyframes waiting share the budget, the stages that do not fit are deferred
+            // and the local BA is shrunk. Without budget the remaining time is infinite.
+            const int nQueued = max(KeyframesInQueue(),1);
+            const double budget = mfTimeBudget/nQueued;
+            const double tStart = Now();
+            const double tDeadline = tStart+budget;
+            SchedulerStats stats = GetSchedulerStats();
+            double t = tStart;
+            double tNow;
+
             // BoW conversion and insertion in Map
             ProcessNewKeyFrame();
+            tNow = Now();
+            UpdateCost(stats.costProcess,tNow-t);
+            t = tNow;
 
             // Check recent MapPoints
             MapPointCulling();
+            tNow = Now();
+            UpdateCost(stats.costCulling,tNow-t);
+            t = tNow;
 
             // Triangulate new MapPoints
             CreateNewMapPoints();
+            tNow = Now();
+            UpdateCost(stats.costTriangulation,tNow-t);
+            t = tNow;
 
-            if(!CheckNewKeyFrames())
+            const double remainingFusion = budget>0 ? tDeadline-t : numeric_limits<double>::max();
+            if(!CheckNewKeyFrames() && remainingFusion>=stats.costFusion)
             {
                 // Find more matches in neighbor keyframes and fuse point duplications
                 SearchInNeighbors();
+                tNow = Now();
+                UpdateCost(stats.costFusion,tNow-t);
+                t = tNow;
+            }
+            else
+            {
+                stats.nDeferredFusions++;
+                if(DeferFusion(mpCurrentKeyFrame))
+                    stats.nDroppedFusions++;
             }
 
             mbAbortBA = false;
@@ -78,13 +136,61 @@ void LocalMapping::Run()
             {
                 // Local BA
                 if(mpMap->KeyFramesInMap()>2)
-                    Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame,&mbAbortBA, mpMap);
+                {
+                    const int nAvailableKFs = mpCurrentKeyFrame->GetVectorCovisibleKeyFrames().size()+1;
+                    const double remainingBA = budget>0 ? tDeadline-t : numeric_limits<double>::max();
+                    int nMaxLocalKFs, nIterations;
+                    ChooseLocalBA(nAvailableKFs,remainingBA,stats.costLocalBA,nMaxLocalKFs,nIterations);
+
+                    Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame,&mbAbortBA, mpMap, nMaxLocalKFs, nIterations);
+                    tNow = Now();
+
+                    // An interrupted BA does not tell its cost
+                    const int nLocalKFs = nMaxLocalKFs>0 ? min(nMaxLocalKFs,nAvailableKFs) : nAvailableKFs;
+                    if(!mbAbortBA)
+                        UpdateCost(stats.costLocalBA,(tNow-t)/(nLocalKFs*3*nIterations));
+                    t = tNow;
+
+                    stats.lastBAKeyFrames = nMaxLocalKFs;
+                    stats.lastBAIterations = nIterations;
+                }
 
                 // Check redundant local Keyframes
-                KeyFrameCulling();
+                const double remainingCulling = budget>0 ? tDeadline-t : numeric_limits<double>::max();
+                if(remainingCulling>=stats.costKeyFrameCulling)
+                {
+                    KeyFrameCulling();
+                    tNow = Now();
+                    UpdateCost(stats.costKeyFrameCulling,tNow-t);
+                    t = tNow;
+                }
+                else
+                {
+                    mpDeferredCullingKF = mpCurrentKeyFrame;
+                    stats.nDeferredCullings++;
+                }
             }
+            else
+                stats.nSkippedBA++;
 
             mpLoopCloser->InsertKeyFrame(mpCurrentKeyFrame);
+
+            stats.budget = budget;
+            stats.lastTime = t-tStart;
+            stats.nKeyFrames++;
+            if(budget>0 && t>tDeadline)
+                stats.nOverruns++;
+            {
+                unique_lock<mutex> lock(mMutexSchedulerStats);
+                mSchedulerStats = stats;
+            }
+
+            if(mpCurrentKeyFrame->mnId%100==0)
+            {
+                mpMap->PrintMemoryUsage();
+                PrintQueueStats();
+                PrintSchedulerStats();
+            }
         }
         else if(Stop())
         {
@@ -96,42 +202,148 @@ void LocalMapping::Run()
             if(CheckFinish())
                 break;
         }
+        else
+        {
+            // Idle, catch up with the deferred work
+            RunDeferredWork();
+        }
 
         ResetIfRequested();
 
+        // Free the MapPoints culled or fused by all threads
+        DiscardBadMapPoints();
+        mpMap->Reclaim();
+
         // Tracking will see that Local Mapping is busy
         SetAcceptKeyFrames(true);
 
         if(CheckFinish())
             break;
 
-        usleep(3000);
+        // Sleep until the Tracking inserts a keyframe
+        mqNewKeyFrames.Wait(std::chrono::milliseconds(3));
     }
 
     SetFinish();
 }
 
+void LocalMapping::ChooseLocalBA(const int nAvailableKFs, const double remaining, const float cost,
+                                 int &nMaxLocalKFs, int &nIterations)
+{
+    const int nMinLocalKFs = 5;
+    const int nMinIterations = 2;
+
+    nMaxLocalKFs = 0;
+    nIterations = 5;
+
+    if(cost<=0 || remaining==numeric_limits<double>::max())
+        return;
+
+    // Fewer iterations first, then a smaller window
+    int nLocalKFs = nAvailableKFs;
+    while(nIterations>nMinIterations && cost*nLocalKFs*3*nIterations>remaining)
+        nIterations--;
+
+    if(cost*nLocalKFs*3*nIterations>remaining)
+    {
+        nLocalKFs = max(nMinLocalKFs,(int)(max(remaining,0.0)/(cost*3*nIterations)));
+        nMaxLocalKFs = nLocalKFs;
+    }
+}
+
+bool LocalMapping::DeferFusion(KeyFrame *pKF)
+{
+    // Only the last keyframes are worth fusing late
+    const size_t nMaxDeferred = 5;
+    bool bDropped = false;
+    if(mvpDeferredFuseKFs.size()>=nMaxDeferred)
+    {
+        mvpDeferredFuseKFs.erase(mvpDeferredFuseKFs.begin());
+        bDropped = true;
+    }
+    mvpDeferredFuseKFs.push_back(pKF);
+    return bDropped;
+}
+
+void LocalMapping::RunDeferredWork()
+{
+    // One task per call, so that a new keyframe waits at most one fusion
+    if(!mvpDeferredFuseKFs.empty())
+    {
+        // Newest first, it is the one the Tracking is using
+        KeyFrame* pKF = mvpDeferredFuseKFs.back();
+        mvpDeferredFuseKFs.pop_back();
+        if(!pKF->isBad())
+        {
+            mpCurrentKeyFrame = pKF;
+            SearchInNeighbors();
+        }
+    }
+    else if(mpDeferredCullingKF)
+    {
+        KeyFrame* pKF = mpDeferredCullingKF;
+        mpDeferredCullingKF = static_cast<KeyFrame*>(NULL);
+        if(!pKF->isBad())
+        {
+            mpCurrentKeyFrame = pKF;
+            KeyFrameCulling();
+        }
+    }
+}
+
+LocalMapping::SchedulerStats LocalMapping::GetSchedulerStats()
+{
+    unique_lock<mutex> lock(mMutexSchedulerStats);
+    return mSchedulerStats;
+}
+
+void LocalMapping::PrintSchedulerStats()
+{
+    const SchedulerStats stats = GetSchedulerStats();
+
+    cout << "Local mapping: budget " << 1e3*stats.budget << " ms, last " << 1e3*stats.lastTime << " ms, "
+         << stats.nOverruns << "/" << stats.nKeyFrames << " overruns, stage costs " << 1e3*stats.costProcess << "/"
+         << 1e3*stats.costCulling << "/" << 1e3*stats.costTriangulation << "/" << 1e3*stats.costFusion << "/"
+         << 1e3*stats.costKeyFrameCulling << " ms, BA " << 1e6*stats.costLocalBA << " us/KF/it (window "
+         << stats.lastBAKeyFrames << ", " << stats.lastBAIterations << " its), deferred " << stats.nDeferredFusions
+         << " fusions (" << stats.nDroppedFusions << " dropped) " << stats.nDeferredCullings << " cullings, "
+         << stats.nSkippedBA << " BA skipped" << endl;
+}
+
 void LocalMapping::InsertKeyFrame(KeyFrame *pKF)
 {
-    unique_lock<mutex> lock(mMutexNewKFs);
-    mlNewKeyFrames.push_back(pKF);
+    // MapPoints may have become bad since the tracking matched them, and the keyframe
+    // is not an observation yet so they would not be erased from it
+    DiscardBadMapPoints(pKF);
+    mqNewKeyFrames.Push(pKF);
     mbAbortBA=true;
 }
 
+SPSCQueue<KeyFrame*>::Stats LocalMapping::GetQueueStats()
+{
+    return mqNewKeyFrames.GetStats();
+}
+
+void LocalMapping::PrintQueueStats()
+{
+    const SPSCQueue<KeyFrame*>::Stats statsLM = GetQueueStats();
+    const SPSCQueue<KeyFrame*>::Stats statsLC = mpLoopCloser->GetQueueStats();
+
+    cout << "KeyFrame queues: local mapping " << statsLM.nSize << "/" << statsLM.nCapacity << " (max " << statsLM.nMaxSize
+         << ", full " << statsLM.nFullWaits << ", dwell " << 1e3*statsLM.meanDwell << "/" << 1e3*statsLM.maxDwell << " ms), "
+         << "loop closing " << statsLC.nSize << "/" << statsLC.nCapacity << " (max " << statsLC.nMaxSize
+         << ", full " << statsLC.nFullWaits << ", dwell " << 1e3*statsLC.meanDwell << "/" << 1e3*statsLC.maxDwell << " ms)" << endl;
+}
+
 
 bool LocalMapping::CheckNewKeyFrames()
 {
-    unique_lock<mutex> lock(mMutexNewKFs);
-    return(!mlNewKeyFrames.empty());
+    return(!mqNewKeyFrames.Empty());
 }
 
 void LocalMapping::ProcessNewKeyFrame()
 {
-    {
-        unique_lock<mutex> lock(mMutexNewKFs);
-        mpCurrentKeyFrame = mlNewKeyFrames.front();
-        mlNewKeyFrames.pop_front();
-    }
+    mqNewKeyFrames.TryPop(mpCurrentKeyFrame);
 
     // Compute Bags of Words structures
     mpCurrentKeyFrame->ComputeBoW();
@@ -154,9 +366,13 @@ void LocalMapping::ProcessNewKeyFrame()
                 }
                 else // this can only happen for new stereo points inserted by the Tracking
                 {
-                    mlpRecentAddedMapPoints.push_back(pMP);
+                    mvpRecentAddedMapPoints.push_back(pMP);
                 }
             }
+
+            // Bad points do not accept new observations, unlink them or they would be reclaimed
+            if(pMP->isBad())
+                mpCurrentKeyFrame->EraseMapPointMatch(i);
         }
     }    
 
@@ -167,10 +383,35 @@ void LocalMapping::ProcessNewKeyFrame()
     mpMap->AddKeyFrame(mpCurrentKeyFrame);
 }
 
+void LocalMapping::DiscardBadMapPoints(KeyFrame* pKF)
+{
+    const vector<MapPoint*> vpMapPoints = pKF->GetMapPointMatches();
+    for(size_t i=0; i<vpMapPoints.size(); i++)
+    {
+        MapPoint* pMP = vpMapPoints[i];
+        if(pMP && pMP->isBad())
+            pKF->EraseMapPointMatch(i);
+    }
+}
+
+void LocalMapping::DiscardBadMapPoints()
+{
+    mqNewKeyFrames.ForEach([this](KeyFrame* pKF){DiscardBadMapPoints(pKF);});
+
+    size_t nKept=0;
+    for(size_t i=0, iend=mvpRecentAddedMapPoints.size(); i<iend; i++)
+    {
+        if(!mvpRecentAddedMapPoints[i]->isBad())
+            mvpRecentAddedMapPoints[nKept++] = mvpRecentAddedMapPoints[i];
+    }
+    mvpRecentAddedMapPoints.resize(nKept);
+
+    mpMap->QuiescentState(mnMapParticipant);
+}
+
 void LocalMapping::MapPointCulling()
 {
-    // Check Recent Added MapPoints
-    list<MapPoint*>::iterator lit = mlpRecentAddedMapPoints.begin();
+    // Check Recent Added MapPoints, the ones kept are compacted in place
     const unsigned long int nCurrentKFid = mpCurrentKeyFrame->mnId;
 
     int nThObs;
@@ -180,28 +421,26 @@ void LocalMapping::MapPointCulling()
         nThObs = 3;
     const int cnThObs = nThObs;
 
-    while(lit!=mlpRecentAddedMapPoints.end())
+    size_t nKept=0;
+    for(size_t i=0, iend=mvpRecentAddedMapPoints.size(); i<iend; i++)
     {
-        MapPoint* pMP = *lit;
+        MapPoint* pMP = mvpRecentAddedMapPoints[i];
         if(pMP->isBad())
         {
-            lit = mlpRecentAddedMapPoints.erase(lit);
+            continue;
         }
         else if(pMP->GetFoundRatio()<0.25f )
         {
             pMP->SetBadFlag();
-            lit = mlpRecentAddedMapPoints.erase(lit);
         }
         else if(((int)nCurrentKFid-(int)pMP->mnFirstKFid)>=2 && pMP->Observations()<=cnThObs)
         {
             pMP->SetBadFlag();
-            lit = mlpRecentAddedMapPoints.erase(lit);
         }
-        else if(((int)nCurrentKFid-(int)pMP->mnFirstKFid)>=3)
-            lit = mlpRecentAddedMapPoints.erase(lit);
-        else
-            lit++;
+        else if(((int)nCurrentKFid-(int)pMP->mnFirstKFid)<3)
+            mvpRecentAddedMapPoints[nKept++] = pMP;
     }
+    mvpRecentAddedMapPoints.resize(nKept);
 }
 
 void LocalMapping::CreateNewMapPoints()
@@ -212,8 +451,6 @@ void LocalMapping::CreateNewMapPoints()
         nn=20;
     const vector<KeyFrame*> vpNeighKFs = mpCurrentKeyFrame->GetBestCovisibilityKeyFrames(nn);
 
-    ORBmatcher matcher(0.6,false);
-
     cv::Mat Rcw1 = mpCurrentKeyFrame->GetRotation();
     cv::Mat Rwc1 = Rcw1.t();
     cv::Mat tcw1 = mpCurrentKeyFrame->GetTranslation();
@@ -231,10 +468,14 @@ void LocalMapping::CreateNewMapPoints()
 
     const float ratioFactor = 1.5f*mpCurrentKeyFrame->mfScaleFactor;
 
-    int nnew=0;
-
     // Search matches with epipolar restriction and triangulate
-    for(size_t i=0; i<vpNeighKFs.size(); i++)
+    // Neighbors are processed in parallel, each one only writes its own candidates.
+    // The MapPoints are created afterwards in neighbor order.
+    const int nNeighKFs = vpNeighKFs.size();
+    vector<vector<pair<size_t,size_t> > > vvNewMatches(nNeighKFs);
+    vector<vector<cv::Mat> > vvNewPoints(nNeighKFs);
+
+    mThreadPool.ParallelFor(nNeighKFs,[&](int i)
     {
         if(i>0 && CheckNewKeyFrames())
             return;
@@ -249,7 +490,7 @@ void LocalMapping::CreateNewMapPoints()
         if(!mbMonocular)
         {
             if(baseline<pKF2->mb)
-            continue;
+            return;
         }
         else
         {
@@ -257,13 +498,14 @@ void LocalMapping::CreateNewMapPoints()
             const float ratioBaselineDepth = baseline/medianDepthKF2;
 
             if(ratioBaselineDepth<0.01)
-                continue;
+                return;
         }
 
         // Compute Fundamental Matrix
         cv::Mat F12 = ComputeF12(mpCurrentKeyFrame,pKF2);
 
         // Search matches that fullfil epipolar constraint
+        ORBmatcher matcher(0.6,false);
         vector<pair<size_t,size_t> > vMatchedIndices;
         matcher.SearchForTriangulation(mpCurrentKeyFrame,pKF2,F12,vMatchedIndices,false);
 
@@ -431,7 +673,30 @@ void LocalMapping::CreateNewMapPoints()
                 continue;
 
             // Triangulation is succesfull
-            MapPoint* pMP = new MapPoint(x3D,mpCurrentKeyFrame,mpMap);
+            vvNewMatches[i].push_back(vMatchedIndices[ikp]);
+            vvNewPoints[i].push_back(x3D);
+        }
+    });
+
+    // A keypoint of the current keyframe triangulated with several neighbors
+    // takes the point of the first neighbor, as if they were processed in order
+    int nnew=0;
+    for(int i=0; i<nNeighKFs; i++)
+    {
+        if(i>0 && CheckNewKeyFrames())
+            return;
+
+        KeyFrame* pKF2 = vpNeighKFs[i];
+
+        for(size_t j=0, jend=vvNewMatches[i].size(); j<jend; j++)
+        {
+            const size_t idx1 = vvNewMatches[i][j].first;
+            const size_t idx2 = vvNewMatches[i][j].second;
+
+            if(mpCurrentKeyFrame->GetMapPoint(idx1) || pKF2->GetMapPoint(idx2))
+                continue;
+
+            MapPoint* pMP = new MapPoint(vvNewPoints[i][j],mpCurrentKeyFrame,mpMap);
 
             pMP->AddObservation(mpCurrentKeyFrame,idx1);            
             pMP->AddObservation(pKF2,idx2);
@@ -444,7 +709,7 @@ void LocalMapping::CreateNewMapPoints()
             pMP->UpdateNormalAndDepth();
 
             mpMap->AddMapPoint(pMP);
-            mlpRecentAddedMapPoints.push_back(pMP);
+            mvpRecentAddedMapPoints.push_back(pMP);
 
             nnew++;
         }
@@ -479,25 +744,34 @@ void LocalMapping::SearchInNeighbors()
     }
 
 
-    // Search matches by projection from current KF in target KFs
+    // Matches are searched for all target KFs in parallel. They are fused afterwards in target order,
+    // checked again against the map, so the result is the one of fusing each target in turn.
+    const int nTargetKFs = vpTargetKFs.size();
     ORBmatcher matcher;
+
+    // Search matches by projection from current KF in target KFs
     vector<MapPoint*> vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
-    for(vector<KeyFrame*>::iterator vit=vpTargetKFs.begin(), vend=vpTargetKFs.end(); vit!=vend; vit++)
+    vector<vector<int> > vvnMatchIdx(nTargetKFs);
+
+    mThreadPool.ParallelFor(nTargetKFs,[&](int i)
     {
-        KeyFrame* pKFi = *vit;
+        ORBmatcher matcheri;
+        matcheri.SearchFuseCandidates(vpTargetKFs[i],vpMapPointMatches,vvnMatchIdx[i]);
+    });
 
-        matcher.Fuse(pKFi,vpMapPointMatches);
-    }
+    for(int i=0; i<nTargetKFs; i++)
+        matcher.FuseCandidates(vpTargetKFs[i],vpMapPointMatches,vvnMatchIdx[i]);
 
     // Search matches by projection from target KFs in current KF
-    vector<MapPoint*> vpFuseCandidates;
-    vpFuseCandidates.reserve(vpTargetKFs.size()*vpMapPointMatches.size());
+    vector<vector<MapPoint*> > vvpFuseCandidates(nTargetKFs);
 
-    for(vector<KeyFrame*>::iterator vitKF=vpTargetKFs.begin(), vendKF=vpTargetKFs.end(); vitKF!=vendKF; vitKF++)
+    for(int i=0; i<nTargetKFs; i++)
     {
-        KeyFrame* pKFi = *vitKF;
+        KeyFrame* pKFi = vpTargetKFs[i];
 
         vector<MapPoint*> vpMapPointsKFi = pKFi->GetMapPointMatches();
+        vector<MapPoint*> &vpFuseCandidates = vvpFuseCandidates[i];
+        vpFuseCandidates.reserve(vpMapPointsKFi.size());
 
         for(vector<MapPoint*>::iterator vitMP=vpMapPointsKFi.begin(), vendMP=vpMapPointsKFi.end(); vitMP!=vendMP; vitMP++)
         {
@@ -511,23 +785,36 @@ void LocalMapping::SearchInNeighbors()
         }
     }
 
-    matcher.Fuse(mpCurrentKeyFrame,vpFuseCandidates);
+    mThreadPool.ParallelFor(nTargetKFs,[&](int i)
+    {
+        ORBmatcher matcheri;
+        matcheri.SearchFuseCandidates(mpCurrentKeyFrame,vvpFuseCandidates[i],vvnMatchIdx[i]);
+    });
+
+    for(int i=0; i<nTargetKFs; i++)
+        matcher.FuseCandidates(mpCurrentKeyFrame,vvpFuseCandidates[i],vvnMatchIdx[i]);
 
 
-    // Update points
+    // Update points, each one only locks itself
     vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
-    for(size_t i=0, iend=vpMapPointMatches.size(); i<iend; i++)
+    const int nMPs = vpMapPointMatches.size();
+    const int nBlocks = (nMPs+63)/64;
+    mThreadPool.ParallelFor(nBlocks,[&](int b)
     {
-        MapPoint* pMP=vpMapPointMatches[i];
-        if(pMP)
+        const int iend = min(nMPs,(b+1)*64);
+        for(int i=b*64; i<iend; i++)
         {
-            if(!pMP->isBad())
+            MapPoint* pMP=vpMapPointMatches[i];
+            if(pMP)
             {
-                pMP->ComputeDistinctiveDescriptors();
-                pMP->UpdateNormalAndDepth();
+                if(!pMP->isBad())
+                {
+                    pMP->ComputeDistinctiveDescriptors();
+                    pMP->UpdateNormalAndDepth();
+                }
             }
         }
-    }
+    });
 
     // Update connections in covisibility graph
     mpCurrentKeyFrame->UpdateConnections();
@@ -556,7 +843,6 @@ void LocalMapping::RequestStop()
 {
     unique_lock<mutex> lock(mMutexStop);
     mbStopRequested = true;
-    unique_lock<mutex> lock2(mMutexNewKFs);
     mbAbortBA = true;
 }
 
@@ -593,9 +879,11 @@ void LocalMapping::Release()
         return;
     mbStopped = false;
     mbStopRequested = false;
-    for(list<KeyFrame*>::iterator lit = mlNewKeyFrames.begin(), lend=mlNewKeyFrames.end(); lit!=lend; lit++)
-        delete *lit;
-    mlNewKeyFrames.clear();
+    // The queue is only read by this thread, which is stopped. Pop and delete in a single pass,
+    // so that a keyframe pushed meanwhile is either deleted or left in the queue.
+    KeyFrame* pKF;
+    while(mqNewKeyFrames.TryPop(pKF))
+        delete pKF;
 
     cout << "Local Mapping RELEASE" << endl;
 }
@@ -644,8 +932,7 @@ void LocalMapping::KeyFrameCulling()
             continue;
         const vector<MapPoint*> vpMapPoints = pKF->GetMapPointMatches();
 
-        int nObs = 3;
-        const int thObs=nObs;
+        const int thObs=3;
         int nRedundantObservations=0;
         int nMPs=0;
         for(size_t i=0, iend=vpMapPoints.size(); i<iend; i++)
@@ -662,33 +949,15 @@ void LocalMapping::KeyFrameCulling()
                     }
 
                     nMPs++;
-                    if(pMP->Observations()>thObs)
-                    {
-                        const int &scaleLevel = pKF->mvKeysUn[i].octave;
-                        const map<KeyFrame*, size_t> observations = pMP->GetObservations();
-                        int nObs=0;
-                        for(map<KeyFrame*, size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
-                        {
-                            KeyFrame* pKFi = mit->first;
-                            if(pKFi==pKF)
-                                continue;
-                            const int &scaleLeveli = pKFi->mvKeysUn[mit->second].octave;
-
-                            if(scaleLeveli<=scaleLevel+1)
-                            {
-                                nObs++;
-                                if(nObs>=thObs)
-                                    break;
-                            }
-                        }
-                        if(nObs>=thObs)
-                        {
-                            nRedundantObservations++;
-                        }
-                    }
+
+                    // Other keyframes seeing the point in the same or finer scale, pKF is one
+                    // of the observations counted
+                    const int &scaleLevel = pKF->mvKeysUn[i].octave;
+                    if(pMP->ObservationsUpToLevel(scaleLevel+1)-1>=thObs)
+                        nRedundantObservations++;
                 }
             }
-        }  
+        }
 
         if(nRedundantObservations>0.9*nMPs)
             pKF->SetBadFlag();
@@ -725,8 +994,10 @@ void LocalMapping::ResetIfRequested()
     unique_lock<mutex> lock(mMutexReset);
     if(mbResetRequested)
     {
-        mlNewKeyFrames.clear();
-        mlpRecentAddedMapPoints.clear();
+        mqNewKeyFrames.Clear();
+        mvpRecentAddedMapPoints.clear();
+        mvpDeferredFuseKFs.clear();
+        mpDeferredCullingKF = static_cast<KeyFrame*>(NULL);
         mbResetRequested=false;
     }
 }
@@ -30,6 +30,8 @@
 
 #include<mutex>
 #include<thread>
+#include<atomic>
+#include<algorithm>
 
 
 namespace ORB_SLAM2
@@ -37,10 +39,12 @@ namespace ORB_SLAM2
 
 LoopClosing::LoopClosing(Map *pMap, KeyFrameDatabase *pDB, ORBVocabulary *pVoc, const bool bFixScale):
     mbResetRequested(false), mbFinishRequested(false), mbFinished(true), mpMap(pMap),
-    mpKeyFrameDB(pDB), mpORBVocabulary(pVoc), mpMatchedKF(NULL), mLastLoopKFid(0), mbRunningGBA(false), mbFinishedGBA(true),
+    mpKeyFrameDB(pDB), mpORBVocabulary(pVoc), mqLoopKeyFrameQueue(1024), mpMatchedKF(NULL), mLastLoopKFid(0), mbRunningGBA(false), mbFinishedGBA(true),
     mbStopGBA(false), mpThreadGBA(NULL), mbFixScale(bFixScale), mnFullBAIdx(0)
 {
     mnCovisibilityConsistencyTh = 3;
+
+    mnMapParticipant = mpMap->RegisterParticipant();
 }
 
 void LoopClosing::SetTracker(Tracking *pTracker)
@@ -78,10 +82,13 @@ void LoopClosing::Run()
 
         ResetIfRequested();
 
+        // MapPoints used for the loop are not kept for the next iteration
+        mpMap->QuiescentState(mnMapParticipant);
+
         if(CheckFinish())
             break;
 
-        usleep(5000);
+        mqLoopKeyFrameQueue.Wait(std::chrono::milliseconds(5));
     }
 
     SetFinish();
@@ -89,26 +96,30 @@ void LoopClosing::Run()
 
 void LoopClosing::InsertKeyFrame(KeyFrame *pKF)
 {
-    unique_lock<mutex> lock(mMutexLoopQueue);
     if(pKF->mnId!=0)
-        mlpLoopKeyFrameQueue.push_back(pKF);
+    {
+        // This thread goes through quiescent states while the keyframe waits in the queue,
+        // it must not be culled (and released) before DetectLoop reads its BoW vector
+        pKF->SetNotErase();
+        mqLoopKeyFrameQueue.Push(pKF);
+    }
+}
+
+SPSCQueue<KeyFrame*>::Stats LoopClosing::GetQueueStats()
+{
+    return mqLoopKeyFrameQueue.GetStats();
 }
 
 bool LoopClosing::CheckNewKeyFrames()
 {
-    unique_lock<mutex> lock(mMutexLoopQueue);
-    return(!mlpLoopKeyFrameQueue.empty());
+    return(!mqLoopKeyFrameQueue.Empty());
 }
 
 bool LoopClosing::DetectLoop()
 {
-    {
-        unique_lock<mutex> lock(mMutexLoopQueue);
-        mpCurrentKF = mlpLoopKeyFrameQueue.front();
-        mlpLoopKeyFrameQueue.pop_front();
-        // Avoid that a keyframe can be erased while it is being process by this thread
-        mpCurrentKF->SetNotErase();
-    }
+    // The keyframe cannot be erased while it is being processed by this thread, it was protected
+    // when it was queued (see InsertKeyFrame)
+    mqLoopKeyFrameQueue.TryPop(mpCurrentKF);
 
     //If the map contains less than 10 KF or less than 10 KF have passed from last loop detection
     if(mpCurrentKF->mnId<mLastLoopKFid+10)
@@ -232,83 +243,59 @@ bool LoopClosing::ComputeSim3()
 {
     // For each consistent loop candidate we try to compute a Sim3
 
+    // The first candidate in this order that is verified is accepted. The most similar places are tried
+    // first and the result depends neither on the order of the database nor on the threads.
+    sort(mvpEnoughConsistentCandidates.begin(),mvpEnoughConsistentCandidates.end(),KeyFrame::loopScoreComp);
+
     const int nInitialCandidates = mvpEnoughConsistentCandidates.size();
 
     // We compute first ORB matches for each candidate
     // If enough matches are found, we setup a Sim3Solver
-    ORBmatcher matcher(0.75,true);
-
-    vector<Sim3Solver*> vpSim3Solvers;
-    vpSim3Solvers.resize(nInitialCandidates);
+    // Each candidate then runs its RANSAC, guided matching and Sim3 optimization on its own
+    // in the thread pool, and only writes its own slot.
+    vector<vector<MapPoint*> > vvpMapPointMatches(nInitialCandidates);
+    vector<vector<MapPoint*> > vvpLoopMatches(nInitialCandidates);
+    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vgScm(nInitialCandidates);
 
-    vector<vector<MapPoint*> > vvpMapPointMatches;
-    vvpMapPointMatches.resize(nInitialCandidates);
-
-    vector<bool> vbDiscarded;
-    vbDiscarded.resize(nInitialCandidates);
+    // avoid that local mapping erase them while they are being processed in this thread
+    for(int i=0; i<nInitialCandidates; i++)
+        mvpEnoughConsistentCandidates[i]->SetNotErase();
 
-    int nCandidates=0; //candidates with enough matches
+    // Lowest index of a candidate accepted so far. Candidates after it stop their RANSAC,
+    // so the result is the same as if they were processed in order.
+    std::atomic<int> nMatchIdx(nInitialCandidates);
 
-    for(int i=0; i<nInitialCandidates; i++)
+    mThreadPool.ParallelFor(nInitialCandidates,[&](int i)
     {
         KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
 
-        // avoid that local mapping erase it while it is being processed in this thread
-        pKF->SetNotErase();
+        // A preceding candidate was already accepted
+        if(pKF->isBad() || i>nMatchIdx)
+            return;
 
-        if(pKF->isBad())
-        {
-            vbDiscarded[i] = true;
-            continue;
-        }
+        ORBmatcher matcher(0.75,true);
 
         int nmatches = matcher.SearchByBoW(mpCurrentKF,pKF,vvpMapPointMatches[i]);
 
-        if(nmatches<20)
-        {
-            vbDiscarded[i] = true;
-            continue;
-        }
-        else
-        {
-            Sim3Solver* pSolver = new Sim3Solver(mpCurrentKF,pKF,vvpMapPointMatches[i],mbFixScale);
-            pSolver->SetRansacParameters(0.99,20,300);
-            vpSim3Solvers[i] = pSolver;
-        }
-
-        nCandidates++;
-    }
+        if(nmatches<20 || i>nMatchIdx)
+            return;
 
-    bool bMatch = false;
+        Sim3Solver solver(mpCurrentKF,pKF,vvpMapPointMatches[i],mbFixScale);
+        solver.SetRansacParameters(0.99,20,300);
+        // Deterministic seed, independent of the scheduling of the threads
+        solver.SetSeed(mpCurrentKF->mnId*1000003ul+pKF->mnId);
 
-    // Perform alternatively RANSAC iterations for each candidate
-    // until one is succesful or all fail
-    while(nCandidates>0 && !bMatch)
-    {
-        for(int i=0; i<nInitialCandidates; i++)
+        bool bNoMore = false;
+        while(!bNoMore && i<nMatchIdx)
         {
-            if(vbDiscarded[i])
-                continue;
-
-            KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
-
             // Perform 5 Ransac Iterations
             vector<bool> vbInliers;
             int nInliers;
-            bool bNoMore;
-
-            Sim3Solver* pSolver = vpSim3Solvers[i];
-            cv::Mat Scm  = pSolver->iterate(5,bNoMore,vbInliers,nInliers);
 
-            // If Ransac reachs max. iterations discard keyframe
-            if(bNoMore)
-            {
-                vbDiscarded[i]=true;
-                nCandidates--;
-            }
+            cv::Mat Scm  = solver.iterate(5,bNoMore,vbInliers,nInliers);
 
             // If RANSAC returns a Sim3, perform a guided matching and optimize with all correspondences
-            if(!Scm.empty())
+            if(!Scm.empty() && i<nMatchIdx)
             {
                 vector<MapPoint*> vpMapPointMatches(vvpMapPointMatches[i].size(), static_cast<MapPoint*>(NULL));
                 for(size_t j=0, jend=vbInliers.size(); j<jend; j++)
@@ -317,9 +304,9 @@ bool LoopClosing::ComputeSim3()
                        vpMapPointMatches[j]=vvpMapPointMatches[i][j];
                 }
 
-                cv::Mat R = pSolver->GetEstimatedRotation();
-                cv::Mat t = pSolver->GetEstimatedTranslation();
-                const float s = pSolver->GetEstimatedScale();
+                cv::Mat R = solver.GetEstimatedRotation();
+                cv::Mat t = solver.GetEstimatedTranslation();
+                const float s = solver.GetEstimatedScale();
                 matcher.SearchBySim3(mpCurrentKF,pKF,vpMapPointMatches,s,R,t,7.5);
 
                 g2o::Sim3 gScm(Converter::toMatrix3d(R),Converter::toVector3d(t),s);
@@ -328,17 +315,29 @@ bool LoopClosing::ComputeSim3()
                 // If optimization is succesful stop ransacs and continue
                 if(nInliers>=20)
                 {
-                    bMatch = true;
-                    mpMatchedKF = pKF;
-                    g2o::Sim3 gSmw(Converter::toMatrix3d(pKF->GetRotation()),Converter::toVector3d(pKF->GetTranslation()),1.0);
-                    mg2oScw = gScm*gSmw;
-                    mScw = Converter::toCvMat(mg2oScw);
+                    vgScm[i] = gScm;
+                    vvpLoopMatches[i] = vpMapPointMatches;
 
-                    mvpCurrentMatchedPoints = vpMapPointMatches;
-                    break;
+                    int nCurrentIdx = nMatchIdx;
+                    while(i<nCurrentIdx && !nMatchIdx.compare_exchange_weak(nCurrentIdx,i));
+                    return;
                 }
             }
         }
+    });
+
+    bool bMatch = nMatchIdx<nInitialCandidates;
+
+    if(bMatch)
+    {
+        const int i = nMatchIdx;
+        KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
+        mpMatchedKF = pKF;
+        g2o::Sim3 gSmw(Converter::toMatrix3d(pKF->GetRotation()),Converter::toVector3d(pKF->GetTranslation()),1.0);
+        mg2oScw = vgScm[i]*gSmw;
+        mScw = Converter::toCvMat(mg2oScw);
+
+        mvpCurrentMatchedPoints = vvpLoopMatches[i];
     }
 
     if(!bMatch)
@@ -372,6 +371,7 @@ bool LoopClosing::ComputeSim3()
     }
 
     // Find more matches projecting with the computed Sim3
+    ORBmatcher matcher(0.75,true);
     matcher.SearchByProjection(mpCurrentKF, mScw, mvpLoopMapPoints, mvpCurrentMatchedPoints,10);
 
     // If enough matches accept Loop
@@ -437,12 +437,13 @@ void LoopClosing::CorrectLoop()
 
     KeyFrameAndPose CorrectedSim3, NonCorrectedSim3;
     CorrectedSim3[mpCurrentKF]=mg2oScw;
+    map<KeyFrame*, vector<KeyFrame*> > PreviousNeighbors;
     cv::Mat Twc = mpCurrentKF->GetPoseInverse();
 
 
     {
         // Get Map Mutex
-        unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+        MapUpdateLock lock(mpMap);
 
         for(vector<KeyFrame*>::iterator vit=mvpCurrentConnectedKFs.begin(), vend=mvpCurrentConnectedKFs.end(); vit!=vend; vit++)
         {
@@ -515,6 +516,10 @@ void LoopClosing::CorrectLoop()
             pKFi->UpdateConnections();
         }
 
+        // Covisibility weights follow the fusion immediately, keep the neighbors from before it
+        for(vector<KeyFrame*>::iterator vit=mvpCurrentConnectedKFs.begin(), vend=mvpCurrentConnectedKFs.end(); vit!=vend; vit++)
+            PreviousNeighbors[*vit] = (*vit)->GetVectorCovisibleKeyFrames();
+
         // Start Loop Fusion
         // Update matched map points and replace if duplicated
         for(size_t i=0; i<mvpCurrentMatchedPoints.size(); i++)
@@ -548,12 +553,12 @@ void LoopClosing::CorrectLoop()
     for(vector<KeyFrame*>::iterator vit=mvpCurrentConnectedKFs.begin(), vend=mvpCurrentConnectedKFs.end(); vit!=vend; vit++)
     {
         KeyFrame* pKFi = *vit;
-        vector<KeyFrame*> vpPreviousNeighbors = pKFi->GetVectorCovisibleKeyFrames();
+        const vector<KeyFrame*> &vpPreviousNeighbors = PreviousNeighbors[pKFi];
 
         // Update connections. Detect new links.
         pKFi->UpdateConnections();
         LoopConnections[pKFi]=pKFi->GetConnectedKeyFrames();
-        for(vector<KeyFrame*>::iterator vit_prev=vpPreviousNeighbors.begin(), vend_prev=vpPreviousNeighbors.end(); vit_prev!=vend_prev; vit_prev++)
+        for(vector<KeyFrame*>::const_iterator vit_prev=vpPreviousNeighbors.begin(), vend_prev=vpPreviousNeighbors.end(); vit_prev!=vend_prev; vit_prev++)
         {
             LoopConnections[pKFi].erase(*vit_prev);
         }
@@ -563,15 +568,63 @@ void LoopClosing::CorrectLoop()
         }
     }
 
-    // Optimize graph
-    Optimizer::OptimizeEssentialGraph(mpMap, mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, mbFixScale);
-
-    mpMap->InformNewBigChange();
+    // Optimize graph. The graph is copied while Local Mapping is stopped and solved while it runs,
+    // the keyframes it creates meanwhile are corrected with their parent when the result is applied.
+    Optimizer::EssentialGraph graph;
+    Optimizer::BuildEssentialGraph(mpMap, mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, mbFixScale, graph);
 
     // Add loop edge
     mpMatchedKF->AddLoopEdge(mpCurrentKF);
     mpCurrentKF->AddLoopEdge(mpMatchedKF);
 
+    mpLocalMapper->Release();
+
+    Optimizer::SolveEssentialGraph(graph, &mThreadPool);
+
+    mpLocalMapper->RequestStop();
+    while(!mpLocalMapper->isStopped() && !mpLocalMapper->isFinished())
+    {
+        usleep(1000);
+    }
+
+    Optimizer::ApplyEssentialGraph(mpMap, mpCurrentKF, graph);
+
+    mpMap->InformNewBigChange();
+
+    // Keyframes whose pose changed noticeably with the correction, the Global BA only optimizes these and
+    // their neighbours. Keyframes added after the graph was built only followed their parent and are included too.
+    // The keyframes of an aborted Global BA remain pending, the next one refines both regions.
+    {
+        const vector<KeyFrame*> vpAllKFs = mpMap->GetAllKeyFrames();
+        const size_t nGraphKFs = graph.vpKFs.size();
+        vector<double> vDist(vpAllKFs.size(),-1.0);
+        vector<double> vAngle(vpAllKFs.size(),-1.0);
+        double maxDist = 0, maxAngle = 0;
+        for(size_t i=0, iend=vpAllKFs.size(); i<iend; i++)
+        {
+            KeyFrame* pKF = vpAllKFs[i];
+            const unsigned long nIDi = pKF->mnId;
+            if(nIDi>=nGraphKFs || !graph.vpKFs[nIDi])
+                continue;
+
+            KeyFrameAndPose::const_iterator it = NonCorrectedSim3.find(pKF);
+            const g2o::Sim3 &Siw = it!=NonCorrectedSim3.end() ? it->second : graph.vScw[nIDi];
+            const g2o::Sim3 &CorrectedSiw = graph.vCorrectedScw[nIDi];
+            vDist[i] = (Siw.inverse().translation()-CorrectedSiw.inverse().translation()).norm();
+            vAngle[i] = Siw.rotation().angularDistance(CorrectedSiw.rotation());
+            maxDist = max(maxDist,vDist[i]);
+            maxAngle = max(maxAngle,vAngle[i]);
+        }
+
+        const double th = 0.05;
+        unique_lock<mutex> lock(mMutexGBA);
+        for(size_t i=0, iend=vpAllKFs.size(); i<iend; i++)
+        {
+            if(vDist[i]<0 || vDist[i]>th*maxDist || vAngle[i]>th*maxAngle)
+                mspGBAPendingKFs.insert(vpAllKFs[i]);
+        }
+    }
+
     // Launch a new thread to perform Global Bundle Adjustment
     mbRunningGBA = true;
     mbFinishedGBA = false;
@@ -588,19 +641,34 @@ void LoopClosing::SearchAndFuse(const KeyFrameAndPose &CorrectedPosesMap)
 {
     ORBmatcher matcher(0.8);
 
+    const int nKFs = CorrectedPosesMap.size();
+    vector<KeyFrame*> vpKFs;
+    vector<cv::Mat> vScw;
+    vpKFs.reserve(nKFs);
+    vScw.reserve(nKFs);
     for(KeyFrameAndPose::const_iterator mit=CorrectedPosesMap.begin(), mend=CorrectedPosesMap.end(); mit!=mend;mit++)
     {
-        KeyFrame* pKF = mit->first;
-
-        g2o::Sim3 g2oScw = mit->second;
-        cv::Mat cvScw = Converter::toCvMat(g2oScw);
+        vpKFs.push_back(mit->first);
+        vScw.push_back(Converter::toCvMat(mit->second));
+    }
 
-        vector<MapPoint*> vpReplacePoints(mvpLoopMapPoints.size(),static_cast<MapPoint*>(NULL));
-        matcher.Fuse(pKF,cvScw,mvpLoopMapPoints,4,vpReplacePoints);
+    // Matches are searched for all keyframes in parallel, without modifying the map. They are fused
+    // afterwards in keyframe order, checked again against the map, as if each keyframe was fused in turn.
+    vector<vector<int> > vvnMatchIdx(nKFs);
+    mThreadPool.ParallelFor(nKFs,[&](int i)
+    {
+        ORBmatcher matcheri(0.8);
+        matcheri.SearchFuseCandidates(vpKFs[i],vScw[i],mvpLoopMapPoints,4,vvnMatchIdx[i]);
+    });
+
+    // Get Map Mutex
+    MapUpdateLock lock(mpMap);
+    const int nLP = mvpLoopMapPoints.size();
+    for(int k=0; k<nKFs; k++)
+    {
+        vector<MapPoint*> vpReplacePoints(nLP,static_cast<MapPoint*>(NULL));
+        matcher.FuseCandidates(vpKFs[k],mvpLoopMapPoints,vvnMatchIdx[k],vpReplacePoints);
 
-        // Get Map Mutex
-        unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
-        const int nLP = mvpLoopMapPoints.size();
         for(int i=0; i<nLP;i++)
         {
             MapPoint* pRep = vpReplacePoints[i];
@@ -636,8 +704,12 @@ void LoopClosing::ResetIfRequested()
     unique_lock<mutex> lock(mMutexReset);
     if(mbResetRequested)
     {
-        mlpLoopKeyFrameQueue.clear();
+        mqLoopKeyFrameQueue.Clear();
         mLastLoopKFid=0;
+        {
+            unique_lock<mutex> lockGBA(mMutexGBA);
+            mspGBAPendingKFs.clear();
+        }
         mbResetRequested=false;
     }
 }
@@ -647,7 +719,17 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
     cout << "Starting Global Bundle Adjustment" << endl;
 
     int idx =  mnFullBAIdx;
-    Optimizer::GlobalBundleAdjustemnt(mpMap,10,&mbStopGBA,nLoopKF,false);
+
+    vector<KeyFrame*> vpActiveKFs;
+    {
+        unique_lock<mutex> lock(mMutexGBA);
+        vpActiveKFs.assign(mspGBAPendingKFs.begin(),mspGBAPendingKFs.end());
+    }
+
+    // The optimizer holds all MapPoints, they cannot be reclaimed meanwhile
+    const int nMapParticipant = mpMap->RegisterParticipant();
+    Optimizer::IncrementalGlobalBundleAdjustment(mpMap,vpActiveKFs,10,&mbStopGBA,nLoopKF,false);
+    mpMap->UnregisterParticipant(nMapParticipant);
 
     // Update all MapPoints and KeyFrames
     // Local Mapping was active during BA, that means that there might be new keyframes
@@ -671,7 +753,7 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
             }
 
             // Get Map Mutex
-            unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+            MapUpdateLock lock(mpMap);
 
             // Correct keyframes starting at map first keyframe
             list<KeyFrame*> lpKFtoCheck(mpMap->mvpKeyFrameOrigins.begin(),mpMap->mvpKeyFrameOrigins.end());
@@ -700,11 +782,11 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
             }
 
             // Correct MapPoints
-            const vector<MapPoint*> vpMPs = mpMap->GetAllMapPoints();
+            const Map::MapPointSpan spanMPs = mpMap->GetMapPointSpan();
 
-            for(size_t i=0; i<vpMPs.size(); i++)
+            for(Map::MapPointSpan::const_iterator it=spanMPs.begin(), itend=spanMPs.end(); it!=itend; ++it)
             {
-                MapPoint* pMP = vpMPs[i];
+                MapPoint* pMP = *it;
 
                 if(pMP->isBad())
                     continue;
@@ -738,6 +820,8 @@ void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF)
 
             mpMap->InformNewBigChange();
 
+            mspGBAPendingKFs.clear();
+
             mpLocalMapper->Release();
 
             cout << "Map updated!" << endl;
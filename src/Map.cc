@@ -21,18 +21,24 @@
 #include "Map.h"
 
 #include<mutex>
+#include<fstream>
+#include<iostream>
+#include<unistd.h>
 
 namespace ORB_SLAM2
 {
 
-Map::Map():mnMaxKFid(0),mnBigChangeIdx(0)
+Map::Map():mnMaxKFid(0),mnEpoch(1),mnReclaimedMapPoints(0),mnBigChangeIdx(0),mnUpdateIdx(0)
 {
 }
 
 void Map::AddKeyFrame(KeyFrame *pKF)
 {
     unique_lock<mutex> lock(mMutexMap);
-    mspKeyFrames.insert(pKF);
+    if(pKF->mnMapIdx<0)
+    {
+        pKF->mnMapIdx = mKeyFrames.Insert(pKF);
+    }
     if(pKF->mnId>mnMaxKFid)
         mnMaxKFid=pKF->mnId;
 }
@@ -40,13 +46,23 @@ void Map::AddKeyFrame(KeyFrame *pKF)
 void Map::AddMapPoint(MapPoint *pMP)
 {
     unique_lock<mutex> lock(mMutexMap);
-    mspMapPoints.insert(pMP);
+    if(pMP->mnMapIdx>=0)
+        return;
+    pMP->mnMapIdx = mMapPoints.Insert(pMP);
+    mPointIndex.Insert(pMP);
 }
 
 void Map::EraseMapPoint(MapPoint *pMP)
 {
     unique_lock<mutex> lock(mMutexMap);
-    mspMapPoints.erase(pMP);
+    if(pMP->mnMapIdx<0)
+        return;
+    mMapPoints.Erase(pMP->mnMapIdx);
+    pMP->mnMapIdx = -1;
+    mPointIndex.Erase(pMP);
+
+    unique_lock<mutex> lock2(mMutexReclaim);
+    mvRetiredMapPoints.push_back(make_pair(pMP,mnEpoch));
 
     // TODO: This only erase the pointer.
     // Delete the MapPoint
@@ -55,7 +71,13 @@ void Map::EraseMapPoint(MapPoint *pMP)
 void Map::EraseKeyFrame(KeyFrame *pKF)
 {
     unique_lock<mutex> lock(mMutexMap);
-    mspKeyFrames.erase(pKF);
+    if(pKF->mnMapIdx<0)
+        return;
+    mKeyFrames.Erase(pKF->mnMapIdx);
+    pKF->mnMapIdx = -1;
+
+    unique_lock<mutex> lock2(mMutexReclaim);
+    mvRetiredKeyFrames.push_back(make_pair(pKF,mnEpoch));
 
     // TODO: This only erase the pointer.
     // Delete the MapPoint
@@ -79,28 +101,66 @@ int Map::GetLastBigChangeIdx()
     return mnBigChangeIdx;
 }
 
+void Map::BeginUpdate()
+{
+    unique_lock<mutex> lock(mMutexMap);
+    mnUpdateIdx++;
+}
+
+void Map::EndUpdate()
+{
+    unique_lock<mutex> lock(mMutexMap);
+    mnUpdateIdx++;
+}
+
+unsigned long Map::GetUpdateIdx()
+{
+    unique_lock<mutex> lock(mMutexMap);
+    return mnUpdateIdx;
+}
+
 vector<KeyFrame*> Map::GetAllKeyFrames()
 {
     unique_lock<mutex> lock(mMutexMap);
-    return vector<KeyFrame*>(mspKeyFrames.begin(),mspKeyFrames.end());
+    const KeyFrameSpan span = mKeyFrames.GetSpan();
+    vector<KeyFrame*> vpKFs;
+    vpKFs.reserve(mKeyFrames.Count());
+    for(KeyFrameSpan::const_iterator it=span.begin(), itend=span.end(); it!=itend; ++it)
+        vpKFs.push_back(*it);
+    return vpKFs;
 }
 
 vector<MapPoint*> Map::GetAllMapPoints()
 {
     unique_lock<mutex> lock(mMutexMap);
-    return vector<MapPoint*>(mspMapPoints.begin(),mspMapPoints.end());
+    const MapPointSpan span = mMapPoints.GetSpan();
+    vector<MapPoint*> vpMPs;
+    vpMPs.reserve(mMapPoints.Count());
+    for(MapPointSpan::const_iterator it=span.begin(), itend=span.end(); it!=itend; ++it)
+        vpMPs.push_back(*it);
+    return vpMPs;
+}
+
+Map::KeyFrameSpan Map::GetKeyFrameSpan()
+{
+    return mKeyFrames.GetSpan();
+}
+
+Map::MapPointSpan Map::GetMapPointSpan()
+{
+    return mMapPoints.GetSpan();
 }
 
 long unsigned int Map::MapPointsInMap()
 {
     unique_lock<mutex> lock(mMutexMap);
-    return mspMapPoints.size();
+    return mMapPoints.Count();
 }
 
 long unsigned int Map::KeyFramesInMap()
 {
     unique_lock<mutex> lock(mMutexMap);
-    return mspKeyFrames.size();
+    return mKeyFrames.Count();
 }
 
 vector<MapPoint*> Map::GetReferenceMapPoints()
@@ -109,25 +169,188 @@ vector<MapPoint*> Map::GetReferenceMapPoints()
     return mvpReferenceMapPoints;
 }
 
+vector<MapPoint*> Map::GetMapPointsInFrustum(const cv::Mat &Tcw, const float fx, const float fy, const float cx, const float cy,
+                                             const float minX, const float maxX, const float minY, const float maxY,
+                                             const float maxDepth)
+{
+    return mPointIndex.GetPointsInFrustum(Tcw,fx,fy,cx,cy,minX,maxX,minY,maxY,maxDepth);
+}
+
+vector<MapPoint*> Map::GetMapPointsInRadius(const cv::Mat &x3Dw, const float r)
+{
+    return mPointIndex.GetPointsInRadius(x3Dw,r);
+}
+
+void Map::UpdateMapPointIndex(MapPoint *pMP)
+{
+    mPointIndex.Update(pMP);
+}
+
 long unsigned int Map::GetMaxKFid()
 {
     unique_lock<mutex> lock(mMutexMap);
     return mnMaxKFid;
 }
 
+int Map::RegisterParticipant()
+{
+    unique_lock<mutex> lock(mMutexReclaim);
+    for(size_t i=0; i<mvnParticipantEpochs.size(); i++)
+    {
+        if(mvnParticipantEpochs[i]==0)
+        {
+            mvnParticipantEpochs[i] = ++mnEpoch;
+            return i;
+        }
+    }
+    mvnParticipantEpochs.push_back(++mnEpoch);
+    return mvnParticipantEpochs.size()-1;
+}
+
+void Map::UnregisterParticipant(const int nId)
+{
+    unique_lock<mutex> lock(mMutexReclaim);
+    mvnParticipantEpochs[nId] = 0;
+}
+
+void Map::QuiescentState(const int nId)
+{
+    unique_lock<mutex> lock(mMutexReclaim);
+    mvnParticipantEpochs[nId] = ++mnEpoch;
+}
+
+void Map::Reclaim()
+{
+    vector<MapPoint*> vpToDelete;
+    vector<KeyFrame*> vpToRelease;
+    {
+        unique_lock<mutex> lock(mMutexReclaim);
+
+        // Objects erased before this epoch are not referenced anymore
+        unsigned long nSafeEpoch = mnEpoch+1;
+        for(vector<unsigned long>::iterator vit=mvnParticipantEpochs.begin(), vend=mvnParticipantEpochs.end(); vit!=vend; vit++)
+            if(*vit>0 && *vit<nSafeEpoch)
+                nSafeEpoch = *vit;
+
+        size_t j=0;
+        for(size_t i=0; i<mvRetiredMapPoints.size(); i++)
+        {
+            if(mvRetiredMapPoints[i].second<nSafeEpoch)
+                vpToDelete.push_back(mvRetiredMapPoints[i].first);
+            else
+                mvRetiredMapPoints[j++] = mvRetiredMapPoints[i];
+        }
+        mvRetiredMapPoints.resize(j);
+
+        j=0;
+        for(size_t i=0; i<mvRetiredKeyFrames.size(); i++)
+        {
+            if(mvRetiredKeyFrames[i].second<nSafeEpoch)
+                vpToRelease.push_back(mvRetiredKeyFrames[i].first);
+            else
+                mvRetiredKeyFrames[j++] = mvRetiredKeyFrames[i];
+        }
+        mvRetiredKeyFrames.resize(j);
+        mvpReleasedKeyFrames.insert(mvpReleasedKeyFrames.end(),vpToRelease.begin(),vpToRelease.end());
+        mnReclaimedMapPoints += vpToDelete.size();
+    }
+
+    if(vpToDelete.empty() && vpToRelease.empty())
+        return;
+
+    // The reference MapPoints are only read by the viewer, drop the bad ones before deleting
+    {
+        unique_lock<mutex> lock(mMutexMap);
+        size_t j=0;
+        for(size_t i=0; i<mvpReferenceMapPoints.size(); i++)
+        {
+            MapPoint* pMP = mvpReferenceMapPoints[i];
+            if(pMP && !pMP->isBad())
+                mvpReferenceMapPoints[j++] = pMP;
+        }
+        mvpReferenceMapPoints.resize(j);
+    }
+
+    for(vector<MapPoint*>::iterator vit=vpToDelete.begin(), vend=vpToDelete.end(); vit!=vend; vit++)
+        delete *vit;
+
+    for(vector<KeyFrame*>::iterator vit=vpToRelease.begin(), vend=vpToRelease.end(); vit!=vend; vit++)
+        (*vit)->ReleaseMatchingData();
+}
+
+void Map::PrintMemoryUsage()
+{
+    size_t nMapPoints, nKeyFrames, nRetiredMapPoints, nRetiredKeyFrames, nReleasedKeyFrames;
+    unsigned long nReclaimedMapPoints;
+    {
+        unique_lock<mutex> lock(mMutexMap);
+        nMapPoints = mMapPoints.Count();
+        nKeyFrames = mKeyFrames.Count();
+    }
+    {
+        unique_lock<mutex> lock(mMutexReclaim);
+        nRetiredMapPoints = mvRetiredMapPoints.size();
+        nRetiredKeyFrames = mvRetiredKeyFrames.size();
+        nReleasedKeyFrames = mvpReleasedKeyFrames.size();
+        nReclaimedMapPoints = mnReclaimedMapPoints;
+    }
+
+    // Resident set size (Linux)
+    long nResidentPages = 0;
+    {
+        ifstream f("/proc/self/statm");
+        long nTotalPages;
+        f >> nTotalPages >> nResidentPages;
+    }
+    const double residentMB = nResidentPages*(double)sysconf(_SC_PAGESIZE)/(1024.0*1024.0);
+
+    cout << "Map memory: " << nKeyFrames << " KFs (" << nRetiredKeyFrames << " pending, " << nReleasedKeyFrames << " released), "
+         << nMapPoints << " MPs (" << nRetiredMapPoints << " pending, " << nReclaimedMapPoints << " reclaimed), "
+         << "slabs " << KeyFrame::GetAllocator().Capacity() << " KFs / " << MapPoint::GetAllocator().Capacity() << " MPs, "
+         << "RSS " << residentMB << " MB" << endl;
+}
+
 void Map::clear()
 {
-    for(set<MapPoint*>::iterator sit=mspMapPoints.begin(), send=mspMapPoints.end(); sit!=send; sit++)
-        delete *sit;
+    unique_lock<mutex> lock(mMutexMap);
+    unique_lock<mutex> lock2(mMutexReclaim);
+
+    const MapPointSpan spanMPs = mMapPoints.GetSpan();
+    for(MapPointSpan::const_iterator it=spanMPs.begin(), itend=spanMPs.end(); it!=itend; ++it)
+        delete *it;
+
+    const KeyFrameSpan spanKFs = mKeyFrames.GetSpan();
+    for(KeyFrameSpan::const_iterator it=spanKFs.begin(), itend=spanKFs.end(); it!=itend; ++it)
+        delete *it;
 
-    for(set<KeyFrame*>::iterator sit=mspKeyFrames.begin(), send=mspKeyFrames.end(); sit!=send; sit++)
-        delete *sit;
+    for(vector<pair<MapPoint*,unsigned long> >::iterator vit=mvRetiredMapPoints.begin(), vend=mvRetiredMapPoints.end(); vit!=vend; vit++)
+        delete vit->first;
 
-    mspMapPoints.clear();
-    mspKeyFrames.clear();
+    for(vector<pair<KeyFrame*,unsigned long> >::iterator vit=mvRetiredKeyFrames.begin(), vend=mvRetiredKeyFrames.end(); vit!=vend; vit++)
+        delete vit->first;
+
+    for(vector<KeyFrame*>::iterator vit=mvpReleasedKeyFrames.begin(), vend=mvpReleasedKeyFrames.end(); vit!=vend; vit++)
+        delete *vit;
+
+    mMapPoints.Clear();
+    mKeyFrames.Clear();
+    mPointIndex.clear();
+    mvRetiredMapPoints.clear();
+    mvRetiredKeyFrames.clear();
+    mvpReleasedKeyFrames.clear();
     mnMaxKFid = 0;
     mvpReferenceMapPoints.clear();
     mvpKeyFrameOrigins.clear();
 }
 
+MapUpdateLock::MapUpdateLock(Map *pMap):mpMap(pMap), mLock(pMap->mMutexMapUpdate)
+{
+    mpMap->BeginUpdate();
+}
+
+MapUpdateLock::~MapUpdateLock()
+{
+    mpMap->EndUpdate();
+}
+
 } //namespace ORB_SLAM
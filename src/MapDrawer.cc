@@ -43,24 +43,25 @@ MapDrawer::MapDrawer(Map* pMap, const string &strSettingPath):mpMap(pMap)
 
 void MapDrawer::DrawMapPoints()
 {
-    const vector<MapPoint*> &vpMPs = mpMap->GetAllMapPoints();
+    const Map::MapPointSpan spanMPs = mpMap->GetMapPointSpan();
     const vector<MapPoint*> &vpRefMPs = mpMap->GetReferenceMapPoints();
 
     set<MapPoint*> spRefMPs(vpRefMPs.begin(), vpRefMPs.end());
 
-    if(vpMPs.empty())
+    if(spanMPs.begin()==spanMPs.end())
         return;
 
     glPointSize(mPointSize);
     glBegin(GL_POINTS);
     glColor3f(0.0,0.0,0.0);
 
-    for(size_t i=0, iend=vpMPs.size(); i<iend;i++)
+    for(Map::MapPointSpan::const_iterator it=spanMPs.begin(), itend=spanMPs.end(); it!=itend; ++it)
     {
-        if(vpMPs[i]->isBad() || spRefMPs.count(vpMPs[i]))
+        MapPoint* pMP = *it;
+        if(pMP->isBad() || spRefMPs.count(pMP))
             continue;
-        cv::Mat pos = vpMPs[i]->GetWorldPos();
-        glVertex3f(pos.at<float>(0),pos.at<float>(1),pos.at<float>(2));
+        const cv::Vec3f pos = pMP->GetWorldPos3f();
+        glVertex3f(pos[0],pos[1],pos[2]);
     }
     glEnd();
 
@@ -86,13 +87,13 @@ void MapDrawer::DrawKeyFrames(const bool bDrawKF, const bool bDrawGraph)
     const float h = w*0.75;
     const float z = w*0.6;
 
-    const vector<KeyFrame*> vpKFs = mpMap->GetAllKeyFrames();
+    const Map::KeyFrameSpan spanKFs = mpMap->GetKeyFrameSpan();
 
     if(bDrawKF)
     {
-        for(size_t i=0; i<vpKFs.size(); i++)
+        for(Map::KeyFrameSpan::const_iterator it=spanKFs.begin(), itend=spanKFs.end(); it!=itend; ++it)
         {
-            KeyFrame* pKF = vpKFs[i];
+            KeyFrame* pKF = *it;
             cv::Mat Twc = pKF->GetPoseInverse().t();
 
             glPushMatrix();
@@ -134,16 +135,18 @@ void MapDrawer::DrawKeyFrames(const bool bDrawKF, const bool bDrawGraph)
         glColor4f(0.0f,1.0f,0.0f,0.6f);
         glBegin(GL_LINES);
 
-        for(size_t i=0; i<vpKFs.size(); i++)
+        for(Map::KeyFrameSpan::const_iterator it=spanKFs.begin(), itend=spanKFs.end(); it!=itend; ++it)
         {
+            KeyFrame* pKF = *it;
+
             // Covisibility Graph
-            const vector<KeyFrame*> vCovKFs = vpKFs[i]->GetCovisiblesByWeight(100);
-            cv::Mat Ow = vpKFs[i]->GetCameraCenter();
+            const vector<KeyFrame*> vCovKFs = pKF->GetCovisiblesByWeight(100);
+            cv::Mat Ow = pKF->GetCameraCenter();
             if(!vCovKFs.empty())
             {
                 for(vector<KeyFrame*>::const_iterator vit=vCovKFs.begin(), vend=vCovKFs.end(); vit!=vend; vit++)
                 {
-                    if((*vit)->mnId<vpKFs[i]->mnId)
+                    if((*vit)->mnId<pKF->mnId)
                         continue;
                     cv::Mat Ow2 = (*vit)->GetCameraCenter();
                     glVertex3f(Ow.at<float>(0),Ow.at<float>(1),Ow.at<float>(2));
@@ -152,7 +155,7 @@ void MapDrawer::DrawKeyFrames(const bool bDrawKF, const bool bDrawGraph)
             }
 
             // Spanning tree
-            KeyFrame* pParent = vpKFs[i]->GetParent();
+            KeyFrame* pParent = pKF->GetParent();
             if(pParent)
             {
                 cv::Mat Owp = pParent->GetCameraCenter();
@@ -161,10 +164,10 @@ void MapDrawer::DrawKeyFrames(const bool bDrawKF, const bool bDrawGraph)
             }
 
             // Loops
-            set<KeyFrame*> sLoopKFs = vpKFs[i]->GetLoopEdges();
+            set<KeyFrame*> sLoopKFs = pKF->GetLoopEdges();
             for(set<KeyFrame*>::iterator sit=sLoopKFs.begin(), send=sLoopKFs.end(); sit!=send; sit++)
             {
-                if((*sit)->mnId<vpKFs[i]->mnId)
+                if((*sit)->mnId<pKF->mnId)
                     continue;
                 cv::Mat Owl = (*sit)->GetCameraCenter();
                 glVertex3f(Ow.at<float>(0),Ow.at<float>(1),Ow.at<float>(2));
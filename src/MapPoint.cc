@@ -22,21 +22,25 @@
 #include "ORBmatcher.h"
 
 #include<mutex>
+#include<algorithm>
+#include<cstring>
 
 namespace ORB_SLAM2
 {
 
 long unsigned int MapPoint::nNextId=0;
 mutex MapPoint::mGlobalMutex;
+const size_t MapPoint::MAX_DESC_SAMPLES;
+static_assert(ORBmatcher::DESC_WORDS==4,"MapPoint::mvDescSamples is sized for 4 words per descriptor");
 
 MapPoint::MapPoint(const cv::Mat &Pos, KeyFrame *pRefKF, Map* pMap):
-    mnFirstKFid(pRefKF->mnId), mnFirstFrame(pRefKF->mnFrameId), nObs(0), mnTrackReferenceForFrame(0),
+    mnFirstKFid(pRefKF->mnId), mnFirstFrame(pRefKF->mnFrameId), nObs(0), mnMapIdx(-1), mnIndexKey(0), mbInIndex(false), mnTrackReferenceForFrame(0),
     mnLastFrameSeen(0), mnBALocalForKF(0), mnFuseCandidateForKF(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
-    mnCorrectedReference(0), mnBAGlobalForKF(0), mpRefKF(pRefKF), mnVisible(1), mnFound(1), mbBad(false),
-    mpReplaced(static_cast<MapPoint*>(NULL)), mfMinDistance(0), mfMaxDistance(0), mpMap(pMap)
+    mnCorrectedReference(0), mnBAGlobalForKF(0), mnDescSeen(0), mpRefKF(pRefKF), mnVisible(1), mnFound(1), mbBad(false),
+    mpReplaced(static_cast<MapPoint*>(NULL)), mpMap(pMap)
 {
-    Pos.copyTo(mWorldPos);
-    mNormalVector = cv::Mat::zeros(3,1,CV_32F);
+    float data[POS_DATA_SIZE] = {Pos.at<float>(0), Pos.at<float>(1), Pos.at<float>(2), 0, 0, 0, 0, 0};
+    mPosData.Write(data);
 
     // MapPoints can be created from Tracking and Local Mapping. This mutex avoid conflicts with id.
     unique_lock<mutex> lock(mpMap->mMutexPointCreation);
@@ -44,24 +48,27 @@ MapPoint::MapPoint(const cv::Mat &Pos, KeyFrame *pRefKF, Map* pMap):
 }
 
 MapPoint::MapPoint(const cv::Mat &Pos, Map* pMap, Frame* pFrame, const int &idxF):
-    mnFirstKFid(-1), mnFirstFrame(pFrame->mnId), nObs(0), mnTrackReferenceForFrame(0), mnLastFrameSeen(0),
+    mnFirstKFid(-1), mnFirstFrame(pFrame->mnId), nObs(0), mnMapIdx(-1), mnIndexKey(0), mbInIndex(false), mnTrackReferenceForFrame(0), mnLastFrameSeen(0),
     mnBALocalForKF(0), mnFuseCandidateForKF(0),mnLoopPointForKF(0), mnCorrectedByKF(0),
-    mnCorrectedReference(0), mnBAGlobalForKF(0), mpRefKF(static_cast<KeyFrame*>(NULL)), mnVisible(1),
+    mnCorrectedReference(0), mnBAGlobalForKF(0), mnDescSeen(0), mpRefKF(static_cast<KeyFrame*>(NULL)), mnVisible(1),
     mnFound(1), mbBad(false), mpReplaced(NULL), mpMap(pMap)
 {
-    Pos.copyTo(mWorldPos);
     cv::Mat Ow = pFrame->GetCameraCenter();
-    mNormalVector = mWorldPos - Ow;
-    mNormalVector = mNormalVector/cv::norm(mNormalVector);
-
     cv::Mat PC = Pos - Ow;
     const float dist = cv::norm(PC);
+    cv::Mat normal = PC/dist;
+
     const int level = pFrame->mvKeysUn[idxF].octave;
     const float levelScaleFactor =  pFrame->mvScaleFactors[level];
     const int nLevels = pFrame->mnScaleLevels;
 
-    mfMaxDistance = dist*levelScaleFactor;
-    mfMinDistance = mfMaxDistance/pFrame->mvScaleFactors[nLevels-1];
+    const float maxDistance = dist*levelScaleFactor;
+    const float minDistance = maxDistance/pFrame->mvScaleFactors[nLevels-1];
+
+    float data[POS_DATA_SIZE] = {Pos.at<float>(0), Pos.at<float>(1), Pos.at<float>(2),
+                                 normal.at<float>(0), normal.at<float>(1), normal.at<float>(2),
+                                 minDistance, maxDistance};
+    mPosData.Write(data);
 
     pFrame->mDescriptors.row(idxF).copyTo(mDescriptor);
 
@@ -70,23 +77,69 @@ MapPoint::MapPoint(const cv::Mat &Pos, Map* pMap, Frame* pFrame, const int &idxF
     mnId=nNextId++;
 }
 
+void* MapPoint::operator new(size_t nSize)
+{
+    return GetAllocator().Allocate(nSize);
+}
+
+void MapPoint::operator delete(void* p, size_t nSize)
+{
+    GetAllocator().Deallocate(p,nSize);
+}
+
+SlabAllocator<MapPoint>& MapPoint::GetAllocator()
+{
+    static SlabAllocator<MapPoint> allocator;
+    return allocator;
+}
+
 void MapPoint::SetWorldPos(const cv::Mat &Pos)
 {
-    unique_lock<mutex> lock2(mGlobalMutex);
-    unique_lock<mutex> lock(mMutexPos);
-    Pos.copyTo(mWorldPos);
+    {
+        unique_lock<mutex> lock2(mGlobalMutex);
+        unique_lock<mutex> lock(mMutexPos);
+        float data[POS_DATA_SIZE];
+        mPosData.Read(data);
+        for(int i=0; i<3; i++)
+            data[POS_DATA_POS+i] = Pos.at<float>(i);
+        mPosData.Write(data);
+    }
+
+    mpMap->UpdateMapPointIndex(this);
 }
 
 cv::Mat MapPoint::GetWorldPos()
 {
-    unique_lock<mutex> lock(mMutexPos);
-    return mWorldPos.clone();
+    return cv::Mat(GetWorldPos3f());
 }
 
 cv::Mat MapPoint::GetNormal()
 {
-    unique_lock<mutex> lock(mMutexPos);
-    return mNormalVector.clone();
+    return cv::Mat(GetNormal3f());
+}
+
+cv::Vec3f MapPoint::GetWorldPos3f()
+{
+    float data[POS_DATA_SIZE];
+    mPosData.Read(data);
+    return cv::Vec3f(data[POS_DATA_POS],data[POS_DATA_POS+1],data[POS_DATA_POS+2]);
+}
+
+cv::Vec3f MapPoint::GetNormal3f()
+{
+    float data[POS_DATA_SIZE];
+    mPosData.Read(data);
+    return cv::Vec3f(data[POS_DATA_NORMAL],data[POS_DATA_NORMAL+1],data[POS_DATA_NORMAL+2]);
+}
+
+void MapPoint::GetGeometry(cv::Vec3f &Pos, cv::Vec3f &Normal, float &minDistance, float &maxDistance)
+{
+    float data[POS_DATA_SIZE];
+    mPosData.Read(data);
+    Pos = cv::Vec3f(data[POS_DATA_POS],data[POS_DATA_POS+1],data[POS_DATA_POS+2]);
+    Normal = cv::Vec3f(data[POS_DATA_NORMAL],data[POS_DATA_NORMAL+1],data[POS_DATA_NORMAL+2]);
+    minDistance = data[POS_DATA_MIN_DISTANCE];
+    maxDistance = data[POS_DATA_MAX_DISTANCE];
 }
 
 KeyFrame* MapPoint::GetReferenceKeyFrame()
@@ -97,68 +150,188 @@ KeyFrame* MapPoint::GetReferenceKeyFrame()
 
 void MapPoint::AddObservation(KeyFrame* pKF, size_t idx)
 {
-    unique_lock<mutex> lock(mMutexFeatures);
-    if(mObservations.count(pKF))
-        return;
-    mObservations[pKF]=idx;
+    vector<KeyFrame*> vpOtherKFs;
+    {
+        unique_lock<mutex> lock(mMutexFeatures);
+        if(mbBad)
+            return;
+        ObservationList::iterator it = FindObservation(pKF);
+        if(it!=mObservations.end() && it->first==pKF)
+            return;
 
-    if(pKF->mvuRight[idx]>=0)
-        nObs+=2;
-    else
-        nObs++;
+        vpOtherKFs.reserve(mObservations.size());
+        for(ObservationList::const_iterator mit=mObservations.begin(), mend=mObservations.end(); mit!=mend; mit++)
+            vpOtherKFs.push_back(mit->first);
+
+        mObservations.insert(it,make_pair(pKF,idx));
+
+        const int level = pKF->mvKeysUn[idx].octave;
+        while(mvnObsPerLevel.size()<=static_cast<size_t>(level))
+            mvnObsPerLevel.push_back(0);
+        mvnObsPerLevel[level]++;
+
+        // Reservoir sampling: once full, the k-th observation replaces a sample with probability MAX_DESC_SAMPLES/k
+        mnDescSeen++;
+        if(mvpDescSampleKFs.size()<MAX_DESC_SAMPLES)
+            AddDescriptorSample(pKF,idx);
+        else
+        {
+            // Deterministic per point hash instead of a shared random generator
+            unsigned long h = mnId*2654435761ul ^ mnDescSeen*40503ul;
+            h ^= h>>15;
+            h *= 0x2c1b3c6dul;
+            h ^= h>>12;
+            const size_t j = h%mnDescSeen;
+            if(j<MAX_DESC_SAMPLES)
+            {
+                EraseDescriptorSample(j);
+                AddDescriptorSample(pKF,idx);
+            }
+        }
+
+        if(pKF->mvuRight[idx]>=0)
+            nObs+=2;
+        else
+            nObs++;
+    }
+
+    UpdateCovisibility(pKF,vpOtherKFs,1);
 }
 
 void MapPoint::EraseObservation(KeyFrame* pKF)
 {
     bool bBad=false;
+    vector<KeyFrame*> vpOtherKFs;
     {
         unique_lock<mutex> lock(mMutexFeatures);
-        if(mObservations.count(pKF))
+        ObservationList::iterator it = FindObservation(pKF);
+        if(it!=mObservations.end() && it->first==pKF)
         {
-            int idx = mObservations[pKF];
+            int idx = it->second;
             if(pKF->mvuRight[idx]>=0)
                 nObs-=2;
             else
                 nObs--;
 
-            mObservations.erase(pKF);
-
-            if(mpRefKF==pKF)
-                mpRefKF=mObservations.begin()->first;
+            mObservations.erase(it);
+            mvnObsPerLevel[pKF->mvKeysUn[idx].octave]--;
+
+            const size_t nSamples = mvpDescSampleKFs.size();
+            for(size_t i=0; i<nSamples; i++)
+            {
+                if(mvpDescSampleKFs[i]!=pKF)
+                    continue;
+
+                EraseDescriptorSample(i);
+
+                // Refill the sample with an observation that is not in it
+                if(mObservations.size()>=nSamples)
+                {
+                    for(ObservationList::const_iterator mit=mObservations.begin(), mend=mObservations.end(); mit!=mend; mit++)
+                    {
+                        if(find(mvpDescSampleKFs.begin(),mvpDescSampleKFs.end(),mit->first)==mvpDescSampleKFs.end())
+                        {
+                            AddDescriptorSample(mit->first,mit->second);
+                            break;
+                        }
+                    }
+                }
+                break;
+            }
+
+            if(mpRefKF==pKF && !mObservations.empty())
+                mpRefKF=mObservations.front().first;
 
             // If only 2 observations or less, discard point
             if(nObs<=2)
                 bBad=true;
+
+            vpOtherKFs.reserve(mObservations.size());
+            for(ObservationList::const_iterator mit=mObservations.begin(), mend=mObservations.end(); mit!=mend; mit++)
+                vpOtherKFs.push_back(mit->first);
         }
     }
 
+    UpdateCovisibility(pKF,vpOtherKFs,-1);
+
     if(bBad)
         SetBadFlag();
 }
 
+void MapPoint::UpdateCovisibility(KeyFrame* pKF, const vector<KeyFrame*> &vpKFs, const int nDelta)
+{
+    for(vector<KeyFrame*>::const_iterator vit=vpKFs.begin(), vend=vpKFs.end(); vit!=vend; vit++)
+    {
+        pKF->UpdateWeight(*vit,nDelta);
+        (*vit)->UpdateWeight(pKF,nDelta);
+    }
+}
+
+void MapPoint::EraseCovisibility(const ObservationList &obs)
+{
+    vector<KeyFrame*> vpKFs;
+    vpKFs.reserve(obs.size());
+    for(ObservationList::const_iterator mit=obs.begin(), mend=obs.end(); mit!=mend; mit++)
+    {
+        UpdateCovisibility(mit->first,vpKFs,-1);
+        vpKFs.push_back(mit->first);
+    }
+}
+
 map<KeyFrame*, size_t> MapPoint::GetObservations()
+{
+    unique_lock<mutex> lock(mMutexFeatures);
+    return map<KeyFrame*,size_t>(mObservations.begin(),mObservations.end());
+}
+
+MapPoint::ObservationList MapPoint::GetObservationList()
 {
     unique_lock<mutex> lock(mMutexFeatures);
     return mObservations;
 }
 
+static bool ObservationComp(const MapPoint::Observation &obs, KeyFrame* pKF)
+{
+    return obs.first<pKF;
+}
+
+MapPoint::ObservationList::iterator MapPoint::FindObservation(KeyFrame *pKF)
+{
+    return lower_bound(mObservations.begin(),mObservations.end(),pKF,ObservationComp);
+}
+
 int MapPoint::Observations()
 {
     unique_lock<mutex> lock(mMutexFeatures);
     return nObs;
 }
 
+int MapPoint::ObservationsUpToLevel(const int &level)
+{
+    unique_lock<mutex> lock(mMutexFeatures);
+    const size_t nLevels = min(mvnObsPerLevel.size(),static_cast<size_t>(max(level+1,0)));
+    int n=0;
+    for(size_t i=0; i<nLevels; i++)
+        n+=mvnObsPerLevel[i];
+    return n;
+}
+
 void MapPoint::SetBadFlag()
 {
-    map<KeyFrame*,size_t> obs;
+    ObservationList obs;
     {
         unique_lock<mutex> lock1(mMutexFeatures);
         unique_lock<mutex> lock2(mMutexPos);
         mbBad=true;
         obs = mObservations;
         mObservations.clear();
+        mvnObsPerLevel.clear();
+        mvDescSamples.clear();
+        mvpDescSampleKFs.clear();
+        mvnDescDistSums.clear();
     }
-    for(map<KeyFrame*,size_t>::iterator mit=obs.begin(), mend=obs.end(); mit!=mend; mit++)
+    EraseCovisibility(obs);
+    for(ObservationList::const_iterator mit=obs.begin(), mend=obs.end(); mit!=mend; mit++)
     {
         KeyFrame* pKF = mit->first;
         pKF->EraseMapPointMatch(mit->second);
@@ -180,19 +353,26 @@ void MapPoint::Replace(MapPoint* pMP)
         return;
 
     int nvisible, nfound;
-    map<KeyFrame*,size_t> obs;
+    ObservationList obs;
     {
         unique_lock<mutex> lock1(mMutexFeatures);
         unique_lock<mutex> lock2(mMutexPos);
         obs=mObservations;
         mObservations.clear();
+        mvnObsPerLevel.clear();
+        mvDescSamples.clear();
+        mvpDescSampleKFs.clear();
+        mvnDescDistSums.clear();
         mbBad=true;
         nvisible = mnVisible;
         nfound = mnFound;
         mpReplaced = pMP;
     }
 
-    for(map<KeyFrame*,size_t>::iterator mit=obs.begin(), mend=obs.end(); mit!=mend; mit++)
+    // The covisibility contributed by this point moves to pMP with the observations
+    EraseCovisibility(obs);
+
+    for(ObservationList::const_iterator mit=obs.begin(), mend=obs.end(); mit!=mend; mit++)
     {
         // Replace measurement in keyframe
         KeyFrame* pKF = mit->first;
@@ -201,6 +381,10 @@ void MapPoint::Replace(MapPoint* pMP)
         {
             pKF->ReplaceMapPointMatch(mit->second, pMP);
             pMP->AddObservation(pKF,mit->second);
+
+            // pMP may have been set bad meanwhile, without this observation
+            if(pMP->isBad())
+                pKF->EraseMapPointMatch(mit->second);
         }
         else
         {
@@ -241,69 +425,60 @@ float MapPoint::GetFoundRatio()
 
 void MapPoint::ComputeDistinctiveDescriptors()
 {
-    // Retrieve all observed descriptors
-    vector<cv::Mat> vDescriptors;
-
-    map<KeyFrame*,size_t> observations;
-
-    {
-        unique_lock<mutex> lock1(mMutexFeatures);
-        if(mbBad)
-            return;
-        observations=mObservations;
-    }
-
-    if(observations.empty())
+    // Take the sampled descriptor with least total distance to the rest
+    unique_lock<mutex> lock(mMutexFeatures);
+    if(mbBad || mvnDescDistSums.empty())
         return;
 
-    vDescriptors.reserve(observations.size());
-
-    for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
-    {
-        KeyFrame* pKF = mit->first;
-
-        if(!pKF->isBad())
-            vDescriptors.push_back(pKF->mDescriptors.row(mit->second));
-    }
+    const size_t bestIdx = min_element(mvnDescDistSums.begin(),mvnDescDistSums.end())-mvnDescDistSums.begin();
+    KeyFrame* pKF = mvpDescSampleKFs[bestIdx];
+    ObservationList::iterator it = FindObservation(pKF);
+    if(it!=mObservations.end() && it->first==pKF)
+        mDescriptor = pKF->mDescriptors.row(it->second).clone();
+}
 
-    if(vDescriptors.empty())
-        return;
+void MapPoint::AddDescriptorSample(KeyFrame *pKF, size_t idx)
+{
+    uint64_t desc[ORBmatcher::DESC_WORDS];
+    memcpy(desc,pKF->mDescriptors.ptr(idx),sizeof(desc));
 
-    // Compute distances between them
-    const size_t N = vDescriptors.size();
+    const size_t N = mvpDescSampleKFs.size();
+    int vDists[MAX_DESC_SAMPLES];
+    if(N>0)
+        ORBmatcher::DescriptorDistances(desc,&mvDescSamples[0],N,vDists);
 
-    float Distances[N][N];
-    for(size_t i=0;i<N;i++)
+    int sum = 0;
+    for(size_t i=0; i<N; i++)
     {
-        Distances[i][i]=0;
-        for(size_t j=i+1;j<N;j++)
-        {
-            int distij = ORBmatcher::DescriptorDistance(vDescriptors[i],vDescriptors[j]);
-            Distances[i][j]=distij;
-            Distances[j][i]=distij;
-        }
+        mvnDescDistSums[i] += vDists[i];
+        sum += vDists[i];
     }
 
-    // Take the descriptor with least median distance to the rest
-    int BestMedian = INT_MAX;
-    int BestIdx = 0;
-    for(size_t i=0;i<N;i++)
-    {
-        vector<int> vDists(Distances[i],Distances[i]+N);
-        sort(vDists.begin(),vDists.end());
-        int median = vDists[0.5*(N-1)];
-
-        if(median<BestMedian)
-        {
-            BestMedian = median;
-            BestIdx = i;
-        }
-    }
+    mvDescSamples.resize((N+1)*ORBmatcher::DESC_WORDS);
+    copy(desc,desc+ORBmatcher::DESC_WORDS,mvDescSamples.begin()+N*ORBmatcher::DESC_WORDS);
+    mvpDescSampleKFs.push_back(pKF);
+    mvnDescDistSums.push_back(sum);
+}
 
+void MapPoint::EraseDescriptorSample(size_t i)
+{
+    const size_t N = mvpDescSampleKFs.size();
+    int vDists[MAX_DESC_SAMPLES];
+    ORBmatcher::DescriptorDistances(&mvDescSamples[i*ORBmatcher::DESC_WORDS],&mvDescSamples[0],N,vDists);
+    for(size_t j=0; j<N; j++)
+        mvnDescDistSums[j] -= vDists[j];
+
+    // Move the last sample into the freed slot
+    const size_t last = N-1;
+    if(i!=last)
     {
-        unique_lock<mutex> lock(mMutexFeatures);
-        mDescriptor = vDescriptors[BestIdx].clone();
+        copy(mvDescSamples.begin()+last*ORBmatcher::DESC_WORDS,mvDescSamples.end(),mvDescSamples.begin()+i*ORBmatcher::DESC_WORDS);
+        mvpDescSampleKFs[i] = mvpDescSampleKFs[last];
+        mvnDescDistSums[i] = mvnDescDistSums[last];
     }
+    mvDescSamples.resize(last*ORBmatcher::DESC_WORDS);
+    mvpDescSampleKFs.pop_back();
+    mvnDescDistSums.pop_back();
 }
 
 cv::Mat MapPoint::GetDescriptor()
@@ -315,8 +490,9 @@ cv::Mat MapPoint::GetDescriptor()
 int MapPoint::GetIndexInKeyFrame(KeyFrame *pKF)
 {
     unique_lock<mutex> lock(mMutexFeatures);
-    if(mObservations.count(pKF))
-        return mObservations[pKF];
+    ObservationList::iterator it = FindObservation(pKF);
+    if(it!=mObservations.end() && it->first==pKF)
+        return it->second;
     else
         return -1;
 }
@@ -324,14 +500,15 @@ int MapPoint::GetIndexInKeyFrame(KeyFrame *pKF)
 bool MapPoint::IsInKeyFrame(KeyFrame *pKF)
 {
     unique_lock<mutex> lock(mMutexFeatures);
-    return (mObservations.count(pKF));
+    ObservationList::iterator it = FindObservation(pKF);
+    return it!=mObservations.end() && it->first==pKF;
 }
 
 void MapPoint::UpdateNormalAndDepth()
 {
-    map<KeyFrame*,size_t> observations;
+    ObservationList observations;
     KeyFrame* pRefKF;
-    cv::Mat Pos;
+    size_t nRefIdx = 0;
     {
         unique_lock<mutex> lock1(mMutexFeatures);
         unique_lock<mutex> lock2(mMutexPos);
@@ -339,56 +516,64 @@ void MapPoint::UpdateNormalAndDepth()
             return;
         observations=mObservations;
         pRefKF=mpRefKF;
-        Pos = mWorldPos.clone();
+        ObservationList::iterator it = FindObservation(pRefKF);
+        if(it!=mObservations.end() && it->first==pRefKF)
+            nRefIdx = it->second;
     }
 
     if(observations.empty())
         return;
 
-    cv::Mat normal = cv::Mat::zeros(3,1,CV_32F);
+    const cv::Vec3f Pos = GetWorldPos3f();
+
+    cv::Vec3f normal(0,0,0);
     int n=0;
-    for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+    for(ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
     {
         KeyFrame* pKF = mit->first;
-        cv::Mat Owi = pKF->GetCameraCenter();
-        cv::Mat normali = mWorldPos - Owi;
-        normal = normal + normali/cv::norm(normali);
+        const cv::Vec3f normali = Pos - pKF->GetCameraCenter3f();
+        normal += normali/cv::norm(normali);
         n++;
     }
+    normal = normal/n;
 
-    cv::Mat PC = Pos - pRefKF->GetCameraCenter();
+    const cv::Vec3f PC = Pos - pRefKF->GetCameraCenter3f();
     const float dist = cv::norm(PC);
-    const int level = pRefKF->mvKeysUn[observations[pRefKF]].octave;
+    const int level = pRefKF->mvKeysUn[nRefIdx].octave;
     const float levelScaleFactor =  pRefKF->mvScaleFactors[level];
     const int nLevels = pRefKF->mnScaleLevels;
 
     {
         unique_lock<mutex> lock3(mMutexPos);
-        mfMaxDistance = dist*levelScaleFactor;
-        mfMinDistance = mfMaxDistance/pRefKF->mvScaleFactors[nLevels-1];
-        mNormalVector = normal/n;
+        float data[POS_DATA_SIZE];
+        mPosData.Read(data);
+        for(int i=0; i<3; i++)
+            data[POS_DATA_NORMAL+i] = normal(i);
+        data[POS_DATA_MAX_DISTANCE] = dist*levelScaleFactor;
+        data[POS_DATA_MIN_DISTANCE] = data[POS_DATA_MAX_DISTANCE]/pRefKF->mvScaleFactors[nLevels-1];
+        mPosData.Write(data);
     }
 }
 
 float MapPoint::GetMinDistanceInvariance()
 {
-    unique_lock<mutex> lock(mMutexPos);
-    return 0.8f*mfMinDistance;
+    float data[POS_DATA_SIZE];
+    mPosData.Read(data);
+    return 0.8f*data[POS_DATA_MIN_DISTANCE];
 }
 
 float MapPoint::GetMaxDistanceInvariance()
 {
-    unique_lock<mutex> lock(mMutexPos);
-    return 1.2f*mfMaxDistance;
+    float data[POS_DATA_SIZE];
+    mPosData.Read(data);
+    return 1.2f*data[POS_DATA_MAX_DISTANCE];
 }
 
 int MapPoint::PredictScale(const float &currentDist, KeyFrame* pKF)
 {
-    float ratio;
-    {
-        unique_lock<mutex> lock(mMutexPos);
-        ratio = mfMaxDistance/currentDist;
-    }
+    float data[POS_DATA_SIZE];
+    mPosData.Read(data);
+    const float ratio = data[POS_DATA_MAX_DISTANCE]/currentDist;
 
     int nScale = ceil(log(ratio)/pKF->mfLogScaleFactor);
     if(nScale<0)
@@ -401,11 +586,9 @@ int MapPoint::PredictScale(const float &currentDist, KeyFrame* pKF)
 
 int MapPoint::PredictScale(const float &currentDist, Frame* pF)
 {
-    float ratio;
-    {
-        unique_lock<mutex> lock(mMutexPos);
-        ratio = mfMaxDistance/currentDist;
-    }
+    float data[POS_DATA_SIZE];
+    mPosData.Read(data);
+    const float ratio = data[POS_DATA_MAX_DISTANCE]/currentDist;
 
     int nScale = ceil(log(ratio)/pF->mfLogScaleFactor);
     if(nScale<0)
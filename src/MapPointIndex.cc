@@ -0,0 +1,317 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MapPointIndex.h"
+#include "MapPoint.h"
+
+#include<cmath>
+#include<algorithm>
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+// Voxel coordinates are packed in 21 bits per axis
+static const int KEY_BITS = 21;
+static const int KEY_OFFSET = 1<<(KEY_BITS-1);
+static const long long KEY_MASK = (1ll<<KEY_BITS)-1;
+
+const int MapPointIndex::BLOCK_VOXELS;
+
+static inline int FloorDiv(const int a, const int b)
+{
+    return a>=0 ? a/b : -((-a+b-1)/b);
+}
+
+MapPointIndex::MapPointIndex(const float fVoxelSize):mfVoxelSize(fVoxelSize),mfInvVoxelSize(1.0f/fVoxelSize)
+{
+}
+
+long long MapPointIndex::ComputeKey(const int ix, const int iy, const int iz) const
+{
+    return (((long long)(ix+KEY_OFFSET)&KEY_MASK)<<(2*KEY_BITS)) |
+           (((long long)(iy+KEY_OFFSET)&KEY_MASK)<<KEY_BITS) |
+           ((long long)(iz+KEY_OFFSET)&KEY_MASK);
+}
+
+long long MapPointIndex::ComputeKey(const cv::Vec3f &x3Dw) const
+{
+    return ComputeKey(floor(x3Dw[0]*mfInvVoxelSize),floor(x3Dw[1]*mfInvVoxelSize),floor(x3Dw[2]*mfInvVoxelSize));
+}
+
+void MapPointIndex::ComputeCoords(const long long key, int &ix, int &iy, int &iz) const
+{
+    ix = ((key>>(2*KEY_BITS))&KEY_MASK)-KEY_OFFSET;
+    iy = ((key>>KEY_BITS)&KEY_MASK)-KEY_OFFSET;
+    iz = (key&KEY_MASK)-KEY_OFFSET;
+}
+
+cv::Vec3f MapPointIndex::VoxelCenter(const long long key) const
+{
+    int ix, iy, iz;
+    ComputeCoords(key,ix,iy,iz);
+    return cv::Vec3f((ix+0.5f)*mfVoxelSize,(iy+0.5f)*mfVoxelSize,(iz+0.5f)*mfVoxelSize);
+}
+
+long long MapPointIndex::ComputeBlockKey(const long long key) const
+{
+    int ix, iy, iz;
+    ComputeCoords(key,ix,iy,iz);
+    return ComputeKey(FloorDiv(ix,BLOCK_VOXELS),FloorDiv(iy,BLOCK_VOXELS),FloorDiv(iz,BLOCK_VOXELS));
+}
+
+void MapPointIndex::Insert(MapPoint *pMP)
+{
+    unique_lock<mutex> lock(mMutexIndex);
+    if(pMP->mbInIndex)
+        return;
+    pMP->mnIndexKey = ComputeKey(pMP->GetWorldPos3f());
+    pMP->mbInIndex = true;
+    InsertInVoxel(pMP,pMP->mnIndexKey);
+}
+
+void MapPointIndex::Erase(MapPoint *pMP)
+{
+    unique_lock<mutex> lock(mMutexIndex);
+    if(!pMP->mbInIndex)
+        return;
+    EraseFromVoxel(pMP,pMP->mnIndexKey);
+    pMP->mbInIndex = false;
+}
+
+void MapPointIndex::Update(MapPoint *pMP)
+{
+    unique_lock<mutex> lock(mMutexIndex);
+    if(!pMP->mbInIndex)
+        return;
+
+    // The position is read under the lock, the last update always leaves the point in the right voxel
+    const long long key = ComputeKey(pMP->GetWorldPos3f());
+    if(key==pMP->mnIndexKey)
+        return;
+
+    EraseFromVoxel(pMP,pMP->mnIndexKey);
+    pMP->mnIndexKey = key;
+    InsertInVoxel(pMP,key);
+}
+
+void MapPointIndex::InsertInVoxel(MapPoint *pMP, const long long key)
+{
+    vector<MapPoint*> &vpMPs = mVoxels[key];
+    if(vpMPs.empty())
+        mBlocks[ComputeBlockKey(key)].push_back(key);
+    vpMPs.push_back(pMP);
+}
+
+void MapPointIndex::EraseFromVoxel(MapPoint *pMP, const long long key)
+{
+    unordered_map<long long, vector<MapPoint*> >::iterator it = mVoxels.find(key);
+    if(it==mVoxels.end())
+        return;
+
+    vector<MapPoint*> &vpMPs = it->second;
+    vector<MapPoint*>::iterator vit = find(vpMPs.begin(),vpMPs.end(),pMP);
+    if(vit!=vpMPs.end())
+    {
+        *vit = vpMPs.back();
+        vpMPs.pop_back();
+    }
+
+    if(vpMPs.empty())
+    {
+        mVoxels.erase(it);
+
+        unordered_map<long long, vector<long long> >::iterator bit = mBlocks.find(ComputeBlockKey(key));
+        if(bit==mBlocks.end())
+            return;
+        vector<long long> &vKeys = bit->second;
+        vector<long long>::iterator kit = find(vKeys.begin(),vKeys.end(),key);
+        if(kit!=vKeys.end())
+        {
+            *kit = vKeys.back();
+            vKeys.pop_back();
+        }
+        if(vKeys.empty())
+            mBlocks.erase(bit);
+    }
+}
+
+void MapPointIndex::clear()
+{
+    unique_lock<mutex> lock(mMutexIndex);
+    mVoxels.clear();
+    mBlocks.clear();
+}
+
+size_t MapPointIndex::VoxelsInIndex()
+{
+    unique_lock<mutex> lock(mMutexIndex);
+    return mVoxels.size();
+}
+
+vector<MapPoint*> MapPointIndex::GetPointsInFrustum(const cv::Mat &Tcw, const float fx, const float fy, const float cx, const float cy,
+                                                    const float minX, const float maxX, const float minY, const float maxY,
+                                                    const float maxDepth)
+{
+    const cv::Matx33f Rcw = Tcw.rowRange(0,3).colRange(0,3);
+    const cv::Vec3f tcw = Tcw.rowRange(0,3).col(3);
+    const cv::Matx33f Rwc = Rcw.t();
+    const cv::Vec3f Ow = -(Rwc*tcw);
+
+    // Inward normals of the side planes of the frustum (in camera coordinates)
+    cv::Vec3f normals[4] = {cv::Vec3f(fx,0,cx-minX), cv::Vec3f(-fx,0,maxX-cx),
+                            cv::Vec3f(0,fy,cy-minY), cv::Vec3f(0,-fy,maxY-cy)};
+    for(int i=0; i<4; i++)
+        normals[i] = normals[i]*(1.0f/cv::norm(normals[i]));
+
+    // A voxel (or block) intersects the frustum if its bounding sphere does
+    const float radius = 0.5f*sqrt(3.0f)*mfVoxelSize;
+    const float blockSize = BLOCK_VOXELS*mfVoxelSize;
+    const float blockRadius = 0.5f*sqrt(3.0f)*blockSize;
+
+    auto InFrustum = [&](const cv::Vec3f &x3Dw, const float r)
+    {
+        const cv::Vec3f Pc = Rcw*x3Dw+tcw;
+        if(Pc[2]<-r || Pc[2]>maxDepth+r)
+            return false;
+        for(int i=0; i<4; i++)
+            if(Pc.dot(normals[i])<-r)
+                return false;
+        return true;
+    };
+
+    // Bounding box of the frustum: camera center and image corners at maxDepth
+    cv::Vec3f bmin = Ow, bmax = Ow;
+    const float xs[2] = {minX,maxX};
+    const float ys[2] = {minY,maxY};
+    for(int i=0; i<2; i++)
+        for(int j=0; j<2; j++)
+        {
+            const cv::Vec3f Pc((xs[i]-cx)*maxDepth/fx,(ys[j]-cy)*maxDepth/fy,maxDepth);
+            const cv::Vec3f Pw = Rwc*Pc+Ow;
+            for(int k=0; k<3; k++)
+            {
+                bmin[k] = min(bmin[k],Pw[k]);
+                bmax[k] = max(bmax[k],Pw[k]);
+            }
+        }
+
+    int bminIdx[3], bmaxIdx[3];
+    for(int k=0; k<3; k++)
+    {
+        bminIdx[k] = floor(bmin[k]/blockSize);
+        bmaxIdx[k] = floor(bmax[k]/blockSize);
+    }
+
+    vector<MapPoint*> vpMPs;
+
+    unique_lock<mutex> lock(mMutexIndex);
+
+    auto AddBlock = [&](const vector<long long> &vKeys)
+    {
+        for(vector<long long>::const_iterator kit=vKeys.begin(), kend=vKeys.end(); kit!=kend; kit++)
+        {
+            if(!InFrustum(VoxelCenter(*kit),radius))
+                continue;
+            const vector<MapPoint*> &vpVoxelMPs = mVoxels.at(*kit);
+            vpMPs.insert(vpMPs.end(),vpVoxelMPs.begin(),vpVoxelMPs.end());
+        }
+    };
+
+    // Visit the blocks of the bounding box, or all occupied blocks if there are less of them
+    const double nCells = double(bmaxIdx[0]-bminIdx[0]+1)*(bmaxIdx[1]-bminIdx[1]+1)*(bmaxIdx[2]-bminIdx[2]+1);
+    if(nCells<=mBlocks.size())
+    {
+        for(int bx=bminIdx[0]; bx<=bmaxIdx[0]; bx++)
+            for(int by=bminIdx[1]; by<=bmaxIdx[1]; by++)
+                for(int bz=bminIdx[2]; bz<=bmaxIdx[2]; bz++)
+                {
+                    unordered_map<long long, vector<long long> >::const_iterator it = mBlocks.find(ComputeKey(bx,by,bz));
+                    if(it==mBlocks.end())
+                        continue;
+                    const cv::Vec3f center((bx+0.5f)*blockSize,(by+0.5f)*blockSize,(bz+0.5f)*blockSize);
+                    if(InFrustum(center,blockRadius))
+                        AddBlock(it->second);
+                }
+    }
+    else
+    {
+        for(unordered_map<long long, vector<long long> >::const_iterator it=mBlocks.begin(), itend=mBlocks.end(); it!=itend; it++)
+        {
+            int bx, by, bz;
+            ComputeCoords(it->first,bx,by,bz);
+            const cv::Vec3f center((bx+0.5f)*blockSize,(by+0.5f)*blockSize,(bz+0.5f)*blockSize);
+            if(InFrustum(center,blockRadius))
+                AddBlock(it->second);
+        }
+    }
+
+    return vpMPs;
+}
+
+vector<MapPoint*> MapPointIndex::GetPointsInRadius(const cv::Mat &x3Dw, const float r)
+{
+    const cv::Vec3f c = x3Dw;
+    const int minX = floor((c[0]-r)*mfInvVoxelSize), maxX = floor((c[0]+r)*mfInvVoxelSize);
+    const int minY = floor((c[1]-r)*mfInvVoxelSize), maxY = floor((c[1]+r)*mfInvVoxelSize);
+    const int minZ = floor((c[2]-r)*mfInvVoxelSize), maxZ = floor((c[2]+r)*mfInvVoxelSize);
+    const float r2 = r*r;
+
+    vector<MapPoint*> vpMPs;
+
+    unique_lock<mutex> lock(mMutexIndex);
+
+    // Visit the voxels of the bounding box, or all occupied voxels if there are less of them
+    const double nCells = double(maxX-minX+1)*(maxY-minY+1)*(maxZ-minZ+1);
+    if(nCells<=mVoxels.size())
+    {
+        for(int ix=minX; ix<=maxX; ix++)
+            for(int iy=minY; iy<=maxY; iy++)
+                for(int iz=minZ; iz<=maxZ; iz++)
+                {
+                    unordered_map<long long, vector<MapPoint*> >::const_iterator it = mVoxels.find(ComputeKey(ix,iy,iz));
+                    if(it==mVoxels.end())
+                        continue;
+                    for(vector<MapPoint*>::const_iterator vit=it->second.begin(), vend=it->second.end(); vit!=vend; vit++)
+                    {
+                        const cv::Vec3f d = (*vit)->GetWorldPos3f()-c;
+                        if(d.dot(d)<=r2)
+                            vpMPs.push_back(*vit);
+                    }
+                }
+    }
+    else
+    {
+        for(unordered_map<long long, vector<MapPoint*> >::const_iterator it=mVoxels.begin(), itend=mVoxels.end(); it!=itend; it++)
+        {
+            for(vector<MapPoint*>::const_iterator vit=it->second.begin(), vend=it->second.end(); vit!=vend; vit++)
+            {
+                const cv::Vec3f d = (*vit)->GetWorldPos3f()-c;
+                if(d.dot(d)<=r2)
+                    vpMPs.push_back(*vit);
+            }
+        }
+    }
+
+    return vpMPs;
+}
+
+} //namespace ORB_SLAM
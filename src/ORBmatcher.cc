@@ -823,6 +823,13 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, cv::Mat F
 }
 
 int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const float th)
+{
+    vector<int> vnMatchIdx;
+    SearchFuseCandidates(pKF,vpMapPoints,vnMatchIdx,th);
+    return FuseCandidates(pKF,vpMapPoints,vnMatchIdx);
+}
+
+int ORBmatcher::SearchFuseCandidates(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, vector<int> &vnMatchIdx, const float th)
 {
     cv::Mat Rcw = pKF->GetRotation();
     cv::Mat tcw = pKF->GetTranslation();
@@ -835,9 +842,10 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
 
     cv::Mat Ow = pKF->GetCameraCenter();
 
-    int nFused=0;
+    int nCandidates=0;
 
     const int nMPs = vpMapPoints.size();
+    vnMatchIdx.assign(nMPs,-1);
 
     for(int i=0; i<nMPs; i++)
     {
@@ -948,33 +956,57 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
             }
         }
 
-        // If there is already a MapPoint replace otherwise add new measurement
         if(bestDist<=TH_LOW)
         {
-            MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
-            if(pMPinKF)
-            {
-                if(!pMPinKF->isBad())
-                {
-                    if(pMPinKF->Observations()>pMP->Observations())
-                        pMP->Replace(pMPinKF);
-                    else
-                        pMPinKF->Replace(pMP);
-                }
-            }
-            else
+            vnMatchIdx[i] = bestIdx;
+            nCandidates++;
+        }
+    }
+
+    return nCandidates;
+}
+
+int ORBmatcher::FuseCandidates(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const vector<int> &vnMatchIdx)
+{
+    int nFused=0;
+
+    const int nMPs = vpMapPoints.size();
+
+    for(int i=0; i<nMPs; i++)
+    {
+        const int bestIdx = vnMatchIdx[i];
+        if(bestIdx<0)
+            continue;
+
+        // Previous fusions may have replaced the MapPoint or already added it to the KeyFrame
+        MapPoint* pMP = vpMapPoints[i];
+        if(pMP->isBad() || pMP->IsInKeyFrame(pKF))
+            continue;
+
+        // If there is already a MapPoint replace otherwise add new measurement
+        MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
+        if(pMPinKF)
+        {
+            if(!pMPinKF->isBad())
             {
-                pMP->AddObservation(pKF,bestIdx);
-                pKF->AddMapPoint(pMP,bestIdx);
+                if(pMPinKF->Observations()>pMP->Observations())
+                    pMP->Replace(pMPinKF);
+                else
+                    pMPinKF->Replace(pMP);
             }
-            nFused++;
         }
+        else
+        {
+            pMP->AddObservation(pKF,bestIdx);
+            pKF->AddMapPoint(pMP,bestIdx);
+        }
+        nFused++;
     }
 
     return nFused;
 }
 
-int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoints, float th, vector<MapPoint *> &vpReplacePoint)
+int ORBmatcher::SearchFuseCandidates(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoints, float th, vector<int> &vnMatchIdx)
 {
     // Get Calibration Parameters for later projection
     const float &fx = pKF->fx;
@@ -992,9 +1024,10 @@ int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoi
     // Set of MapPoints already found in the KeyFrame
     const set<MapPoint*> spAlreadyFound = pKF->GetMapPoints();
 
-    int nFused=0;
+    int nFound=0;
 
     const int nPoints = vpPoints.size();
+    vnMatchIdx.assign(nPoints,-1);
 
     // For each candidate MapPoint project and match
     for(int iMP=0; iMP<nPoints; iMP++)
@@ -1078,27 +1111,62 @@ int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoi
             }
         }
 
-        // If there is already a MapPoint replace otherwise add new measurement
         if(bestDist<=TH_LOW)
         {
-            MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
-            if(pMPinKF)
-            {
-                if(!pMPinKF->isBad())
-                    vpReplacePoint[iMP] = pMPinKF;
-            }
-            else
-            {
-                pMP->AddObservation(pKF,bestIdx);
-                pKF->AddMapPoint(pMP,bestIdx);
-            }
-            nFused++;
+            vnMatchIdx[iMP] = bestIdx;
+            nFound++;
         }
     }
 
+    return nFound;
+}
+
+int ORBmatcher::FuseCandidates(KeyFrame *pKF, const vector<MapPoint *> &vpPoints, const vector<int> &vnMatchIdx, vector<MapPoint *> &vpReplacePoint)
+{
+    int nFused=0;
+
+    const int nPoints = vpPoints.size();
+
+    for(int iMP=0; iMP<nPoints; iMP++)
+    {
+        const int bestIdx = vnMatchIdx[iMP];
+        if(bestIdx<0)
+            continue;
+
+        // The map may have changed since the search
+        MapPoint* pMP = vpPoints[iMP];
+        if(pMP->isBad())
+            continue;
+
+        // If there is already a MapPoint replace otherwise add new measurement
+        MapPoint* pMPinKF = pKF->GetMapPoint(bestIdx);
+        if(pMPinKF)
+        {
+            if(pMPinKF==pMP)
+                continue;
+            if(!pMPinKF->isBad())
+                vpReplacePoint[iMP] = pMPinKF;
+        }
+        else
+        {
+            if(pMP->IsInKeyFrame(pKF))
+                continue;
+            pMP->AddObservation(pKF,bestIdx);
+            pKF->AddMapPoint(pMP,bestIdx);
+        }
+        nFused++;
+    }
+
     return nFused;
 }
 
+int ORBmatcher::Fuse(KeyFrame *pKF, cv::Mat Scw, const vector<MapPoint *> &vpPoints, float th, vector<MapPoint *> &vpReplacePoint)
+{
+    vector<int> vnMatchIdx;
+    SearchFuseCandidates(pKF,Scw,vpPoints,th,vnMatchIdx);
+    return FuseCandidates(pKF,vpPoints,vnMatchIdx,vpReplacePoint);
+}
+
 int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &vpMatches12,
                              const float &s12, const cv::Mat &R12, const cv::Mat &t12, const float th)
 {
@@ -1348,6 +1416,9 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
     const bool bForward = tlc.at<float>(2)>CurrentFrame.mb && !bMono;
     const bool bBackward = -tlc.at<float>(2)>CurrentFrame.mb && !bMono;
 
+    const cv::Matx33f Rcw33f = Rcw;
+    const cv::Vec3f tcw3f = tcw;
+
     for(int i=0; i<LastFrame.N; i++)
     {
         MapPoint* pMP = LastFrame.mvpMapPoints[i];
@@ -1357,12 +1428,11 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
             if(!LastFrame.mvbOutlier[i])
             {
                 // Project
-                cv::Mat x3Dw = pMP->GetWorldPos();
-                cv::Mat x3Dc = Rcw*x3Dw+tcw;
+                const cv::Vec3f x3Dc = Rcw33f*pMP->GetWorldPos3f()+tcw3f;
 
-                const float xc = x3Dc.at<float>(0);
-                const float yc = x3Dc.at<float>(1);
-                const float invzc = 1.0/x3Dc.at<float>(2);
+                const float xc = x3Dc(0);
+                const float yc = x3Dc(1);
+                const float invzc = 1.0/x3Dc(2);
 
                 if(invzc<0)
                     continue;
@@ -1662,4 +1732,15 @@ int ORBmatcher::DescriptorDistance(const cv::Mat &a, const cv::Mat &b)
     return dist;
 }
 
+void ORBmatcher::DescriptorDistances(const uint64_t *a, const uint64_t *pB, const int nB, int *pDists)
+{
+    const uint64_t a0=a[0], a1=a[1], a2=a[2], a3=a[3];
+
+    for(int i=0; i<nB; i++, pB+=DESC_WORDS)
+    {
+        pDists[i] = __builtin_popcountll(a0^pB[0]) + __builtin_popcountll(a1^pB[1]) +
+                    __builtin_popcountll(a2^pB[2]) + __builtin_popcountll(a3^pB[3]);
+    }
+}
+
 } //namespace ORB_SLAM
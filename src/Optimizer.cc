@@ -23,6 +23,7 @@
 #include "Thirdparty/g2o/g2o/core/block_solver.h"
 #include "Thirdparty/g2o/g2o/core/optimization_algorithm_levenberg.h"
 #include "Thirdparty/g2o/g2o/solvers/linear_solver_eigen.h"
+#include "Thirdparty/g2o/g2o/solvers/linear_solver_pcg.h"
 #include "Thirdparty/g2o/g2o/types/types_six_dof_expmap.h"
 #include "Thirdparty/g2o/g2o/core/robust_kernel_impl.h"
 #include "Thirdparty/g2o/g2o/solvers/linear_solver_dense.h"
@@ -31,12 +32,84 @@
 #include<Eigen/StdVector>
 
 #include "Converter.h"
+#include "ThreadPool.h"
 
 #include<mutex>
+#include<algorithm>
 
 namespace ORB_SLAM2
 {
 
+Optimizer::eLinearSolver Optimizer::meGlobalBASolver = Optimizer::CHOLESKY;
+Optimizer::eLinearSolver Optimizer::meEssentialGraphSolver = Optimizer::CHOLESKY;
+int Optimizer::mnPCGMaxIterations = 100;
+double Optimizer::mfPCGTolerance = 1e-6;
+int Optimizer::mnEssentialGraphSubmapSize = 0;
+int Optimizer::mnEssentialGraphMaxCycles = 8;
+
+void Optimizer::ReadSettings(const string &strSettingPath)
+{
+    cv::FileStorage fSettings(strSettingPath, cv::FileStorage::READ);
+
+    // Missing entries are read as 0, which keeps the sparse Cholesky solver
+    int nGlobalBASolver = fSettings["Optimizer.GlobalBA.LinearSolver"];
+    int nEssentialGraphSolver = fSettings["Optimizer.EssentialGraph.LinearSolver"];
+    meGlobalBASolver = nGlobalBASolver==PCG ? PCG : CHOLESKY;
+    meEssentialGraphSolver = nEssentialGraphSolver==PCG ? PCG : CHOLESKY;
+
+    int nMaxIterations = fSettings["Optimizer.PCG.MaxIterations"];
+    if(nMaxIterations>0)
+        mnPCGMaxIterations = nMaxIterations;
+    double tolerance = fSettings["Optimizer.PCG.Tolerance"];
+    if(tolerance>0)
+        mfPCGTolerance = tolerance;
+
+    int nSubmapSize = fSettings["Optimizer.EssentialGraph.SubmapSize"];
+    mnEssentialGraphSubmapSize = max(nSubmapSize,0);
+    int nMaxCycles = fSettings["Optimizer.EssentialGraph.MaxCycles"];
+    if(nMaxCycles>0)
+        mnEssentialGraphMaxCycles = nMaxCycles;
+
+    cout << endl << "Optimizer Parameters: " << endl;
+    cout << "- Global BA linear solver: " << (meGlobalBASolver==PCG ? "PCG" : "Cholesky") << endl;
+    cout << "- Essential Graph linear solver: " << (meEssentialGraphSolver==PCG ? "PCG" : "Cholesky") << endl;
+    if(meGlobalBASolver==PCG || meEssentialGraphSolver==PCG)
+    {
+        cout << "- PCG max iterations: " << mnPCGMaxIterations << endl;
+        cout << "- PCG tolerance: " << mfPCGTolerance << endl;
+    }
+    if(mnEssentialGraphSubmapSize>0)
+    {
+        cout << "- Essential Graph submap size: " << mnEssentialGraphSubmapSize << endl;
+        cout << "- Essential Graph max cycles: " << mnEssentialGraphMaxCycles << endl;
+    }
+}
+
+ThreadPool& Optimizer::LinearSolverPool()
+{
+    // Shared by all optimizations, concurrent solves take turns
+    static ThreadPool pool;
+    return pool;
+}
+
+template<class BlockSolver>
+typename BlockSolver::LinearSolverType* Optimizer::CreateLinearSolver(const eLinearSolver eSolver)
+{
+    if(eSolver==PCG)
+    {
+        g2o::LinearSolverPCG<typename BlockSolver::PoseMatrixType>* linearSolver =
+                new g2o::LinearSolverPCG<typename BlockSolver::PoseMatrixType>();
+        linearSolver->setMaxIterations(mnPCGMaxIterations);
+        linearSolver->setTolerance(mfPCGTolerance);
+        linearSolver->setParallelFor([](int n, const std::function<void(int)> &f)
+        {
+            LinearSolverPool().ParallelFor(n,f);
+        });
+        return linearSolver;
+    }
+
+    return new g2o::LinearSolverEigen<typename BlockSolver::PoseMatrixType>();
+}
 
 void Optimizer::GlobalBundleAdjustemnt(Map* pMap, int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust)
 {
@@ -45,9 +118,93 @@ void Optimizer::GlobalBundleAdjustemnt(Map* pMap, int nIterations, bool* pbStopF
     BundleAdjustment(vpKFs,vpMP,nIterations,pbStopFlag, nLoopKF, bRobust);
 }
 
+void Optimizer::IncrementalGlobalBundleAdjustment(Map* pMap, const vector<KeyFrame*> &vpActiveKFs, int nIterations,
+                                                  bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust)
+{
+    const vector<KeyFrame*> vpAllKFs = pMap->GetAllKeyFrames();
+    const unsigned long nMaxKFid = pMap->GetMaxKFid();
+
+    // 0: not included, 1: optimized, 2: fixed
+    vector<char> vnState(nMaxKFid+1,0);
+    vector<KeyFrame*> vpKFs;
+    for(size_t i=0, iend=vpActiveKFs.size(); i<iend; i++)
+    {
+        KeyFrame* pKF = vpActiveKFs[i];
+        if(pKF->isBad() || pKF->mnId>nMaxKFid)
+            continue;
+        if(!vnState[pKF->mnId])
+        {
+            vnState[pKF->mnId] = 1;
+            vpKFs.push_back(pKF);
+        }
+        const vector<KeyFrame*> vpNeighs = pKF->GetVectorCovisibleKeyFrames();
+        for(size_t j=0, jend=vpNeighs.size(); j<jend; j++)
+        {
+            KeyFrame* pKFn = vpNeighs[j];
+            if(pKFn->isBad() || pKFn->mnId>nMaxKFid || vnState[pKFn->mnId])
+                continue;
+            vnState[pKFn->mnId] = 1;
+            vpKFs.push_back(pKFn);
+        }
+    }
+
+    if(2*vpKFs.size()>vpAllKFs.size())
+    {
+        GlobalBundleAdjustemnt(pMap,nIterations,pbStopFlag,nLoopKF,bRobust);
+        return;
+    }
+
+    // MapPoints seen by the optimized keyframes
+    vector<MapPoint*> vpMP;
+    const unsigned long nMaxMPid = MapPoint::nNextId;
+    vector<bool> vbIncludedMP(nMaxMPid,false);
+    for(size_t i=0, iend=vpKFs.size(); i<iend; i++)
+    {
+        const vector<MapPoint*> vpMPsi = vpKFs[i]->GetMapPointMatches();
+        for(size_t j=0, jend=vpMPsi.size(); j<jend; j++)
+        {
+            MapPoint* pMP = vpMPsi[j];
+            if(!pMP || pMP->isBad() || pMP->mnId>=nMaxMPid || vbIncludedMP[pMP->mnId])
+                continue;
+            vbIncludedMP[pMP->mnId] = true;
+            vpMP.push_back(pMP);
+        }
+    }
+
+    // The other keyframes seeing them are fixed. The map origins are always included, the
+    // spanning tree update of the loop closing starts from them.
+    vector<KeyFrame*> vpFixedKFs;
+    for(size_t i=0, iend=vpMP.size(); i<iend; i++)
+    {
+        const MapPoint::ObservationList observations = vpMP[i]->GetObservationList();
+        for(MapPoint::ObservationList::const_iterator mit=observations.begin(); mit!=observations.end(); mit++)
+        {
+            KeyFrame* pKF = mit->first;
+            if(pKF->isBad() || pKF->mnId>nMaxKFid || vnState[pKF->mnId])
+                continue;
+            vnState[pKF->mnId] = 2;
+            vpFixedKFs.push_back(pKF);
+        }
+    }
+    for(size_t i=0, iend=pMap->mvpKeyFrameOrigins.size(); i<iend; i++)
+    {
+        KeyFrame* pKF = pMap->mvpKeyFrameOrigins[i];
+        if(pKF->mnId>nMaxKFid || vnState[pKF->mnId])
+            continue;
+        vnState[pKF->mnId] = 2;
+        vpFixedKFs.push_back(pKF);
+    }
+
+    cout << "Incremental Global BA: " << vpKFs.size() << " of " << vpAllKFs.size() << " keyframes optimized, "
+         << vpFixedKFs.size() << " fixed" << endl;
+
+    BundleAdjustment(vpKFs,vpMP,nIterations,pbStopFlag,nLoopKF,bRobust,vpFixedKFs);
+}
+
 
 void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<MapPoint *> &vpMP,
-                                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust)
+                                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust,
+                                 const vector<KeyFrame*> &vpFixedKF)
 {
     vector<bool> vbNotIncludedMP;
     vbNotIncludedMP.resize(vpMP.size());
@@ -55,7 +212,7 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
     g2o::SparseOptimizer optimizer;
     g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
 
-    linearSolver = new g2o::LinearSolverEigen<g2o::BlockSolver_6_3::PoseMatrixType>();
+    linearSolver = CreateLinearSolver<g2o::BlockSolver_6_3>(meGlobalBASolver);
 
     g2o::BlockSolver_6_3 * solver_ptr = new g2o::BlockSolver_6_3(linearSolver);
 
@@ -82,6 +239,20 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
             maxKFid=pKF->mnId;
     }
 
+    for(size_t i=0; i<vpFixedKF.size(); i++)
+    {
+        KeyFrame* pKF = vpFixedKF[i];
+        if(pKF->isBad())
+            continue;
+        g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
+        vSE3->setEstimate(Converter::toSE3Quat(pKF->GetPose()));
+        vSE3->setId(pKF->mnId);
+        vSE3->setFixed(true);
+        optimizer.addVertex(vSE3);
+        if(pKF->mnId>maxKFid)
+            maxKFid=pKF->mnId;
+    }
+
     const float thHuber2D = sqrt(5.99);
     const float thHuber3D = sqrt(7.815);
 
@@ -92,21 +263,21 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
         if(pMP->isBad())
             continue;
         g2o::VertexSBAPointXYZ* vPoint = new g2o::VertexSBAPointXYZ();
-        vPoint->setEstimate(Converter::toVector3d(pMP->GetWorldPos()));
+        vPoint->setEstimate(Converter::toVector3d(pMP->GetWorldPos3f()));
         const int id = pMP->mnId+maxKFid+1;
         vPoint->setId(id);
         vPoint->setMarginalized(true);
         optimizer.addVertex(vPoint);
 
-       const map<KeyFrame*,size_t> observations = pMP->GetObservations();
+       const MapPoint::ObservationList observations = pMP->GetObservationList();
 
         int nEdges = 0;
         //SET EDGES
-        for(map<KeyFrame*,size_t>::const_iterator mit=observations.begin(); mit!=observations.end(); mit++)
+        for(MapPoint::ObservationList::const_iterator mit=observations.begin(); mit!=observations.end(); mit++)
         {
 
             KeyFrame* pKF = mit->first;
-            if(pKF->isBad() || pKF->mnId>maxKFid)
+            if(pKF->isBad() || pKF->mnId>maxKFid || !optimizer.vertex(pKF->mnId))
                 continue;
 
             nEdges++;
@@ -190,9 +361,10 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
     // Recover optimized data
 
     //Keyframes
-    for(size_t i=0; i<vpKFs.size(); i++)
+    const size_t nKFs = vpKFs.size();
+    for(size_t i=0; i<nKFs+vpFixedKF.size(); i++)
     {
-        KeyFrame* pKF = vpKFs[i];
+        KeyFrame* pKF = i<nKFs ? vpKFs[i] : vpFixedKF[i-nKFs];
         if(pKF->isBad())
             continue;
         g2o::VertexSE3Expmap* vSE3 = static_cast<g2o::VertexSE3Expmap*>(optimizer.vertex(pKF->mnId));
@@ -450,7 +622,7 @@ int Optimizer::PoseOptimization(Frame *pFrame)
     return nInitialCorrespondences-nBad;
 }
 
-void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap)
+void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap, const int nMaxLocalKFs, const int nIterations)
 {    
     // Local KeyFrames: First Breath Search from Current Keyframe
     list<KeyFrame*> lLocalKeyFrames;
@@ -461,6 +633,9 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     const vector<KeyFrame*> vNeighKFs = pKF->GetVectorCovisibleKeyFrames();
     for(int i=0, iend=vNeighKFs.size(); i<iend; i++)
     {
+        // The neighbors left out are fixed if they see local MapPoints
+        if(nMaxLocalKFs>0 && (int)lLocalKeyFrames.size()>=nMaxLocalKFs)
+            break;
         KeyFrame* pKFi = vNeighKFs[i];
         pKFi->mnBALocalForKF = pKF->mnId;
         if(!pKFi->isBad())
@@ -489,8 +664,8 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     list<KeyFrame*> lFixedCameras;
     for(list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++)
     {
-        map<KeyFrame*,size_t> observations = (*lit)->GetObservations();
-        for(map<KeyFrame*,size_t>::iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+        const MapPoint::ObservationList observations = (*lit)->GetObservationList();
+        for(MapPoint::ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
         {
             KeyFrame* pKFi = mit->first;
 
@@ -573,16 +748,16 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     {
         MapPoint* pMP = *lit;
         g2o::VertexSBAPointXYZ* vPoint = new g2o::VertexSBAPointXYZ();
-        vPoint->setEstimate(Converter::toVector3d(pMP->GetWorldPos()));
+        vPoint->setEstimate(Converter::toVector3d(pMP->GetWorldPos3f()));
         int id = pMP->mnId+maxKFid+1;
         vPoint->setId(id);
         vPoint->setMarginalized(true);
         optimizer.addVertex(vPoint);
 
-        const map<KeyFrame*,size_t> observations = pMP->GetObservations();
+        const MapPoint::ObservationList observations = pMP->GetObservationList();
 
         //Set edges
-        for(map<KeyFrame*,size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
+        for(MapPoint::ObservationList::const_iterator mit=observations.begin(), mend=observations.end(); mit!=mend; mit++)
         {
             KeyFrame* pKFi = mit->first;
 
@@ -657,7 +832,7 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
             return;
 
     optimizer.initializeOptimization();
-    optimizer.optimize(5);
+    optimizer.optimize(nIterations);
 
     bool bDoMore= true;
 
@@ -704,7 +879,7 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     // Optimize again without the outliers
 
     optimizer.initializeOptimization(0);
-    optimizer.optimize(10);
+    optimizer.optimize(2*nIterations);
 
     }
 
@@ -743,7 +918,7 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     }
 
     // Get Map Mutex
-    unique_lock<mutex> lock(pMap->mMutexMapUpdate);
+    MapUpdateLock lock(pMap);
 
     if(!vToErase.empty())
     {
@@ -783,25 +958,31 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
                                        const LoopClosing::KeyFrameAndPose &CorrectedSim3,
                                        const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale)
 {
-    // Setup optimizer
-    g2o::SparseOptimizer optimizer;
-    optimizer.setVerbose(false);
-    g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
-           new g2o::LinearSolverEigen<g2o::BlockSolver_7_3::PoseMatrixType>();
-    g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
-    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
-
-    solver->setUserLambdaInit(1e-16);
-    optimizer.setAlgorithm(solver);
+    EssentialGraph graph;
+    BuildEssentialGraph(pMap,pLoopKF,pCurKF,NonCorrectedSim3,CorrectedSim3,LoopConnections,bFixScale,graph);
+    SolveEssentialGraph(graph);
+    ApplyEssentialGraph(pMap,pCurKF,graph);
+}
 
+void Optimizer::BuildEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* pCurKF,
+                                    const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
+                                    const LoopClosing::KeyFrameAndPose &CorrectedSim3,
+                                    const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale,
+                                    EssentialGraph &graph)
+{
     const vector<KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
-    const vector<MapPoint*> vpMPs = pMap->GetAllMapPoints();
 
     const unsigned int nMaxKFid = pMap->GetMaxKFid();
 
-    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vScw(nMaxKFid+1);
-    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vCorrectedSwc(nMaxKFid+1);
-    vector<g2o::VertexSim3Expmap*> vpVertices(nMaxKFid+1);
+    graph.vpKFs.assign(nMaxKFid+1,static_cast<KeyFrame*>(NULL));
+    graph.vScw.assign(nMaxKFid+1,g2o::Sim3());
+    graph.vCorrectedScw.clear();
+    graph.vEdges.clear();
+    graph.vEdgeMeasurements.clear();
+    graph.nLoopKFid = pLoopKF->mnId;
+    graph.bFixScale = bFixScale;
+
+    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > &vScw = graph.vScw;
 
     const int minFeat = 100;
 
@@ -811,7 +992,6 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
         KeyFrame* pKF = vpKFs[i];
         if(pKF->isBad())
             continue;
-        g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
 
         const int nIDi = pKF->mnId;
 
@@ -820,7 +1000,6 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
         if(it!=CorrectedSim3.end())
         {
             vScw[nIDi] = it->second;
-            VSim3->setEstimate(it->second);
         }
         else
         {
@@ -828,26 +1007,14 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
             Eigen::Matrix<double,3,1> tcw = Converter::toVector3d(pKF->GetTranslation());
             g2o::Sim3 Siw(Rcw,tcw,1.0);
             vScw[nIDi] = Siw;
-            VSim3->setEstimate(Siw);
         }
 
-        if(pKF==pLoopKF)
-            VSim3->setFixed(true);
-
-        VSim3->setId(nIDi);
-        VSim3->setMarginalized(false);
-        VSim3->_fix_scale = bFixScale;
-
-        optimizer.addVertex(VSim3);
-
-        vpVertices[nIDi]=VSim3;
+        graph.vpKFs[nIDi] = pKF;
     }
 
 
     set<pair<long unsigned int,long unsigned int> > sInsertedEdges;
 
-    const Eigen::Matrix<double,7,7> matLambda = Eigen::Matrix<double,7,7>::Identity();
-
     // Set Loop edges
     for(map<KeyFrame *, set<KeyFrame *> >::const_iterator mit = LoopConnections.begin(), mend=LoopConnections.end(); mit!=mend; mit++)
     {
@@ -866,14 +1033,8 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
             const g2o::Sim3 Sjw = vScw[nIDj];
             const g2o::Sim3 Sji = Sjw * Swi;
 
-            g2o::EdgeSim3* e = new g2o::EdgeSim3();
-            e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDj)));
-            e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-            e->setMeasurement(Sji);
-
-            e->information() = matLambda;
-
-            optimizer.addEdge(e);
+            graph.vEdges.push_back(make_pair(nIDi,nIDj));
+            graph.vEdgeMeasurements.push_back(Sji);
 
             sInsertedEdges.insert(make_pair(min(nIDi,nIDj),max(nIDi,nIDj)));
         }
@@ -913,13 +1074,8 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
             g2o::Sim3 Sji = Sjw * Swi;
 
-            g2o::EdgeSim3* e = new g2o::EdgeSim3();
-            e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDj)));
-            e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-            e->setMeasurement(Sji);
-
-            e->information() = matLambda;
-            optimizer.addEdge(e);
+            graph.vEdges.push_back(make_pair(nIDi,nIDj));
+            graph.vEdgeMeasurements.push_back(Sji);
         }
 
         // Loop edges
@@ -939,12 +1095,9 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
                     Slw = vScw[pLKF->mnId];
 
                 g2o::Sim3 Sli = Slw * Swi;
-                g2o::EdgeSim3* el = new g2o::EdgeSim3();
-                el->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pLKF->mnId)));
-                el->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-                el->setMeasurement(Sli);
-                el->information() = matLambda;
-                optimizer.addEdge(el);
+
+                graph.vEdges.push_back(make_pair(nIDi,pLKF->mnId));
+                graph.vEdgeMeasurements.push_back(Sli);
             }
         }
 
@@ -971,53 +1124,419 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
                     g2o::Sim3 Sni = Snw * Swi;
 
-                    g2o::EdgeSim3* en = new g2o::EdgeSim3();
-                    en->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFn->mnId)));
-                    en->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-                    en->setMeasurement(Sni);
-                    en->information() = matLambda;
-                    optimizer.addEdge(en);
+                    graph.vEdges.push_back(make_pair(nIDi,pKFn->mnId));
+                    graph.vEdgeMeasurements.push_back(Sni);
                 }
             }
         }
     }
+}
+
+void Optimizer::SolveEssentialGraph(EssentialGraph &graph, ThreadPool* pThreadPool)
+{
+    int nVertices = 0;
+    for(size_t i=0, iend=graph.vpKFs.size(); i<iend; i++)
+    {
+        if(graph.vpKFs[i])
+            nVertices++;
+    }
+
+    if(mnEssentialGraphSubmapSize>0 && nVertices>2*mnEssentialGraphSubmapSize)
+        SolveEssentialGraphHierarchical(graph,mnEssentialGraphSubmapSize,pThreadPool,mnEssentialGraphMaxCycles);
+    else
+        SolveEssentialGraphFlat(graph);
+}
+
+void Optimizer::SolveEssentialGraphFlat(EssentialGraph &graph, const int nIterations)
+{
+    // Setup optimizer
+    g2o::SparseOptimizer optimizer;
+    optimizer.setVerbose(false);
+    g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
+           CreateLinearSolver<g2o::BlockSolver_7_3>(meEssentialGraphSolver);
+    g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
+    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+
+    solver->setUserLambdaInit(1e-16);
+    optimizer.setAlgorithm(solver);
+
+    const int N = graph.vpKFs.size();
+
+    // Set KeyFrame vertices
+    for(int i=0; i<N; i++)
+    {
+        if(!graph.vpKFs[i])
+            continue;
+
+        g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
+        VSim3->setEstimate(graph.vScw[i]);
+        VSim3->setFixed((unsigned long)i==graph.nLoopKFid);
+        VSim3->setId(i);
+        VSim3->setMarginalized(false);
+        VSim3->_fix_scale = graph.bFixScale;
+
+        optimizer.addVertex(VSim3);
+    }
+
+    const Eigen::Matrix<double,7,7> matLambda = Eigen::Matrix<double,7,7>::Identity();
+
+    for(size_t i=0, iend=graph.vEdges.size(); i<iend; i++)
+    {
+        g2o::EdgeSim3* e = new g2o::EdgeSim3();
+        e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(graph.vEdges[i].second)));
+        e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(graph.vEdges[i].first)));
+        e->setMeasurement(graph.vEdgeMeasurements[i]);
+        e->information() = matLambda;
+        optimizer.addEdge(e);
+    }
 
     // Optimize!
     optimizer.initializeOptimization();
-    optimizer.optimize(20);
+    optimizer.optimize(nIterations);
+
+    graph.vCorrectedScw.assign(N,g2o::Sim3());
+    for(int i=0; i<N; i++)
+    {
+        if(!graph.vpKFs[i])
+            continue;
+        g2o::VertexSim3Expmap* VSim3 = static_cast<g2o::VertexSim3Expmap*>(optimizer.vertex(i));
+        graph.vCorrectedScw[i] = VSim3->estimate();
+    }
+}
+
+int Optimizer::SolveEssentialGraphHierarchical(EssentialGraph &graph, const int nSubmapSize, ThreadPool* pThreadPool,
+                                               const int nMaxCycles)
+{
+    // The submaps are rigid in the condensed graph, with the drift they contain. Each cycle starts from the
+    // relaxed poses of the previous one, with the submaps partly corrected. The cycles stop when the error
+    // decreases by less than 5%, or if it increases, in which case the previous poses are kept.
+    const double convergenceRatio = 0.05;
+
+    graph.vCorrectedScw = graph.vScw;
+    double chi2 = EssentialGraphChi2(graph,graph.vCorrectedScw);
+
+    int nCycles = 0;
+    while(nCycles<nMaxCycles)
+    {
+        const vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vScw = graph.vCorrectedScw;
+        SolveEssentialGraphCycle(graph,vScw,nSubmapSize,pThreadPool);
+        nCycles++;
+
+        const double newChi2 = EssentialGraphChi2(graph,graph.vCorrectedScw);
+        if(newChi2>chi2)
+        {
+            graph.vCorrectedScw = vScw;
+            break;
+        }
+
+        const bool bConverged = chi2-newChi2 < convergenceRatio*chi2;
+        chi2 = newChi2;
+        if(bConverged)
+            break;
+    }
+
+    return nCycles;
+}
+
+double Optimizer::EssentialGraphChi2(const EssentialGraph &graph, const vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > &vScw)
+{
+    // Edges have identity information, as in the solvers
+    double chi2 = 0;
+    for(size_t e=0, eend=graph.vEdges.size(); e<eend; e++)
+    {
+        const g2o::Sim3 error = graph.vEdgeMeasurements[e]*vScw[graph.vEdges[e].first]*
+                                vScw[graph.vEdges[e].second].inverse();
+        chi2 += error.log().squaredNorm();
+    }
+    return chi2;
+}
+
+void Optimizer::SolveEssentialGraphCycle(EssentialGraph &graph, const vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > &vScw,
+                                         const int nSubmapSize, ThreadPool* pThreadPool)
+{
+    const int N = graph.vpKFs.size();
+    const int nEdges = graph.vEdges.size();
+
+    vector<vector<int> > vvEdgesOf(N);
+    for(int e=0; e<nEdges; e++)
+    {
+        vvEdgesOf[graph.vEdges[e].first].push_back(e);
+        vvEdgesOf[graph.vEdges[e].second].push_back(e);
+    }
+
+    // Submaps are moved rigidly in the condensed graph, they must not contain the drift the loop corrects.
+    // They only grow through edges that agree with the initial estimate (residual below 3 times the median).
+    vector<double> vResiduals(nEdges);
+    for(int e=0; e<nEdges; e++)
+    {
+        const g2o::Sim3 error = graph.vEdgeMeasurements[e]*vScw[graph.vEdges[e].first]*
+                                vScw[graph.vEdges[e].second].inverse();
+        vResiduals[e] = error.log().norm();
+    }
+    vector<bool> vbConsistent(nEdges,true);
+    if(nEdges>0)
+    {
+        vector<double> vSorted = vResiduals;
+        nth_element(vSorted.begin(),vSorted.begin()+nEdges/2,vSorted.end());
+        const double th = 3.0*vSorted[nEdges/2];
+        for(int e=0; e<nEdges; e++)
+            vbConsistent[e] = vResiduals[e]<=th;
+    }
+
+    // Partition the keyframes in connected submaps by region growing. The first submap grows from the fixed
+    // keyframe, which becomes its anchor. The other seeds are taken in id order, which follows the trajectory.
+    vector<int> vSubmap(N,-1);
+    vector<int> vAnchors;
+    vector<vector<int> > vvSubmapKFs;
+    for(int k=-1; k<N; k++)
+    {
+        const int seed = k<0 ? graph.nLoopKFid : k;
+        if(seed>=N || !graph.vpKFs[seed] || vSubmap[seed]>=0)
+            continue;
+
+        const int nSubmapId = vAnchors.size();
+        vAnchors.push_back(seed);
+        vvSubmapKFs.push_back(vector<int>());
+        vector<int> &vKFs = vvSubmapKFs.back();
+        vKFs.reserve(nSubmapSize);
+        vKFs.push_back(seed);
+        vSubmap[seed] = nSubmapId;
+
+        for(size_t next=0; next<vKFs.size() && (int)vKFs.size()<nSubmapSize; next++)
+        {
+            const vector<int> &vEdgesOf = vvEdgesOf[vKFs[next]];
+            for(size_t j=0; j<vEdgesOf.size() && (int)vKFs.size()<nSubmapSize; j++)
+            {
+                if(!vbConsistent[vEdgesOf[j]])
+                    continue;
+                const pair<unsigned long,unsigned long> &edge = graph.vEdges[vEdgesOf[j]];
+                const int nIDn = (int)edge.first==vKFs[next] ? edge.second : edge.first;
+                if(vSubmap[nIDn]>=0)
+                    continue;
+                vSubmap[nIDn] = nSubmapId;
+                vKFs.push_back(nIDn);
+            }
+        }
+    }
+
+    const int nSubmaps = vAnchors.size();
+
+    // Pose of each keyframe relative to the anchor of its submap, kept rigid in the condensed graph
+    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vSia(N);
+    for(int i=0; i<N; i++)
+    {
+        if(graph.vpKFs[i])
+            vSia[i] = vScw[i]*vScw[vAnchors[vSubmap[i]]].inverse();
+    }
+
+    const Eigen::Matrix<double,7,7> matLambda = Eigen::Matrix<double,7,7>::Identity();
+
+    // Condensed graph: one vertex per submap anchor, every edge between two submaps becomes an edge between
+    // their anchors. Sji ~ Sjw*Swi = Sjb*Sbw*Swa*Sai, so Sba ~ Sjb^-1*Sji*Sia
+    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vCorrectedSaw(nSubmaps);
+    {
+        g2o::SparseOptimizer optimizer;
+        optimizer.setVerbose(false);
+        g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
+               CreateLinearSolver<g2o::BlockSolver_7_3>(meEssentialGraphSolver);
+        g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
+        g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+        solver->setUserLambdaInit(1e-16);
+        optimizer.setAlgorithm(solver);
+
+        for(int s=0; s<nSubmaps; s++)
+        {
+            g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
+            VSim3->setEstimate(vScw[vAnchors[s]]);
+            VSim3->setFixed((unsigned long)vAnchors[s]==graph.nLoopKFid);
+            VSim3->setId(s);
+            VSim3->setMarginalized(false);
+            VSim3->_fix_scale = graph.bFixScale;
+            optimizer.addVertex(VSim3);
+        }
+
+        for(int e=0; e<nEdges; e++)
+        {
+            const int i = graph.vEdges[e].first;
+            const int j = graph.vEdges[e].second;
+            const int a = vSubmap[i];
+            const int b = vSubmap[j];
+            if(a==b)
+                continue;
+
+            g2o::EdgeSim3* edge = new g2o::EdgeSim3();
+            edge->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(b)));
+            edge->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(a)));
+            edge->setMeasurement(vSia[j].inverse()*graph.vEdgeMeasurements[e]*vSia[i]);
+            edge->information() = matLambda;
+            optimizer.addEdge(edge);
+        }
 
-    unique_lock<mutex> lock(pMap->mMutexMapUpdate);
+        optimizer.initializeOptimization();
+        optimizer.optimize(20);
 
-    // SE3 Pose Recovering. Sim3:[sR t;0 1] -> SE3:[R t/s;0 1]
-    for(size_t i=0;i<vpKFs.size();i++)
+        for(int s=0; s<nSubmaps; s++)
+            vCorrectedSaw[s] = static_cast<g2o::VertexSim3Expmap*>(optimizer.vertex(s))->estimate();
+    }
+
+    // Move every submap rigidly with its anchor
+    vector<g2o::Sim3,Eigen::aligned_allocator<g2o::Sim3> > vPropagatedScw(N);
+    for(int i=0; i<N; i++)
     {
-        KeyFrame* pKFi = vpKFs[i];
+        if(graph.vpKFs[i])
+            vPropagatedScw[i] = vSia[i]*vCorrectedSaw[vSubmap[i]];
+    }
 
-        const int nIDi = pKFi->mnId;
+    // Relax each submap with the keyframes of the neighbouring submaps fixed at their last pose.
+    // Submaps only read the previous poses and write their own keyframes, they run in parallel.
+    // A few rounds spread the corrections across the submap boundaries.
+    graph.vCorrectedScw.assign(N,g2o::Sim3());
+    int nIterations = 10;
+    auto relax = [&](int s)
+    {
+        const vector<int> &vKFs = vvSubmapKFs[s];
+
+        g2o::SparseOptimizer optimizer;
+        optimizer.setVerbose(false);
+        g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
+               CreateLinearSolver<g2o::BlockSolver_7_3>(meEssentialGraphSolver);
+        g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
+        g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+        solver->setUserLambdaInit(1e-16);
+        optimizer.setAlgorithm(solver);
+
+        for(size_t k=0; k<vKFs.size(); k++)
+        {
+            g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
+            VSim3->setEstimate(vPropagatedScw[vKFs[k]]);
+            VSim3->setFixed((unsigned long)vKFs[k]==graph.nLoopKFid);
+            VSim3->setId(vKFs[k]);
+            VSim3->setMarginalized(false);
+            VSim3->_fix_scale = graph.bFixScale;
+            optimizer.addVertex(VSim3);
+        }
 
-        g2o::VertexSim3Expmap* VSim3 = static_cast<g2o::VertexSim3Expmap*>(optimizer.vertex(nIDi));
-        g2o::Sim3 CorrectedSiw =  VSim3->estimate();
-        vCorrectedSwc[nIDi]=CorrectedSiw.inverse();
-        Eigen::Matrix3d eigR = CorrectedSiw.rotation().toRotationMatrix();
-        Eigen::Vector3d eigt = CorrectedSiw.translation();
-        double s = CorrectedSiw.scale();
+        for(size_t k=0; k<vKFs.size(); k++)
+        {
+            const vector<int> &vEdgesOf = vvEdgesOf[vKFs[k]];
+            for(size_t j=0; j<vEdgesOf.size(); j++)
+            {
+                const int e = vEdgesOf[j];
+                const int nIDi = graph.vEdges[e].first;
+                const int nIDj = graph.vEdges[e].second;
+                const int nIDn = nIDi==vKFs[k] ? nIDj : nIDi;
+
+                // Edges inside the submap are seen from both ends
+                if(vSubmap[nIDn]==s && nIDi!=vKFs[k])
+                    continue;
+
+                if(vSubmap[nIDn]!=s && !optimizer.vertex(nIDn))
+                {
+                    g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
+                    VSim3->setEstimate(vPropagatedScw[nIDn]);
+                    VSim3->setFixed(true);
+                    VSim3->setId(nIDn);
+                    VSim3->setMarginalized(false);
+                    VSim3->_fix_scale = graph.bFixScale;
+                    optimizer.addVertex(VSim3);
+                }
+
+                g2o::EdgeSim3* edge = new g2o::EdgeSim3();
+                edge->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDj)));
+                edge->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
+                edge->setMeasurement(graph.vEdgeMeasurements[e]);
+                edge->information() = matLambda;
+                optimizer.addEdge(edge);
+            }
+        }
 
-        eigt *=(1./s); //[R t/s;0 1]
+        optimizer.initializeOptimization();
+        optimizer.optimize(nIterations);
 
-        cv::Mat Tiw = Converter::toCvSE3(eigR,eigt);
+        for(size_t k=0; k<vKFs.size(); k++)
+            graph.vCorrectedScw[vKFs[k]] = static_cast<g2o::VertexSim3Expmap*>(optimizer.vertex(vKFs[k]))->estimate();
+    };
 
-        pKFi->SetPose(Tiw);
+    const int nRounds = 2;
+    for(int round=0; round<nRounds; round++)
+    {
+        if(round>0)
+        {
+            vPropagatedScw = graph.vCorrectedScw;
+            nIterations = 5;
+        }
+
+        if(pThreadPool)
+            pThreadPool->ParallelFor(nSubmaps,relax);
+        else
+        {
+            for(int s=0; s<nSubmaps; s++)
+                relax(s);
+        }
+    }
+}
+
+void Optimizer::ApplyEssentialGraph(Map* pMap, KeyFrame* pCurKF, const EssentialGraph &graph)
+{
+    MapUpdateLock lock(pMap);
+
+    // Keyframes created while the graph was solved are corrected as their parent in the spanning tree
+    const unsigned long nMaxKFid = pMap->GetMaxKFid();
+    const unsigned long nGraphKFs = graph.vpKFs.size();
+    vector<cv::Mat> vTcwBefore(nMaxKFid+1);
+    vector<cv::Mat> vTcwAfter(nMaxKFid+1);
+
+    list<KeyFrame*> lpKFtoCheck(pMap->mvpKeyFrameOrigins.begin(),pMap->mvpKeyFrameOrigins.end());
+    while(!lpKFtoCheck.empty())
+    {
+        KeyFrame* pKF = lpKFtoCheck.front();
+        lpKFtoCheck.pop_front();
+
+        const unsigned long nIDi = pKF->mnId;
+        vTcwBefore[nIDi] = pKF->GetPose();
+
+        if(nIDi<nGraphKFs && graph.vpKFs[nIDi]==pKF)
+        {
+            // SE3 Pose Recovering. Sim3:[sR t;0 1] -> SE3:[R t/s;0 1]
+            const g2o::Sim3 &CorrectedSiw = graph.vCorrectedScw[nIDi];
+            Eigen::Matrix3d eigR = CorrectedSiw.rotation().toRotationMatrix();
+            Eigen::Vector3d eigt = CorrectedSiw.translation();
+            double s = CorrectedSiw.scale();
+
+            eigt *=(1./s); //[R t/s;0 1]
+
+            vTcwAfter[nIDi] = Converter::toCvSE3(eigR,eigt);
+        }
+        else
+        {
+            KeyFrame* pParentKF = pKF->GetParent();
+            if(pParentKF && !vTcwAfter[pParentKF->mnId].empty())
+            {
+                cv::Mat Tcp = vTcwBefore[nIDi]*vTcwBefore[pParentKF->mnId].inv();
+                vTcwAfter[nIDi] = Tcp*vTcwAfter[pParentKF->mnId];
+            }
+        }
+
+        // The children read the pose before the correction from vTcwBefore
+        if(!vTcwAfter[nIDi].empty())
+            pKF->SetPose(vTcwAfter[nIDi]);
+
+        const set<KeyFrame*> sChilds = pKF->GetChilds();
+        lpKFtoCheck.insert(lpKFtoCheck.end(),sChilds.begin(),sChilds.end());
     }
 
-    // Correct points. Transform to "non-optimized" reference keyframe pose and transform back with optimized pose
-    for(size_t i=0, iend=vpMPs.size(); i<iend; i++)
+    // Correct points. Transform to "non-optimized" reference keyframe pose and transform back with optimized pose.
+    // The "non-optimized" pose is the one at apply time: a local BA might have moved the keyframe and its
+    // points while the graph was solved, and the keyframe pose was just overwritten with the correction.
+    const Map::MapPointSpan spanMPs = pMap->GetMapPointSpan();
+    for(Map::MapPointSpan::const_iterator it=spanMPs.begin(), itend=spanMPs.end(); it!=itend; ++it)
     {
-        MapPoint* pMP = vpMPs[i];
+        MapPoint* pMP = *it;
 
         if(pMP->isBad())
             continue;
 
-        int nIDr;
+        unsigned long nIDr;
         if(pMP->mnCorrectedByKF==pCurKF->mnId)
         {
             nIDr = pMP->mnCorrectedReference;
@@ -1028,16 +1547,37 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
             nIDr = pRefKF->mnId;
         }
 
+        cv::Mat P3Dw = pMP->GetWorldPos();
 
-        g2o::Sim3 Srw = vScw[nIDr];
-        g2o::Sim3 correctedSwr = vCorrectedSwc[nIDr];
+        if(nIDr<nGraphKFs && graph.vpKFs[nIDr])
+        {
+            // Keep the scale of the graph, keyframes corrected around the loop are at a different scale
+            g2o::Sim3 Srw = graph.vScw[nIDr];
+            if(!vTcwBefore[nIDr].empty())
+            {
+                const cv::Mat &Trw = vTcwBefore[nIDr];
+                const double sr = Srw.scale();
+                Srw = g2o::Sim3(Converter::toMatrix3d(Trw.rowRange(0,3).colRange(0,3)),
+                                sr*Converter::toVector3d(Trw.rowRange(0,3).col(3)),sr);
+            }
+            const g2o::Sim3 correctedSwr = graph.vCorrectedScw[nIDr].inverse();
 
-        cv::Mat P3Dw = pMP->GetWorldPos();
-        Eigen::Matrix<double,3,1> eigP3Dw = Converter::toVector3d(P3Dw);
-        Eigen::Matrix<double,3,1> eigCorrectedP3Dw = correctedSwr.map(Srw.map(eigP3Dw));
+            Eigen::Matrix<double,3,1> eigP3Dw = Converter::toVector3d(P3Dw);
+            Eigen::Matrix<double,3,1> eigCorrectedP3Dw = correctedSwr.map(Srw.map(eigP3Dw));
 
-        cv::Mat cvCorrectedP3Dw = Converter::toCvMat(eigCorrectedP3Dw);
-        pMP->SetWorldPos(cvCorrectedP3Dw);
+            cv::Mat cvCorrectedP3Dw = Converter::toCvMat(eigCorrectedP3Dw);
+            pMP->SetWorldPos(cvCorrectedP3Dw);
+        }
+        else if(nIDr<=nMaxKFid && !vTcwAfter[nIDr].empty())
+        {
+            // Reference keyframe created during the optimization
+            const cv::Mat &Trw = vTcwBefore[nIDr];
+            const cv::Mat Twr = vTcwAfter[nIDr].inv();
+            cv::Mat Xr = Trw.rowRange(0,3).colRange(0,3)*P3Dw+Trw.rowRange(0,3).col(3);
+            pMP->SetWorldPos(Twr.rowRange(0,3).colRange(0,3)*Xr+Twr.rowRange(0,3).col(3));
+        }
+        else
+            continue;
 
         pMP->UpdateNormalAndDepth();
     }
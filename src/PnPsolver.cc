@@ -54,28 +54,265 @@
 
 #include <vector>
 #include <cmath>
+#include <complex>
 #include <opencv2/core/core.hpp>
-#include "Thirdparty/DBoW2/DUtils/Random.h"
 #include <algorithm>
 
+#include <Eigen/Dense>
+
 using namespace std;
 
 namespace ORB_SLAM2
 {
 
+// Ferrari's method, as in the original P3P paper. The real part of every
+// root is returned, spurious roots are rejected by the back-substitution.
+static void SolveQuartic(const double factors[5], double realRoots[4])
+{
+    const double A = factors[0];
+    const double B = factors[1];
+    const double C = factors[2];
+    const double D = factors[3];
+    const double E = factors[4];
+
+    const double A_pw2 = A*A;
+    const double B_pw2 = B*B;
+    const double A_pw3 = A_pw2*A;
+    const double B_pw3 = B_pw2*B;
+    const double A_pw4 = A_pw3*A;
+    const double B_pw4 = B_pw3*B;
+
+    const double alpha = -3*B_pw2/(8*A_pw2)+C/A;
+    const double beta = B_pw3/(8*A_pw3)-B*C/(2*A_pw2)+D/A;
+    const double gamma = -3*B_pw4/(256*A_pw4)+B_pw2*C/(16*A_pw3)-B*D/(4*A_pw2)+E/A;
+
+    const double alpha_pw2 = alpha*alpha;
+    const double alpha_pw3 = alpha_pw2*alpha;
+
+    const std::complex<double> P(-alpha_pw2/12-gamma,0);
+    const std::complex<double> Q(-alpha_pw3/108+alpha*gamma/3-beta*beta/8,0);
+    const std::complex<double> R = -Q/2.0+std::sqrt(Q*Q/4.0+P*P*P/27.0);
+
+    const std::complex<double> U = std::pow(R,1.0/3.0);
+    std::complex<double> y;
+    if(U.real()==0)
+        y = -5.0*alpha/6.0-std::pow(Q,1.0/3.0);
+    else
+        y = -5.0*alpha/6.0-P/(3.0*U)+U;
+
+    const std::complex<double> w = std::sqrt(alpha+2.0*y);
+    const std::complex<double> s1 = std::sqrt(-(3.0*alpha+2.0*y+2.0*beta/w));
+    const std::complex<double> s2 = std::sqrt(-(3.0*alpha+2.0*y-2.0*beta/w));
+
+    realRoots[0] = (-B/(4.0*A)+0.5*(w+s1)).real();
+    realRoots[1] = (-B/(4.0*A)+0.5*(w-s1)).real();
+    realRoots[2] = (-B/(4.0*A)+0.5*(-w+s2)).real();
+    realRoots[3] = (-B/(4.0*A)+0.5*(-w-s2)).real();
+}
+
+// P3P solver of Kneip et al., "A Novel Parametrization of the Perspective-Three-Point
+// Problem for a Direct Computation of Absolute Camera Position and Orientation", CVPR 2011.
+// Input: three world points and their unit bearing vectors in the camera frame.
+// Output: up to four world to camera poses, returns the number of solutions.
+static int SolveP3P(const Eigen::Vector3d P[3], const Eigen::Vector3d f[3],
+                    double Rs[4][3][3], double ts[4][3])
+{
+    Eigen::Vector3d P1 = P[0];
+    Eigen::Vector3d P2 = P[1];
+    const Eigen::Vector3d P3w = P[2];
+
+    // Degenerate configuration: collinear world points
+    if((P2-P1).cross(P3w-P1).squaredNorm()<1e-20)
+        return 0;
+
+    Eigen::Vector3d f1 = f[0];
+    Eigen::Vector3d f2 = f[1];
+
+    // Intermediate camera frame
+    Eigen::Vector3d e1 = f1;
+    Eigen::Vector3d e3 = f1.cross(f2);
+    if(e3.squaredNorm()<1e-20)
+        return 0;
+    e3.normalize();
+    Eigen::Vector3d e2 = e3.cross(e1);
+
+    Eigen::Matrix3d T;
+    T.row(0) = e1.transpose();
+    T.row(1) = e2.transpose();
+    T.row(2) = e3.transpose();
+
+    Eigen::Vector3d f3 = T*f[2];
+
+    // Enforce f3(2)<0 so that theta lies in [0,pi]
+    if(f3(2)>0)
+    {
+        f1 = f[1];
+        f2 = f[0];
+
+        e1 = f1;
+        e3 = f1.cross(f2);
+        e3.normalize();
+        e2 = e3.cross(e1);
+
+        T.row(0) = e1.transpose();
+        T.row(1) = e2.transpose();
+        T.row(2) = e3.transpose();
+
+        f3 = T*f[2];
+
+        P1 = P[1];
+        P2 = P[0];
+    }
+
+    // Intermediate world frame
+    Eigen::Vector3d n1 = (P2-P1).normalized();
+    Eigen::Vector3d n3 = n1.cross(P3w-P1).normalized();
+    Eigen::Vector3d n2 = n3.cross(n1);
+
+    Eigen::Matrix3d Nw;
+    Nw.row(0) = n1.transpose();
+    Nw.row(1) = n2.transpose();
+    Nw.row(2) = n3.transpose();
+
+    const Eigen::Vector3d P3 = Nw*(P3w-P1);
+
+    const double d_12 = (P2-P1).norm();
+    const double f_1 = f3(0)/f3(2);
+    const double f_2 = f3(1)/f3(2);
+    const double p_1 = P3(0);
+    const double p_2 = P3(1);
+
+    const double cos_beta = f1.dot(f2);
+    double b = 1.0/(1.0-cos_beta*cos_beta)-1;
+    b = cos_beta<0 ? -sqrt(b) : sqrt(b);
+
+    const double f_1_pw2 = f_1*f_1;
+    const double f_2_pw2 = f_2*f_2;
+    const double p_1_pw2 = p_1*p_1;
+    const double p_1_pw3 = p_1_pw2*p_1;
+    const double p_1_pw4 = p_1_pw3*p_1;
+    const double p_2_pw2 = p_2*p_2;
+    const double p_2_pw3 = p_2_pw2*p_2;
+    const double p_2_pw4 = p_2_pw3*p_2;
+    const double d_12_pw2 = d_12*d_12;
+    const double b_pw2 = b*b;
+
+    // Factors of the fourth degree polynomial in cos(theta)
+    double factors[5];
+    factors[0] = -f_2_pw2*p_2_pw4-p_2_pw4*f_1_pw2-p_2_pw4;
+    factors[1] = 2*p_2_pw3*d_12*b+2*f_2_pw2*p_2_pw3*d_12*b-2*f_2*p_2_pw3*f_1*d_12;
+    factors[2] = -f_2_pw2*p_2_pw2*p_1_pw2-f_2_pw2*p_2_pw2*d_12_pw2*b_pw2-f_2_pw2*p_2_pw2*d_12_pw2
+                 +f_2_pw2*p_2_pw4+p_2_pw4*f_1_pw2+2*p_1*p_2_pw2*d_12+2*f_1*f_2*p_1*p_2_pw2*d_12*b
+                 -p_2_pw2*p_1_pw2*f_1_pw2+2*p_1*p_2_pw2*f_2_pw2*d_12-p_2_pw2*d_12_pw2*b_pw2
+                 -2*p_1_pw2*p_2_pw2;
+    factors[3] = 2*p_1_pw2*p_2*d_12*b+2*f_2*p_2_pw3*f_1*d_12-2*f_2_pw2*p_2_pw3*d_12*b
+                 -2*p_1*p_2*d_12_pw2*b;
+    factors[4] = -2*f_2*p_2_pw2*f_1*p_1*d_12*b+f_2_pw2*p_2_pw2*d_12_pw2+2*p_1_pw3*d_12
+                 -p_1_pw2*d_12_pw2+f_2_pw2*p_2_pw2*p_1_pw2-p_1_pw4-2*f_2_pw2*p_2_pw2*p_1*d_12
+                 +p_2_pw2*f_1_pw2*p_1_pw2+f_2_pw2*p_2_pw2*d_12_pw2*b_pw2;
+
+    double realRoots[4];
+    SolveQuartic(factors,realRoots);
+
+    int nSolutions = 0;
+    for(int i=0; i<4; i++)
+    {
+        // Polish the root, Ferrari's formulas lose precision on nearly double roots
+        double x = realRoots[i];
+        for(int k=0; k<2; k++)
+        {
+            const double fx = (((factors[0]*x+factors[1])*x+factors[2])*x+factors[3])*x+factors[4];
+            const double dfx = ((4*factors[0]*x+3*factors[1])*x+2*factors[2])*x+factors[3];
+            if(dfx!=0)
+                x -= fx/dfx;
+        }
+
+        if(!(fabs(x)<=1.0))
+            continue;
+
+        const double cot_alpha = (-f_1*p_1/f_2-x*p_2+d_12*b)/(-f_1*x*p_2/f_2+p_1-d_12);
+
+        const double cos_theta = x;
+        const double sin_theta = sqrt(1-x*x);
+        const double sin_alpha = sqrt(1/(cot_alpha*cot_alpha+1));
+        double cos_alpha = sqrt(1-sin_alpha*sin_alpha);
+        if(cot_alpha<0)
+            cos_alpha = -cos_alpha;
+
+        if(!std::isfinite(cos_alpha))
+            continue;
+
+        // Camera center and orientation in the world frame
+        Eigen::Vector3d C(d_12*cos_alpha*(sin_alpha*b+cos_alpha),
+                          cos_theta*d_12*sin_alpha*(sin_alpha*b+cos_alpha),
+                          sin_theta*d_12*sin_alpha*(sin_alpha*b+cos_alpha));
+        C = P1+Nw.transpose()*C;
+
+        Eigen::Matrix3d Rwc;
+        Rwc << -cos_alpha, -sin_alpha*cos_theta, -sin_alpha*sin_theta,
+                sin_alpha, -cos_alpha*cos_theta, -cos_alpha*sin_theta,
+                0, -sin_theta, cos_theta;
+        Rwc = Nw.transpose()*Rwc.transpose()*T;
+
+        const Eigen::Matrix3d Rcw = Rwc.transpose();
+        const Eigen::Vector3d tcw = -Rcw*C;
+
+        for(int r=0; r<3; r++)
+        {
+            for(int c=0; c<3; c++)
+                Rs[nSolutions][r][c] = Rcw(r,c);
+            ts[nSolutions][r] = tcw(r);
+        }
+        nSolutions++;
+    }
+
+    return nSolutions;
+}
+
+// Projects all correspondences with the pose R|t and flags those whose squared
+// reprojection error is below their threshold. Structure of arrays without
+// branches, so that the loop is vectorized.
+static int CountInliers(const int n, const float* __restrict X, const float* __restrict Y, const float* __restrict Z,
+                        const float* __restrict U, const float* __restrict V, const float* __restrict maxError,
+                        const float Tcw[12], const float fu, const float fv, const float uc, const float vc,
+                        int* __restrict vbInliers)
+{
+    const float r00 = Tcw[0], r01 = Tcw[1], r02 = Tcw[2], tx = Tcw[3];
+    const float r10 = Tcw[4], r11 = Tcw[5], r12 = Tcw[6], ty = Tcw[7];
+    const float r20 = Tcw[8], r21 = Tcw[9], r22 = Tcw[10], tz = Tcw[11];
+
+    int nInliers = 0;
+    for(int i=0; i<n; i++)
+    {
+        const float Xc = r00*X[i]+r01*Y[i]+r02*Z[i]+tx;
+        const float Yc = r10*X[i]+r11*Y[i]+r12*Z[i]+ty;
+        const float Zc = r20*X[i]+r21*Y[i]+r22*Z[i]+tz;
+        const float invZc = 1.0f/Zc;
+
+        const float distX = U[i]-(uc+fu*Xc*invZc);
+        const float distY = V[i]-(vc+fv*Yc*invZc);
+
+        const int bInlier = (distX*distX+distY*distY<maxError[i]) & (Zc>0.0f);
+        vbInliers[i] = bInlier;
+        nInliers += bInlier;
+    }
+
+    return nInliers;
+}
 
 PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches):
     pws(0), us(0), alphas(0), pcs(0), maximum_number_of_correspondences(0), number_of_correspondences(0), mnInliersi(0),
     mnIterations(0), mnBestInliers(0), N(0)
 {
     mvpMapPointMatches = vpMapPointMatches;
-    mvP2D.reserve(F.mvpMapPoints.size());
+    mvU2D.reserve(F.mvpMapPoints.size());
+    mvV2D.reserve(F.mvpMapPoints.size());
     mvSigma2.reserve(F.mvpMapPoints.size());
-    mvP3Dw.reserve(F.mvpMapPoints.size());
+    mvX3Dw.reserve(F.mvpMapPoints.size());
+    mvY3Dw.reserve(F.mvpMapPoints.size());
+    mvZ3Dw.reserve(F.mvpMapPoints.size());
     mvKeyPointIndices.reserve(F.mvpMapPoints.size());
-    mvAllIndices.reserve(F.mvpMapPoints.size());
 
-    int idx=0;
     for(size_t i=0, iend=vpMapPointMatches.size(); i<iend; i++)
     {
         MapPoint* pMP = vpMapPointMatches[i];
@@ -86,16 +323,16 @@ PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches)
             {
                 const cv::KeyPoint &kp = F.mvKeysUn[i];
 
-                mvP2D.push_back(kp.pt);
+                mvU2D.push_back(kp.pt.x);
+                mvV2D.push_back(kp.pt.y);
                 mvSigma2.push_back(F.mvLevelSigma2[kp.octave]);
 
                 cv::Mat Pos = pMP->GetWorldPos();
-                mvP3Dw.push_back(cv::Point3f(Pos.at<float>(0),Pos.at<float>(1), Pos.at<float>(2)));
+                mvX3Dw.push_back(Pos.at<float>(0));
+                mvY3Dw.push_back(Pos.at<float>(1));
+                mvZ3Dw.push_back(Pos.at<float>(2));
 
                 mvKeyPointIndices.push_back(i);
-                mvAllIndices.push_back(idx);               
-
-                idx++;
             }
         }
     }
@@ -109,6 +346,11 @@ PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches)
     SetRansacParameters();
 }
 
+void PnPsolver::SetSeed(unsigned long seed)
+{
+    mRng.seed(seed);
+}
+
 PnPsolver::~PnPsolver()
 {
   delete [] pws;
@@ -126,9 +368,10 @@ void PnPsolver::SetRansacParameters(double probability, int minInliers, int maxI
     mRansacEpsilon = epsilon;
     mRansacMinSet = minSet;
 
-    N = mvP2D.size(); // number of correspondences
+    N = mvU2D.size(); // number of correspondences
 
     mvbInliersi.resize(N);
+    mvbHypothesisInliers.resize(N);
 
     // Adjust Parameters according to number of correspondences
     int nMinInliers = N*mRansacEpsilon;
@@ -141,7 +384,8 @@ void PnPsolver::SetRansacParameters(double probability, int minInliers, int maxI
     if(mRansacEpsilon<(float)mRansacMinInliers/N)
         mRansacEpsilon=(float)mRansacMinInliers/N;
 
-    // Set RANSAC iterations according to probability, epsilon, and max iterations
+    // Set RANSAC iterations according to probability, epsilon, and max iterations.
+    // Hypotheses come from P3P, a minimal set has three points.
     int nIterations;
 
     if(mRansacMinInliers==N)
@@ -168,44 +412,46 @@ cv::Mat PnPsolver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInlie
     vbInliers.clear();
     nInliers=0;
 
-    set_maximum_number_of_correspondences(mRansacMinSet);
-
-    if(N<mRansacMinInliers)
+    if(N<mRansacMinInliers || N<3)
     {
         bNoMore = true;
         return cv::Mat();
     }
 
-    vector<size_t> vAvailableIndices;
+    uniform_int_distribution<int> randomIndex(0,N-1);
 
     int nCurrentIterations = 0;
     while(mnIterations<mRansacMaxIts || nCurrentIterations<nIterations)
     {
         nCurrentIterations++;
         mnIterations++;
-        reset_correspondences();
-
-        vAvailableIndices = mvAllIndices;
 
         // Get min set of points
-        for(short i = 0; i < mRansacMinSet; ++i)
+        int vIndices[3];
+        vIndices[0] = randomIndex(mRng);
+        do
+            vIndices[1] = randomIndex(mRng);
+        while(vIndices[1]==vIndices[0]);
+        do
+            vIndices[2] = randomIndex(mRng);
+        while(vIndices[2]==vIndices[0] || vIndices[2]==vIndices[1]);
+
+        // Compute camera pose hypotheses and keep the one with more inliers
+        double Rs[4][3][3], ts[4][3];
+        const int nSolutions = ComputeMinimalPoses(vIndices,Rs,ts);
+
+        mnInliersi = 0;
+        for(int s=0; s<nSolutions; s++)
         {
-            int randi = DUtils::Random::RandomInt(0, vAvailableIndices.size()-1);
-
-            int idx = vAvailableIndices[randi];
-
-            add_correspondence(mvP3Dw[idx].x,mvP3Dw[idx].y,mvP3Dw[idx].z,mvP2D[idx].x,mvP2D[idx].y);
-
-            vAvailableIndices[randi] = vAvailableIndices.back();
-            vAvailableIndices.pop_back();
+            const int nHypothesisInliers = CheckInliers(Rs[s],ts[s],mvbHypothesisInliers);
+            if(nHypothesisInliers>mnInliersi)
+            {
+                mnInliersi = nHypothesisInliers;
+                mvbInliersi.swap(mvbHypothesisInliers);
+                copy_R_and_t(Rs[s],ts[s],mRi,mti);
+            }
         }
 
-        // Compute camera pose
-        compute_pose(mRi, mti);
-
-        // Check inliers
-        CheckInliers();
-
         if(mnInliersi>=mRansacMinInliers)
         {
             // If it is the best solution so far, save it
@@ -257,6 +503,20 @@ cv::Mat PnPsolver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInlie
     return cv::Mat();
 }
 
+int PnPsolver::ComputeMinimalPoses(const int vIndices[3], double Rs[4][3][3], double ts[4][3])
+{
+    Eigen::Vector3d P[3], f[3];
+    for(int i=0; i<3; i++)
+    {
+        const int idx = vIndices[i];
+        P[i] << mvX3Dw[idx], mvY3Dw[idx], mvZ3Dw[idx];
+        f[i] << (mvU2D[idx]-uc)/fu, (mvV2D[idx]-vc)/fv, 1.0;
+        f[i].normalize();
+    }
+
+    return SolveP3P(P,f,Rs,ts);
+}
+
 bool PnPsolver::Refine()
 {
     vector<int> vIndices;
@@ -277,14 +537,14 @@ bool PnPsolver::Refine()
     for(size_t i=0; i<vIndices.size(); i++)
     {
         int idx = vIndices[i];
-        add_correspondence(mvP3Dw[idx].x,mvP3Dw[idx].y,mvP3Dw[idx].z,mvP2D[idx].x,mvP2D[idx].y);
+        add_correspondence(mvX3Dw[idx],mvY3Dw[idx],mvZ3Dw[idx],mvU2D[idx],mvV2D[idx]);
     }
 
-    // Compute camera pose
+    // Compute camera pose (EPnP and Gauss-Newton on all inliers)
     compute_pose(mRi, mti);
 
     // Check inliers
-    CheckInliers();
+    mnInliersi = CheckInliers(mRi,mti,mvbInliersi);
 
     mnRefinedInliers =mnInliersi;
     mvbRefinedInliers = mvbInliersi;
@@ -305,37 +565,14 @@ bool PnPsolver::Refine()
 }
 
 
-void PnPsolver::CheckInliers()
+int PnPsolver::CheckInliers(const double R[3][3], const double t[3], vector<int> &vbInliers)
 {
-    mnInliersi=0;
-
-    for(int i=0; i<N; i++)
-    {
-        cv::Point3f P3Dw = mvP3Dw[i];
-        cv::Point2f P2D = mvP2D[i];
-
-        float Xc = mRi[0][0]*P3Dw.x+mRi[0][1]*P3Dw.y+mRi[0][2]*P3Dw.z+mti[0];
-        float Yc = mRi[1][0]*P3Dw.x+mRi[1][1]*P3Dw.y+mRi[1][2]*P3Dw.z+mti[1];
-        float invZc = 1/(mRi[2][0]*P3Dw.x+mRi[2][1]*P3Dw.y+mRi[2][2]*P3Dw.z+mti[2]);
+    const float Tcw[12] = {(float)R[0][0], (float)R[0][1], (float)R[0][2], (float)t[0],
+                           (float)R[1][0], (float)R[1][1], (float)R[1][2], (float)t[1],
+                           (float)R[2][0], (float)R[2][1], (float)R[2][2], (float)t[2]};
 
-        double ue = uc + fu * Xc * invZc;
-        double ve = vc + fv * Yc * invZc;
-
-        float distX = P2D.x-ue;
-        float distY = P2D.y-ve;
-
-        float error2 = distX*distX+distY*distY;
-
-        if(error2<mvMaxError[i])
-        {
-            mvbInliersi[i]=true;
-            mnInliersi++;
-        }
-        else
-        {
-            mvbInliersi[i]=false;
-        }
-    }
+    return CountInliers(N,&mvX3Dw[0],&mvY3Dw[0],&mvZ3Dw[0],&mvU2D[0],&mvV2D[0],&mvMaxError[0],
+                        Tcw,fu,fv,uc,vc,&vbInliers[0]);
 }
 
 
@@ -385,41 +622,41 @@ void PnPsolver::choose_control_points(void)
 
 
   // Take C1, C2, and C3 from PCA on the reference points:
-  CvMat * PW0 = cvCreateMat(number_of_correspondences, 3, CV_64F);
-
-  double pw0tpw0[3 * 3], dc[3], uct[3 * 3];
-  CvMat PW0tPW0 = cvMat(3, 3, CV_64F, pw0tpw0);
-  CvMat DC      = cvMat(3, 1, CV_64F, dc);
-  CvMat UCt     = cvMat(3, 3, CV_64F, uct);
-
-  for(int i = 0; i < number_of_correspondences; i++)
-    for(int j = 0; j < 3; j++)
-      PW0->data.db[3 * i + j] = pws[3 * i + j] - cws[0][j];
-
-  cvMulTransposed(PW0, &PW0tPW0, 1);
-  cvSVD(&PW0tPW0, &DC, &UCt, 0, CV_SVD_MODIFY_A | CV_SVD_U_T);
+  Eigen::Matrix3d PW0tPW0 = Eigen::Matrix3d::Zero();
+  for(int i = 0; i < number_of_correspondences; i++) {
+    const Eigen::Vector3d pw0(pws[3 * i] - cws[0][0], pws[3 * i + 1] - cws[0][1], pws[3 * i + 2] - cws[0][2]);
+    PW0tPW0.noalias() += pw0 * pw0.transpose();
+  }
 
-  cvReleaseMat(&PW0);
+  // Eigenvalues are sorted in increasing order, principal directions are the last ones
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(PW0tPW0);
+  const Eigen::Vector3d dc = es.eigenvalues().cwiseMax(0.0);
+  const Eigen::Matrix3d UC = es.eigenvectors();
 
   for(int i = 1; i < 4; i++) {
-    double k = sqrt(dc[i - 1] / number_of_correspondences);
+    double k = sqrt(dc(3 - i) / number_of_correspondences);
     for(int j = 0; j < 3; j++)
-      cws[i][j] = cws[0][j] + k * uct[3 * (i - 1) + j];
+      cws[i][j] = cws[0][j] + k * UC(j, 3 - i);
   }
 }
 
 void PnPsolver::compute_barycentric_coordinates(void)
 {
-  double cc[3 * 3], cc_inv[3 * 3];
-  CvMat CC     = cvMat(3, 3, CV_64F, cc);
-  CvMat CC_inv = cvMat(3, 3, CV_64F, cc_inv);
+  Eigen::Matrix3d CC;
 
   for(int i = 0; i < 3; i++)
     for(int j = 1; j < 4; j++)
-      cc[3 * i + j - 1] = cws[j][i] - cws[0][i];
+      CC(i, j - 1) = cws[j][i] - cws[0][i];
 
-  cvInvert(&CC, &CC_inv, CV_SVD);
-  double * ci = cc_inv;
+  // Pseudo-inverse, CC is singular for planar configurations
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(CC, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Vector3d sv = svd.singularValues();
+  Eigen::Vector3d sv_inv;
+  for(int i = 0; i < 3; i++)
+    sv_inv(i) = sv(i) > sv(0) * 1e-10 ? 1.0 / sv(i) : 0.0;
+  const Eigen::Matrix<double, 3, 3, Eigen::RowMajor> CC_inv =
+    svd.matrixV() * sv_inv.asDiagonal() * svd.matrixU().transpose();
+  const double * ci = CC_inv.data();
   for(int i = 0; i < number_of_correspondences; i++) {
     double * pi = pws + 3 * i;
     double * a = alphas + 4 * i;
@@ -433,11 +670,9 @@ void PnPsolver::compute_barycentric_coordinates(void)
   }
 }
 
-void PnPsolver::fill_M(CvMat * M,
-		  const int row, const double * as, const double u, const double v)
+void PnPsolver::fill_M(double * M1, double * M2,
+		  const double * as, const double u, const double v)
 {
-  double * M1 = M->data.db + row * 12;
-  double * M2 = M1 + 12;
 
   for(int i = 0; i < 4; i++) {
     M1[3 * i    ] = as[i] * fu;
@@ -479,40 +714,42 @@ double PnPsolver::compute_pose(double R[3][3], double t[3])
   choose_control_points();
   compute_barycentric_coordinates();
 
-  CvMat * M = cvCreateMat(2 * number_of_correspondences, 12, CV_64F);
-
-  for(int i = 0; i < number_of_correspondences; i++)
-    fill_M(M, 2 * i, alphas + 4 * i, us[2 * i], us[2 * i + 1]);
+  // MtM is accumulated directly, M (2n x 12) is never formed
+  Eigen::Matrix<double, 12, 12> MtM = Eigen::Matrix<double, 12, 12>::Zero();
+  Eigen::Matrix<double, 12, 1> M1, M2;
 
-  double mtm[12 * 12], d[12], ut[12 * 12];
-  CvMat MtM = cvMat(12, 12, CV_64F, mtm);
-  CvMat D   = cvMat(12,  1, CV_64F, d);
-  CvMat Ut  = cvMat(12, 12, CV_64F, ut);
+  for(int i = 0; i < number_of_correspondences; i++) {
+    fill_M(M1.data(), M2.data(), alphas + 4 * i, us[2 * i], us[2 * i + 1]);
+    MtM.noalias() += M1 * M1.transpose();
+    MtM.noalias() += M2 * M2.transpose();
+  }
 
-  cvMulTransposed(M, &MtM, 1);
-  cvSVD(&MtM, &D, &Ut, 0, CV_SVD_MODIFY_A | CV_SVD_U_T);
-  cvReleaseMat(&M);
+  // Rows of ut are the eigenvectors of MtM by decreasing eigenvalue (as U^T of its SVD)
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 12, 12> > es(MtM);
+  Eigen::Matrix<double, 12, 12, Eigen::RowMajor> Ut;
+  for(int i = 0; i < 12; i++)
+    Ut.row(i) = es.eigenvectors().col(11 - i).transpose();
+  const double * ut = Ut.data();
 
-  double l_6x10[6 * 10], rho[6];
-  CvMat L_6x10 = cvMat(6, 10, CV_64F, l_6x10);
-  CvMat Rho    = cvMat(6,  1, CV_64F, rho);
+  Eigen::Matrix<double, 6, 10, Eigen::RowMajor> L_6x10;
+  Eigen::Matrix<double, 6, 1> Rho;
 
-  compute_L_6x10(ut, l_6x10);
-  compute_rho(rho);
+  compute_L_6x10(ut, L_6x10.data());
+  compute_rho(Rho.data());
 
   double Betas[4][4], rep_errors[4];
   double Rs[4][3][3], ts[4][3];
 
-  find_betas_approx_1(&L_6x10, &Rho, Betas[1]);
-  gauss_newton(&L_6x10, &Rho, Betas[1]);
+  find_betas_approx_1(L_6x10, Rho, Betas[1]);
+  gauss_newton(L_6x10, Rho, Betas[1]);
   rep_errors[1] = compute_R_and_t(ut, Betas[1], Rs[1], ts[1]);
 
-  find_betas_approx_2(&L_6x10, &Rho, Betas[2]);
-  gauss_newton(&L_6x10, &Rho, Betas[2]);
+  find_betas_approx_2(L_6x10, Rho, Betas[2]);
+  gauss_newton(L_6x10, Rho, Betas[2]);
   rep_errors[2] = compute_R_and_t(ut, Betas[2], Rs[2], ts[2]);
 
-  find_betas_approx_3(&L_6x10, &Rho, Betas[3]);
-  gauss_newton(&L_6x10, &Rho, Betas[3]);
+  find_betas_approx_3(L_6x10, Rho, Betas[3]);
+  gauss_newton(L_6x10, Rho, Betas[3]);
   rep_errors[3] = compute_R_and_t(ut, Betas[3], Rs[3], ts[3]);
 
   int N = 1;
@@ -587,29 +824,24 @@ void PnPsolver::estimate_R_and_t(double R[3][3], double t[3])
     pw0[j] /= number_of_correspondences;
   }
 
-  double abt[3 * 3], abt_d[3], abt_u[3 * 3], abt_v[3 * 3];
-  CvMat ABt   = cvMat(3, 3, CV_64F, abt);
-  CvMat ABt_D = cvMat(3, 1, CV_64F, abt_d);
-  CvMat ABt_U = cvMat(3, 3, CV_64F, abt_u);
-  CvMat ABt_V = cvMat(3, 3, CV_64F, abt_v);
-
-  cvSetZero(&ABt);
+  Eigen::Matrix3d ABt = Eigen::Matrix3d::Zero();
   for(int i = 0; i < number_of_correspondences; i++) {
     double * pc = pcs + 3 * i;
     double * pw = pws + 3 * i;
 
     for(int j = 0; j < 3; j++) {
-      abt[3 * j    ] += (pc[j] - pc0[j]) * (pw[0] - pw0[0]);
-      abt[3 * j + 1] += (pc[j] - pc0[j]) * (pw[1] - pw0[1]);
-      abt[3 * j + 2] += (pc[j] - pc0[j]) * (pw[2] - pw0[2]);
+      ABt(j, 0) += (pc[j] - pc0[j]) * (pw[0] - pw0[0]);
+      ABt(j, 1) += (pc[j] - pc0[j]) * (pw[1] - pw0[1]);
+      ABt(j, 2) += (pc[j] - pc0[j]) * (pw[2] - pw0[2]);
     }
   }
 
-  cvSVD(&ABt, &ABt_D, &ABt_U, &ABt_V, CV_SVD_MODIFY_A);
+  Eigen::JacobiSVD<Eigen::Matrix3d> svd(ABt, Eigen::ComputeFullU | Eigen::ComputeFullV);
+  const Eigen::Matrix3d UVt = svd.matrixU() * svd.matrixV().transpose();
 
   for(int i = 0; i < 3; i++)
     for(int j = 0; j < 3; j++)
-      R[i][j] = dot(abt_u + 3 * i, abt_v + 3 * j);
+      R[i][j] = UVt(i, j);
 
   const double det =
     R[0][0] * R[1][1] * R[2][2] + R[0][1] * R[1][2] * R[2][0] + R[0][2] * R[1][0] * R[2][1] -
@@ -664,21 +896,18 @@ double PnPsolver::compute_R_and_t(const double * ut, const double * betas,
 // betas10        = [B11 B12 B22 B13 B23 B33 B14 B24 B34 B44]
 // betas_approx_1 = [B11 B12     B13         B14]
 
-void PnPsolver::find_betas_approx_1(const CvMat * L_6x10, const CvMat * Rho,
-			       double * betas)
+void PnPsolver::find_betas_approx_1(const Eigen::Matrix<double, 6, 10, Eigen::RowMajor> & L_6x10,
+			       const Eigen::Matrix<double, 6, 1> & Rho, double * betas)
 {
-  double l_6x4[6 * 4], b4[4];
-  CvMat L_6x4 = cvMat(6, 4, CV_64F, l_6x4);
-  CvMat B4    = cvMat(4, 1, CV_64F, b4);
+  Eigen::Matrix<double, 6, 4> L_6x4;
+  L_6x4.col(0) = L_6x10.col(0);
+  L_6x4.col(1) = L_6x10.col(1);
+  L_6x4.col(2) = L_6x10.col(3);
+  L_6x4.col(3) = L_6x10.col(6);
 
-  for(int i = 0; i < 6; i++) {
-    cvmSet(&L_6x4, i, 0, cvmGet(L_6x10, i, 0));
-    cvmSet(&L_6x4, i, 1, cvmGet(L_6x10, i, 1));
-    cvmSet(&L_6x4, i, 2, cvmGet(L_6x10, i, 3));
-    cvmSet(&L_6x4, i, 3, cvmGet(L_6x10, i, 6));
-  }
-
-  cvSolve(&L_6x4, Rho, &B4, CV_SVD);
+  const Eigen::Matrix<double, 4, 1> B4 =
+    L_6x4.jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV).solve(Rho);
+  const double * b4 = B4.data();
 
   if (b4[0] < 0) {
     betas[0] = sqrt(-b4[0]);
@@ -696,20 +925,17 @@ void PnPsolver::find_betas_approx_1(const CvMat * L_6x10, const CvMat * Rho,
 // betas10        = [B11 B12 B22 B13 B23 B33 B14 B24 B34 B44]
 // betas_approx_2 = [B11 B12 B22                            ]
 
-void PnPsolver::find_betas_approx_2(const CvMat * L_6x10, const CvMat * Rho,
-			       double * betas)
+void PnPsolver::find_betas_approx_2(const Eigen::Matrix<double, 6, 10, Eigen::RowMajor> & L_6x10,
+			       const Eigen::Matrix<double, 6, 1> & Rho, double * betas)
 {
-  double l_6x3[6 * 3], b3[3];
-  CvMat L_6x3  = cvMat(6, 3, CV_64F, l_6x3);
-  CvMat B3     = cvMat(3, 1, CV_64F, b3);
+  Eigen::Matrix<double, 6, 3> L_6x3;
+  L_6x3.col(0) = L_6x10.col(0);
+  L_6x3.col(1) = L_6x10.col(1);
+  L_6x3.col(2) = L_6x10.col(2);
 
-  for(int i = 0; i < 6; i++) {
-    cvmSet(&L_6x3, i, 0, cvmGet(L_6x10, i, 0));
-    cvmSet(&L_6x3, i, 1, cvmGet(L_6x10, i, 1));
-    cvmSet(&L_6x3, i, 2, cvmGet(L_6x10, i, 2));
-  }
-
-  cvSolve(&L_6x3, Rho, &B3, CV_SVD);
+  const Eigen::Matrix<double, 3, 1> B3 =
+    L_6x3.jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV).solve(Rho);
+  const double * b3 = B3.data();
 
   if (b3[0] < 0) {
     betas[0] = sqrt(-b3[0]);
@@ -728,22 +954,19 @@ void PnPsolver::find_betas_approx_2(const CvMat * L_6x10, const CvMat * Rho,
 // betas10        = [B11 B12 B22 B13 B23 B33 B14 B24 B34 B44]
 // betas_approx_3 = [B11 B12 B22 B13 B23                    ]
 
-void PnPsolver::find_betas_approx_3(const CvMat * L_6x10, const CvMat * Rho,
-			       double * betas)
+void PnPsolver::find_betas_approx_3(const Eigen::Matrix<double, 6, 10, Eigen::RowMajor> & L_6x10,
+			       const Eigen::Matrix<double, 6, 1> & Rho, double * betas)
 {
-  double l_6x5[6 * 5], b5[5];
-  CvMat L_6x5 = cvMat(6, 5, CV_64F, l_6x5);
-  CvMat B5    = cvMat(5, 1, CV_64F, b5);
+  Eigen::Matrix<double, 6, 5> L_6x5;
+  L_6x5.col(0) = L_6x10.col(0);
+  L_6x5.col(1) = L_6x10.col(1);
+  L_6x5.col(2) = L_6x10.col(2);
+  L_6x5.col(3) = L_6x10.col(3);
+  L_6x5.col(4) = L_6x10.col(4);
 
-  for(int i = 0; i < 6; i++) {
-    cvmSet(&L_6x5, i, 0, cvmGet(L_6x10, i, 0));
-    cvmSet(&L_6x5, i, 1, cvmGet(L_6x10, i, 1));
-    cvmSet(&L_6x5, i, 2, cvmGet(L_6x10, i, 2));
-    cvmSet(&L_6x5, i, 3, cvmGet(L_6x10, i, 3));
-    cvmSet(&L_6x5, i, 4, cvmGet(L_6x10, i, 4));
-  }
-
-  cvSolve(&L_6x5, Rho, &B5, CV_SVD);
+  const Eigen::Matrix<double, 5, 1> B5 =
+    L_6x5.jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV).solve(Rho);
+  const double * b5 = B5.data();
 
   if (b5[0] < 0) {
     betas[0] = sqrt(-b5[0]);
@@ -810,18 +1033,19 @@ void PnPsolver::compute_rho(double * rho)
 }
 
 void PnPsolver::compute_A_and_b_gauss_newton(const double * l_6x10, const double * rho,
-					double betas[4], CvMat * A, CvMat * b)
+					double betas[4], Eigen::Matrix<double, 6, 4, Eigen::RowMajor> & A,
+					Eigen::Matrix<double, 6, 1> & b)
 {
   for(int i = 0; i < 6; i++) {
     const double * rowL = l_6x10 + i * 10;
-    double * rowA = A->data.db + i * 4;
+    double * rowA = A.data() + i * 4;
 
     rowA[0] = 2 * rowL[0] * betas[0] +     rowL[1] * betas[1] +     rowL[3] * betas[2] +     rowL[6] * betas[3];
     rowA[1] =     rowL[1] * betas[0] + 2 * rowL[2] * betas[1] +     rowL[4] * betas[2] +     rowL[7] * betas[3];
     rowA[2] =     rowL[3] * betas[0] +     rowL[4] * betas[1] + 2 * rowL[5] * betas[2] +     rowL[8] * betas[3];
     rowA[3] =     rowL[6] * betas[0] +     rowL[7] * betas[1] +     rowL[8] * betas[2] + 2 * rowL[9] * betas[3];
 
-    cvmSet(b, i, 0, rho[i] -
+    b(i) = rho[i] -
 	   (
 	    rowL[0] * betas[0] * betas[0] +
 	    rowL[1] * betas[0] * betas[1] +
@@ -833,119 +1057,29 @@ void PnPsolver::compute_A_and_b_gauss_newton(const double * l_6x10, const double
 	    rowL[7] * betas[1] * betas[3] +
 	    rowL[8] * betas[2] * betas[3] +
 	    rowL[9] * betas[3] * betas[3]
-	    ));
+	    );
   }
 }
 
-void PnPsolver::gauss_newton(const CvMat * L_6x10, const CvMat * Rho,
-			double betas[4])
+void PnPsolver::gauss_newton(const Eigen::Matrix<double, 6, 10, Eigen::RowMajor> & L_6x10,
+			const Eigen::Matrix<double, 6, 1> & Rho, double betas[4])
 {
   const int iterations_number = 5;
 
-  double a[6*4], b[6], x[4];
-  CvMat A = cvMat(6, 4, CV_64F, a);
-  CvMat B = cvMat(6, 1, CV_64F, b);
-  CvMat X = cvMat(4, 1, CV_64F, x);
+  Eigen::Matrix<double, 6, 4, Eigen::RowMajor> A;
+  Eigen::Matrix<double, 6, 1> B;
 
   for(int k = 0; k < iterations_number; k++) {
-    compute_A_and_b_gauss_newton(L_6x10->data.db, Rho->data.db,
-				 betas, &A, &B);
-    qr_solve(&A, &B, &X);
-
-    for(int i = 0; i < 4; i++)
-      betas[i] += x[i];
-  }
-}
-
-void PnPsolver::qr_solve(CvMat * A, CvMat * b, CvMat * X)
-{
-  static int max_nr = 0;
-  static double * A1, * A2;
-
-  const int nr = A->rows;
-  const int nc = A->cols;
-
-  if (max_nr != 0 && max_nr < nr) {
-    delete [] A1;
-    delete [] A2;
-  }
-  if (max_nr < nr) {
-    max_nr = nr;
-    A1 = new double[nr];
-    A2 = new double[nr];
-  }
-
-  double * pA = A->data.db, * ppAkk = pA;
-  for(int k = 0; k < nc; k++) {
-    double * ppAik = ppAkk, eta = fabs(*ppAik);
-    for(int i = k + 1; i < nr; i++) {
-      double elt = fabs(*ppAik);
-      if (eta < elt) eta = elt;
-      ppAik += nc;
-    }
+    compute_A_and_b_gauss_newton(L_6x10.data(), Rho.data(),
+				 betas, A, B);
+    const Eigen::Matrix<double, 4, 1> X = A.householderQr().solve(B);
 
-    if (eta == 0) {
-      A1[k] = A2[k] = 0.0;
-      cerr << "God damnit, A is singular, this shouldn't happen." << endl;
+    // A is singular, keep the current estimate
+    if (!std::isfinite(X(0) + X(1) + X(2) + X(3)))
       return;
-    } else {
-      double * ppAik = ppAkk, sum = 0.0, inv_eta = 1. / eta;
-      for(int i = k; i < nr; i++) {
-	*ppAik *= inv_eta;
-	sum += *ppAik * *ppAik;
-	ppAik += nc;
-      }
-      double sigma = sqrt(sum);
-      if (*ppAkk < 0)
-	sigma = -sigma;
-      *ppAkk += sigma;
-      A1[k] = sigma * *ppAkk;
-      A2[k] = -eta * sigma;
-      for(int j = k + 1; j < nc; j++) {
-	double * ppAik = ppAkk, sum = 0;
-	for(int i = k; i < nr; i++) {
-	  sum += *ppAik * ppAik[j - k];
-	  ppAik += nc;
-	}
-	double tau = sum / A1[k];
-	ppAik = ppAkk;
-	for(int i = k; i < nr; i++) {
-	  ppAik[j - k] -= tau * *ppAik;
-	  ppAik += nc;
-	}
-      }
-    }
-    ppAkk += nc + 1;
-  }
 
-  // b <- Qt b
-  double * ppAjj = pA, * pb = b->data.db;
-  for(int j = 0; j < nc; j++) {
-    double * ppAij = ppAjj, tau = 0;
-    for(int i = j; i < nr; i++)	{
-      tau += *ppAij * pb[i];
-      ppAij += nc;
-    }
-    tau /= A1[j];
-    ppAij = ppAjj;
-    for(int i = j; i < nr; i++) {
-      pb[i] -= tau * *ppAij;
-      ppAij += nc;
-    }
-    ppAjj += nc + 1;
-  }
-
-  // X = R-1 b
-  double * pX = X->data.db;
-  pX[nc - 1] = pb[nc - 1] / A2[nc - 1];
-  for(int i = nc - 2; i >= 0; i--) {
-    double * ppAij = pA + i * nc + (i + 1), sum = 0;
-
-    for(int j = i + 1; j < nc; j++) {
-      sum += *ppAij * pX[j];
-      ppAij++;
-    }
-    pX[i] = (pb[i] - sum) / A2[i];
+    for(int i = 0; i < 4; i++)
+      betas[i] += X(i);
   }
 }
 
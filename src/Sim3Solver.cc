@@ -25,14 +25,50 @@
 #include <cmath>
 #include <opencv2/core/core.hpp>
 
+#include <Eigen/Dense>
+
 #include "KeyFrame.h"
 #include "ORBmatcher.h"
 
-#include "Thirdparty/DBoW2/DUtils/Random.h"
-
 namespace ORB_SLAM2
 {
 
+// Transforms the points with sR|t, projects them with the calibration and returns the squared
+// distance to the given image points. Structure of arrays without branches, so that the loop
+// is vectorized.
+static void ReprojectionErrors(const int n, const float* __restrict X, const float* __restrict Y, const float* __restrict Z,
+                               const float* __restrict U, const float* __restrict V, const float sRt[12],
+                               const float fx, const float fy, const float cx, const float cy, float* __restrict err)
+{
+    const float r00 = sRt[0], r01 = sRt[1], r02 = sRt[2], tx = sRt[3];
+    const float r10 = sRt[4], r11 = sRt[5], r12 = sRt[6], ty = sRt[7];
+    const float r20 = sRt[8], r21 = sRt[9], r22 = sRt[10], tz = sRt[11];
+
+    for(int i=0; i<n; i++)
+    {
+        const float Xc = r00*X[i]+r01*Y[i]+r02*Z[i]+tx;
+        const float Yc = r10*X[i]+r11*Y[i]+r12*Z[i]+ty;
+        const float invz = 1.0f/(r20*X[i]+r21*Y[i]+r22*Z[i]+tz);
+
+        const float distX = U[i]-(fx*Xc*invz+cx);
+        const float distY = V[i]-(fy*Yc*invz+cy);
+
+        err[i] = distX*distX+distY*distY;
+    }
+}
+
+static int ThresholdErrors(const int n, const float* __restrict err1, const float* __restrict err2,
+                           const float* __restrict maxErr1, const float* __restrict maxErr2, int* __restrict vbInliers)
+{
+    int nInliers = 0;
+    for(int i=0; i<n; i++)
+    {
+        const int bInlier = (err1[i]<maxErr1[i]) & (err2[i]<maxErr2[i]);
+        vbInliers[i] = bInlier;
+        nInliers += bInlier;
+    }
+    return nInliers;
+}
 
 Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *> &vpMatched12, const bool bFixScale):
     mnIterations(0), mnBestInliers(0), mbFixScale(bFixScale)
@@ -48,17 +84,14 @@ Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *>
     mvpMapPoints2.reserve(mN1);
     mvpMatches12 = vpMatched12;
     mvnIndices1.reserve(mN1);
-    mvX3Dc1.reserve(mN1);
-    mvX3Dc2.reserve(mN1);
+    mvX3Dc1.reserve(mN1); mvY3Dc1.reserve(mN1); mvZ3Dc1.reserve(mN1);
+    mvX3Dc2.reserve(mN1); mvY3Dc2.reserve(mN1); mvZ3Dc2.reserve(mN1);
 
     cv::Mat Rcw1 = pKF1->GetRotation();
     cv::Mat tcw1 = pKF1->GetTranslation();
     cv::Mat Rcw2 = pKF2->GetRotation();
     cv::Mat tcw2 = pKF2->GetTranslation();
 
-    mvAllIndices.reserve(mN1);
-
-    size_t idx=0;
     for(int i1=0; i1<mN1; i1++)
     {
         if(vpMatched12[i1])
@@ -92,25 +125,44 @@ Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *>
             mvnIndices1.push_back(i1);
 
             cv::Mat X3D1w = pMP1->GetWorldPos();
-            mvX3Dc1.push_back(Rcw1*X3D1w+tcw1);
+            cv::Mat X3D1c = Rcw1*X3D1w+tcw1;
+            mvX3Dc1.push_back(X3D1c.at<float>(0));
+            mvY3Dc1.push_back(X3D1c.at<float>(1));
+            mvZ3Dc1.push_back(X3D1c.at<float>(2));
 
             cv::Mat X3D2w = pMP2->GetWorldPos();
-            mvX3Dc2.push_back(Rcw2*X3D2w+tcw2);
-
-            mvAllIndices.push_back(idx);
-            idx++;
+            cv::Mat X3D2c = Rcw2*X3D2w+tcw2;
+            mvX3Dc2.push_back(X3D2c.at<float>(0));
+            mvY3Dc2.push_back(X3D2c.at<float>(1));
+            mvZ3Dc2.push_back(X3D2c.at<float>(2));
         }
     }
 
-    mK1 = pKF1->mK;
-    mK2 = pKF2->mK;
+    mfx1 = pKF1->fx; mfy1 = pKF1->fy; mcx1 = pKF1->cx; mcy1 = pKF1->cy;
+    mfx2 = pKF2->fx; mfy2 = pKF2->fy; mcx2 = pKF2->cx; mcy2 = pKF2->cy;
+
+    const size_t nPoints = mvX3Dc1.size();
+    mvU1im1.resize(nPoints); mvV1im1.resize(nPoints);
+    mvU2im2.resize(nPoints); mvV2im2.resize(nPoints);
+    for(size_t i=0; i<nPoints; i++)
+    {
+        const float invz1 = 1.0f/mvZ3Dc1[i];
+        mvU1im1[i] = mfx1*mvX3Dc1[i]*invz1+mcx1;
+        mvV1im1[i] = mfy1*mvY3Dc1[i]*invz1+mcy1;
 
-    FromCameraToImage(mvX3Dc1,mvP1im1,mK1);
-    FromCameraToImage(mvX3Dc2,mvP2im2,mK2);
+        const float invz2 = 1.0f/mvZ3Dc2[i];
+        mvU2im2[i] = mfx2*mvX3Dc2[i]*invz2+mcx2;
+        mvV2im2[i] = mfy2*mvY3Dc2[i]*invz2+mcy2;
+    }
 
     SetRansacParameters();
 }
 
+void Sim3Solver::SetSeed(unsigned long seed)
+{
+    mRng.seed(seed);
+}
+
 void Sim3Solver::SetRansacParameters(double probability, int minInliers, int maxIterations)
 {
     mRansacProb = probability;
@@ -120,6 +172,8 @@ void Sim3Solver::SetRansacParameters(double probability, int minInliers, int max
     N = mvpMapPoints1.size(); // number of correspondences
 
     mvbInliersi.resize(N);
+    mvErr1.resize(N);
+    mvErr2.resize(N);
 
     // Adjust Parameters according to number of correspondences
     float epsilon = (float)mRansacMinInliers/N;
@@ -143,16 +197,16 @@ cv::Mat Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInli
     vbInliers = vector<bool>(mN1,false);
     nInliers=0;
 
-    if(N<mRansacMinInliers)
+    if(N<mRansacMinInliers || N<3)
     {
         bNoMore = true;
         return cv::Mat();
     }
 
-    vector<size_t> vAvailableIndices;
+    uniform_int_distribution<int> randomIndex(0,N-1);
 
-    cv::Mat P3Dc1i(3,3,CV_32F);
-    cv::Mat P3Dc2i(3,3,CV_32F);
+    Eigen::Matrix3f P3Dc1i;
+    Eigen::Matrix3f P3Dc2i;
 
     int nCurrentIterations = 0;
     while(mnIterations<mRansacMaxIts && nCurrentIterations<nIterations)
@@ -160,20 +214,21 @@ cv::Mat Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInli
         nCurrentIterations++;
         mnIterations++;
 
-        vAvailableIndices = mvAllIndices;
-
         // Get min set of points
-        for(short i = 0; i < 3; ++i)
+        int vIndices[3];
+        vIndices[0] = randomIndex(mRng);
+        do
+            vIndices[1] = randomIndex(mRng);
+        while(vIndices[1]==vIndices[0]);
+        do
+            vIndices[2] = randomIndex(mRng);
+        while(vIndices[2]==vIndices[0] || vIndices[2]==vIndices[1]);
+
+        for(int i=0; i<3; i++)
         {
-            int randi = DUtils::Random::RandomInt(0, vAvailableIndices.size()-1);
-
-            int idx = vAvailableIndices[randi];
-
-            mvX3Dc1[idx].copyTo(P3Dc1i.col(i));
-            mvX3Dc2[idx].copyTo(P3Dc2i.col(i));
-
-            vAvailableIndices[randi] = vAvailableIndices.back();
-            vAvailableIndices.pop_back();
+            const int idx = vIndices[i];
+            P3Dc1i.col(i) << mvX3Dc1[idx], mvY3Dc1[idx], mvZ3Dc1[idx];
+            P3Dc2i.col(i) << mvX3Dc2[idx], mvY3Dc2[idx], mvZ3Dc2[idx];
         }
 
         ComputeSim3(P3Dc1i,P3Dc2i);
@@ -184,13 +239,19 @@ cv::Mat Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool> &vbInli
         {
             mvbBestInliers = mvbInliersi;
             mnBestInliers = mnInliersi;
-            mBestT12 = mT12i.clone();
-            mBestRotation = mR12i.clone();
-            mBestTranslation = mt12i.clone();
-            mBestScale = ms12i;
 
             if(mnInliersi>mRansacMinInliers)
             {
+                mBestScale = ms12i;
+                mBestRotation = (cv::Mat_<float>(3,3) << mR12i(0,0), mR12i(0,1), mR12i(0,2),
+                                                         mR12i(1,0), mR12i(1,1), mR12i(1,2),
+                                                         mR12i(2,0), mR12i(2,1), mR12i(2,2));
+                mBestTranslation = (cv::Mat_<float>(3,1) << mt12i(0), mt12i(1), mt12i(2));
+                mBestT12 = cv::Mat::eye(4,4,CV_32F);
+                cv::Mat sR = ms12i*mBestRotation;
+                sR.copyTo(mBestT12.rowRange(0,3).colRange(0,3));
+                mBestTranslation.copyTo(mBestT12.rowRange(0,3).col(3));
+
                 nInliers = mnInliersi;
                 for(int i=0; i<N; i++)
                     if(mvbInliersi[i])
@@ -212,98 +273,61 @@ cv::Mat Sim3Solver::find(vector<bool> &vbInliers12, int &nInliers)
     return iterate(mRansacMaxIts,bFlag,vbInliers12,nInliers);
 }
 
-void Sim3Solver::ComputeCentroid(cv::Mat &P, cv::Mat &Pr, cv::Mat &C)
-{
-    cv::reduce(P,C,1,CV_REDUCE_SUM);
-    C = C/P.cols;
-
-    for(int i=0; i<P.cols; i++)
-    {
-        Pr.col(i)=P.col(i)-C;
-    }
-}
-
-void Sim3Solver::ComputeSim3(cv::Mat &P1, cv::Mat &P2)
+void Sim3Solver::ComputeSim3(const Eigen::Matrix3f &P1, const Eigen::Matrix3f &P2)
 {
     // Custom implementation of:
     // Horn 1987, Closed-form solution of absolute orientataion using unit quaternions
 
     // Step 1: Centroid and relative coordinates
 
-    cv::Mat Pr1(P1.size(),P1.type()); // Relative coordinates to centroid (set 1)
-    cv::Mat Pr2(P2.size(),P2.type()); // Relative coordinates to centroid (set 2)
-    cv::Mat O1(3,1,Pr1.type()); // Centroid of P1
-    cv::Mat O2(3,1,Pr2.type()); // Centroid of P2
+    const Eigen::Vector3f O1 = P1.rowwise().mean(); // Centroid of P1
+    const Eigen::Vector3f O2 = P2.rowwise().mean(); // Centroid of P2
 
-    ComputeCentroid(P1,Pr1,O1);
-    ComputeCentroid(P2,Pr2,O2);
+    const Eigen::Matrix3f Pr1 = P1.colwise()-O1; // Relative coordinates to centroid (set 1)
+    const Eigen::Matrix3f Pr2 = P2.colwise()-O2; // Relative coordinates to centroid (set 2)
 
     // Step 2: Compute M matrix
 
-    cv::Mat M = Pr2*Pr1.t();
+    const Eigen::Matrix3d M = (Pr2*Pr1.transpose()).cast<double>();
 
     // Step 3: Compute N matrix
 
     double N11, N12, N13, N14, N22, N23, N24, N33, N34, N44;
 
-    cv::Mat N(4,4,P1.type());
-
-    N11 = M.at<float>(0,0)+M.at<float>(1,1)+M.at<float>(2,2);
-    N12 = M.at<float>(1,2)-M.at<float>(2,1);
-    N13 = M.at<float>(2,0)-M.at<float>(0,2);
-    N14 = M.at<float>(0,1)-M.at<float>(1,0);
-    N22 = M.at<float>(0,0)-M.at<float>(1,1)-M.at<float>(2,2);
-    N23 = M.at<float>(0,1)+M.at<float>(1,0);
-    N24 = M.at<float>(2,0)+M.at<float>(0,2);
-    N33 = -M.at<float>(0,0)+M.at<float>(1,1)-M.at<float>(2,2);
-    N34 = M.at<float>(1,2)+M.at<float>(2,1);
-    N44 = -M.at<float>(0,0)-M.at<float>(1,1)+M.at<float>(2,2);
-
-    N = (cv::Mat_<float>(4,4) << N11, N12, N13, N14,
-                                 N12, N22, N23, N24,
-                                 N13, N23, N33, N34,
-                                 N14, N24, N34, N44);
-
-
-    // Step 4: Eigenvector of the highest eigenvalue
+    N11 = M(0,0)+M(1,1)+M(2,2);
+    N12 = M(1,2)-M(2,1);
+    N13 = M(2,0)-M(0,2);
+    N14 = M(0,1)-M(1,0);
+    N22 = M(0,0)-M(1,1)-M(2,2);
+    N23 = M(0,1)+M(1,0);
+    N24 = M(2,0)+M(0,2);
+    N33 = -M(0,0)+M(1,1)-M(2,2);
+    N34 = M(1,2)+M(2,1);
+    N44 = -M(0,0)-M(1,1)+M(2,2);
 
-    cv::Mat eval, evec;
+    Eigen::Matrix4d N;
+    N << N11, N12, N13, N14,
+         N12, N22, N23, N24,
+         N13, N23, N33, N34,
+         N14, N24, N34, N44;
 
-    cv::eigen(N,eval,evec); //evec[0] is the quaternion of the desired rotation
+    // Step 4: Eigenvector of the highest eigenvalue (eigenvalues are sorted in increasing order)
 
-    cv::Mat vec(1,3,evec.type());
-    (evec.row(0).colRange(1,4)).copyTo(vec); //extract imaginary part of the quaternion (sin*axis)
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix4d> es(N);
+    const Eigen::Vector4d q = es.eigenvectors().col(3); // quaternion of the desired rotation (w,x,y,z)
 
-    // Rotation angle. sin is the norm of the imaginary part, cos is the real part
-    double ang=atan2(norm(vec),evec.at<float>(0,0));
-
-    vec = 2*ang*vec/norm(vec); //Angle-axis representation. quaternion angle is the half
-
-    mR12i.create(3,3,P1.type());
-
-    cv::Rodrigues(vec,mR12i); // computes the rotation matrix from angle-axis
+    mR12i = Eigen::Quaterniond(q(0),q(1),q(2),q(3)).normalized().toRotationMatrix().cast<float>();
 
     // Step 5: Rotate set 2
 
-    cv::Mat P3 = mR12i*Pr2;
+    const Eigen::Matrix3f P3 = mR12i*Pr2;
 
     // Step 6: Scale
 
     if(!mbFixScale)
     {
-        double nom = Pr1.dot(P3);
-        cv::Mat aux_P3(P3.size(),P3.type());
-        aux_P3=P3;
-        cv::pow(P3,2,aux_P3);
-        double den = 0;
-
-        for(int i=0; i<aux_P3.rows; i++)
-        {
-            for(int j=0; j<aux_P3.cols; j++)
-            {
-                den+=aux_P3.at<float>(i,j);
-            }
-        }
+        const double nom = Pr1.cwiseProduct(P3).sum();
+        const double den = P3.squaredNorm();
 
         ms12i = nom/den;
     }
@@ -312,55 +336,35 @@ void Sim3Solver::ComputeSim3(cv::Mat &P1, cv::Mat &P2)
 
     // Step 7: Translation
 
-    mt12i.create(1,3,P1.type());
     mt12i = O1 - ms12i*mR12i*O2;
 
     // Step 8: Transformation
 
     // Step 8.1 T12
-    mT12i = cv::Mat::eye(4,4,P1.type());
-
-    cv::Mat sR = ms12i*mR12i;
-
-    sR.copyTo(mT12i.rowRange(0,3).colRange(0,3));
-    mt12i.copyTo(mT12i.rowRange(0,3).col(3));
+    msR12i = ms12i*mR12i;
 
     // Step 8.2 T21
-
-    mT21i = cv::Mat::eye(4,4,P1.type());
-
-    cv::Mat sRinv = (1.0/ms12i)*mR12i.t();
-
-    sRinv.copyTo(mT21i.rowRange(0,3).colRange(0,3));
-    cv::Mat tinv = -sRinv*mt12i;
-    tinv.copyTo(mT21i.rowRange(0,3).col(3));
+    msR21i = (1.0f/ms12i)*mR12i.transpose();
+    mt21i = -msR21i*mt12i;
 }
 
 
 void Sim3Solver::CheckInliers()
 {
-    vector<cv::Mat> vP1im2, vP2im1;
-    Project(mvX3Dc2,vP2im1,mT12i,mK1);
-    Project(mvX3Dc1,vP1im2,mT21i,mK2);
-
-    mnInliersi=0;
-
-    for(size_t i=0; i<mvP1im1.size(); i++)
-    {
-        cv::Mat dist1 = mvP1im1[i]-vP2im1[i];
-        cv::Mat dist2 = vP1im2[i]-mvP2im2[i];
-
-        const float err1 = dist1.dot(dist1);
-        const float err2 = dist2.dot(dist2);
-
-        if(err1<mvnMaxError1[i] && err2<mvnMaxError2[i])
-        {
-            mvbInliersi[i]=true;
-            mnInliersi++;
-        }
-        else
-            mvbInliersi[i]=false;
-    }
+    const float T12[12] = {msR12i(0,0), msR12i(0,1), msR12i(0,2), mt12i(0),
+                           msR12i(1,0), msR12i(1,1), msR12i(1,2), mt12i(1),
+                           msR12i(2,0), msR12i(2,1), msR12i(2,2), mt12i(2)};
+    const float T21[12] = {msR21i(0,0), msR21i(0,1), msR21i(0,2), mt21i(0),
+                           msR21i(1,0), msR21i(1,1), msR21i(1,2), mt21i(1),
+                           msR21i(2,0), msR21i(2,1), msR21i(2,2), mt21i(2)};
+
+    // Points of KF2 projected in KF1, and points of KF1 projected in KF2
+    ReprojectionErrors(N,&mvX3Dc2[0],&mvY3Dc2[0],&mvZ3Dc2[0],&mvU1im1[0],&mvV1im1[0],T12,
+                       mfx1,mfy1,mcx1,mcy1,&mvErr1[0]);
+    ReprojectionErrors(N,&mvX3Dc1[0],&mvY3Dc1[0],&mvZ3Dc1[0],&mvU2im2[0],&mvV2im2[0],T21,
+                       mfx2,mfy2,mcx2,mcy2,&mvErr2[0]);
+
+    mnInliersi = ThresholdErrors(N,&mvErr1[0],&mvErr2[0],&mvnMaxError1[0],&mvnMaxError2[0],&mvbInliersi[0]);
 }
 
 
@@ -379,47 +383,4 @@ float Sim3Solver::GetEstimatedScale()
     return mBestScale;
 }
 
-void Sim3Solver::Project(const vector<cv::Mat> &vP3Dw, vector<cv::Mat> &vP2D, cv::Mat Tcw, cv::Mat K)
-{
-    cv::Mat Rcw = Tcw.rowRange(0,3).colRange(0,3);
-    cv::Mat tcw = Tcw.rowRange(0,3).col(3);
-    const float &fx = K.at<float>(0,0);
-    const float &fy = K.at<float>(1,1);
-    const float &cx = K.at<float>(0,2);
-    const float &cy = K.at<float>(1,2);
-
-    vP2D.clear();
-    vP2D.reserve(vP3Dw.size());
-
-    for(size_t i=0, iend=vP3Dw.size(); i<iend; i++)
-    {
-        cv::Mat P3Dc = Rcw*vP3Dw[i]+tcw;
-        const float invz = 1/(P3Dc.at<float>(2));
-        const float x = P3Dc.at<float>(0)*invz;
-        const float y = P3Dc.at<float>(1)*invz;
-
-        vP2D.push_back((cv::Mat_<float>(2,1) << fx*x+cx, fy*y+cy));
-    }
-}
-
-void Sim3Solver::FromCameraToImage(const vector<cv::Mat> &vP3Dc, vector<cv::Mat> &vP2D, cv::Mat K)
-{
-    const float &fx = K.at<float>(0,0);
-    const float &fy = K.at<float>(1,1);
-    const float &cx = K.at<float>(0,2);
-    const float &cy = K.at<float>(1,2);
-
-    vP2D.clear();
-    vP2D.reserve(vP3Dc.size());
-
-    for(size_t i=0, iend=vP3Dc.size(); i<iend; i++)
-    {
-        const float invz = 1/(vP3Dc[i].at<float>(2));
-        const float x = vP3Dc[i].at<float>(0)*invz;
-        const float y = vP3Dc[i].at<float>(1)*invz;
-
-        vP2D.push_back((cv::Mat_<float>(2,1) << fx*x+cx, fy*y+cy));
-    }
-}
-
 } //namespace ORB_SLAM
@@ -22,6 +22,7 @@
 
 #include "System.h"
 #include "Converter.h"
+#include "Optimizer.h"
 #include <thread>
 #include <pangolin/pangolin.h>
 #include <iomanip>
@@ -57,6 +58,9 @@ System::System(const string &strVocFile, const string &strSettingsFile, const eS
        exit(-1);
     }
 
+    //Select the linear solvers of the global optimizations
+    Optimizer::ReadSettings(strSettingsFile);
+
 
     //Load ORB Vocabulary
     cout << endl << "Loading ORB Vocabulary. This could take a while..." << endl;
@@ -87,7 +91,7 @@ System::System(const string &strVocFile, const string &strSettingsFile, const eS
                              mpMap, mpKeyFrameDatabase, strSettingsFile, mSensor);
 
     //Initialize the Local Mapping thread and launch
-    mpLocalMapper = new LocalMapping(mpMap, mSensor==MONOCULAR);
+    mpLocalMapper = new LocalMapping(mpMap, mSensor==MONOCULAR, strSettingsFile);
     mptLocalMapping = new thread(&ORB_SLAM2::LocalMapping::Run,mpLocalMapper);
 
     //Initialize the Loop Closing thread and launch
@@ -315,6 +319,9 @@ void System::Shutdown()
         usleep(5000);
     }
 
+    mpMap->PrintMemoryUsage();
+    mpTracker->PrintLocalMapStats();
+
     if(mpViewer)
         pangolin::BindToContext("ORB-SLAM2: Map Viewer");
 }
@@ -0,0 +1,128 @@
+/**
+* This file is part of ORB-SLAM2.
+*
+* Copyright (C) 2014-2016 Raúl Mur-Artal <raulmur at unizar dot es> (University of Zaragoza)
+* For more information see <https://github.com/raulmur/ORB_SLAM2>
+*
+* ORB-SLAM2 is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* ORB-SLAM2 is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with ORB-SLAM2. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+namespace ORB_SLAM2
+{
+
+ThreadPool::ThreadPool(const int nThreads):
+    mpTask(static_cast<const function<void(int)>*>(NULL)), mnTaskSize(0), mnNextIdx(0), mnGeneration(0), mnActive(0), mbFinish(false)
+{
+    int n = nThreads;
+    if(n<=0)
+        n = thread::hardware_concurrency();
+
+    for(int i=1; i<n; i++)
+        mvThreads.push_back(thread(&ThreadPool::Run,this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        unique_lock<mutex> lock(mMutex);
+        mbFinish = true;
+    }
+    mCondWork.notify_all();
+
+    for(size_t i=0; i<mvThreads.size(); i++)
+        mvThreads[i].join();
+}
+
+int ThreadPool::Size()
+{
+    return mvThreads.size()+1;
+}
+
+void ThreadPool::ParallelFor(const int n, const function<void(int)> &f)
+{
+    if(n<=0)
+        return;
+
+    unique_lock<mutex> lockCall(mMutexCall);
+
+    if(mvThreads.empty() || n==1)
+    {
+        for(int i=0; i<n; i++)
+            f(i);
+        return;
+    }
+
+    {
+        unique_lock<mutex> lock(mMutex);
+        mpTask = &f;
+        mnTaskSize = n;
+        mnNextIdx = 0;
+        mnGeneration++;
+    }
+    mCondWork.notify_all();
+
+    Work(f,n);
+
+    unique_lock<mutex> lock(mMutex);
+    while(mnActive>0)
+        mCondDone.wait(lock);
+
+    // Workers that wake up after this point find no task
+    mpTask = static_cast<const function<void(int)>*>(NULL);
+    mnTaskSize = 0;
+}
+
+void ThreadPool::Work(const function<void(int)> &f, const int n)
+{
+    int i;
+    while((i=mnNextIdx++)<n)
+        f(i);
+}
+
+void ThreadPool::Run()
+{
+    unsigned long nGeneration = 0;
+
+    unique_lock<mutex> lock(mMutex);
+    while(true)
+    {
+        while(!mbFinish && mnGeneration==nGeneration)
+            mCondWork.wait(lock);
+
+        if(mbFinish)
+            return;
+
+        nGeneration = mnGeneration;
+        if(!mpTask)
+            continue;
+
+        const function<void(int)>* pTask = mpTask;
+        const int n = mnTaskSize;
+        mnActive++;
+        lock.unlock();
+
+        Work(*pTask,n);
+
+        lock.lock();
+        mnActive--;
+        if(mnActive==0)
+            mCondDone.notify_all();
+    }
+}
+
+} //namespace ORB_SLAM
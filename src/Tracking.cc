@@ -32,8 +32,10 @@
 
 #include"Optimizer.h"
 #include"PnPsolver.h"
+#include"ThreadPool.h"
 
 #include<iostream>
+#include<chrono>
 
 #include<mutex>
 
@@ -45,8 +47,9 @@ namespace ORB_SLAM2
 
 Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer, MapDrawer *pMapDrawer, Map *pMap, KeyFrameDatabase* pKFDB, const string &strSettingPath, const int sensor):
     mState(NO_IMAGES_YET), mSensor(sensor), mbOnlyTracking(false), mbVO(false), mpORBVocabulary(pVoc),
-    mpKeyFrameDB(pKFDB), mpInitializer(static_cast<Initializer*>(NULL)), mpSystem(pSys), mpViewer(NULL),
-    mpFrameDrawer(pFrameDrawer), mpMapDrawer(pMapDrawer), mpMap(pMap), mnLastRelocFrameId(0)
+    mpKeyFrameDB(pKFDB), mpInitializer(static_cast<Initializer*>(NULL)),
+    mbLocalMapFromIndex(false), mfLocalMapTime(0), mnLocalMapUpdates(0), mnLocalMapReused(0), mpSystem(pSys), mpViewer(NULL),
+    mpFrameDrawer(pFrameDrawer), mpMapDrawer(pMapDrawer), mpMap(pMap), mnLastRelocFrameId(0), mpPoseRefKF(NULL)
 {
     // Load camera parameters from settings file
 
@@ -146,6 +149,7 @@ Tracking::Tracking(System *pSys, ORBVocabulary* pVoc, FrameDrawer *pFrameDrawer,
             mDepthMapFactor = 1.0f/mDepthMapFactor;
     }
 
+    mnMapParticipant = mpMap->RegisterParticipant();
 }
 
 void Tracking::SetLocalMapper(LocalMapping *pLocalMapper)
@@ -200,6 +204,8 @@ cv::Mat Tracking::GrabImageStereo(const cv::Mat &imRectLeft, const cv::Mat &imRe
 
     Track();
 
+    DiscardBadMapPoints();
+
     return mCurrentFrame.mTcw.clone();
 }
 
@@ -231,6 +237,8 @@ cv::Mat Tracking::GrabImageRGBD(const cv::Mat &imRGB,const cv::Mat &imD, const d
 
     Track();
 
+    DiscardBadMapPoints();
+
     return mCurrentFrame.mTcw.clone();
 }
 
@@ -261,6 +269,8 @@ cv::Mat Tracking::GrabImageMonocular(const cv::Mat &im, const double &timestamp)
 
     Track();
 
+    DiscardBadMapPoints();
+
     return mCurrentFrame.mTcw.clone();
 }
 
@@ -272,16 +282,24 @@ void Tracking::Track()
     }
 
     mLastProcessedState=mState;
+    mpPoseRefKF = static_cast<KeyFrame*>(NULL);
 
-    // Get Map Mutex -> Map cannot be changed
-    unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+    // The map is not locked while tracking the frame. Optimizers keep publishing their results,
+    // every pose optimization is repeated until it ran between two map updates (see OptimizePose).
+    // Matching may still see a half-applied update, the pose is always consistent with one state of the map.
+    // Only the creation of the map and of new keyframes take the map mutex.
 
     if(mState==NOT_INITIALIZED)
     {
-        if(mSensor==System::STEREO || mSensor==System::RGBD)
-            StereoInitialization();
-        else
-            MonocularInitialization();
+        {
+            // Get Map Mutex -> Map cannot be changed
+            unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+
+            if(mSensor==System::STEREO || mSensor==System::RGBD)
+                StereoInitialization();
+            else
+                MonocularInitialization();
+        }
 
         mpFrameDrawer->Update(this);
 
@@ -488,7 +506,14 @@ void Tracking::Track()
     // Store frame pose information to retrieve the complete camera trajectory afterwards.
     if(!mCurrentFrame.mTcw.empty())
     {
-        cv::Mat Tcr = mCurrentFrame.mTcw*mCurrentFrame.mpReferenceKF->GetPoseInverse();
+        // Use the reference pose of the map state the frame was optimized against, the keyframe might
+        // have been moved by a map update since then
+        cv::Mat Twr;
+        if(mCurrentFrame.mpReferenceKF==mpPoseRefKF)
+            Twr = mTwrPose;
+        else
+            Twr = mCurrentFrame.mpReferenceKF->GetPoseInverse();
+        cv::Mat Tcr = mCurrentFrame.mTcw*Twr;
         mlRelativeFramePoses.push_back(Tcr);
         mlpReferences.push_back(mpReferenceKF);
         mlFrameTimes.push_back(mCurrentFrame.mTimeStamp);
@@ -753,6 +778,43 @@ void Tracking::CheckReplacedInLastFrame()
     }
 }
 
+void Tracking::DiscardBadMapPoints()
+{
+    // Replace or drop the bad MapPoints kept for the next frame, then let the map reclaim them
+    Frame* vpFrames[2] = {&mCurrentFrame, &mLastFrame};
+    for(int f=0; f<2; f++)
+    {
+        Frame* pF = vpFrames[f];
+        for(int i=0; i<pF->N; i++)
+        {
+            MapPoint* pMP = pF->mvpMapPoints[i];
+            if(pMP && pMP->isBad())
+            {
+                MapPoint* pRep = pMP->GetReplaced();
+                if(pRep && !pRep->isBad())
+                    pF->mvpMapPoints[i] = pRep;
+                else
+                    pF->mvpMapPoints[i] = static_cast<MapPoint*>(NULL);
+            }
+        }
+    }
+
+    size_t j=0;
+    for(size_t i=0; i<mvpLocalMapPoints.size(); i++)
+    {
+        MapPoint* pMP = mvpLocalMapPoints[i];
+        if(pMP && !pMP->isBad())
+            mvpLocalMapPoints[j++] = pMP;
+    }
+    mvpLocalMapPoints.resize(j);
+
+    // The reference keyframe is matched with BoW in the next frame, a bad one would be released
+    // meanwhile. Take its closest good ancestor in the spanning tree.
+    while(mpReferenceKF && mpReferenceKF->isBad())
+        mpReferenceKF = mpReferenceKF->GetParent();
+
+    mpMap->QuiescentState(mnMapParticipant);
+}
 
 bool Tracking::TrackReferenceKeyFrame()
 {
@@ -772,7 +834,7 @@ bool Tracking::TrackReferenceKeyFrame()
     mCurrentFrame.mvpMapPoints = vpMapPointMatches;
     mCurrentFrame.SetPose(mLastFrame.mTcw);
 
-    Optimizer::PoseOptimization(&mCurrentFrame);
+    OptimizePose();
 
     // Discard outliers
     int nmatchesMap = 0;
@@ -895,7 +957,7 @@ bool Tracking::TrackWithMotionModel()
         return false;
 
     // Optimize frame pose with all matches
-    Optimizer::PoseOptimization(&mCurrentFrame);
+    OptimizePose();
 
     // Discard outliers
     int nmatchesMap = 0;
@@ -927,6 +989,40 @@ bool Tracking::TrackWithMotionModel()
     return nmatchesMap>=10;
 }
 
+int Tracking::OptimizePose()
+{
+    // Map points are read without the map mutex. If a local BA, loop correction or global BA was
+    // written back while optimizing (or was being written when we started), some points might have
+    // been read before and some after the update: optimize again. Under a steady stream of updates
+    // the last attempt waits for the map mutex instead.
+    const int nMaxAttempts = 3;
+    for(int it=0; it<nMaxAttempts; it++)
+    {
+        const unsigned long nUpdateIdx = mpMap->GetUpdateIdx();
+        if(nUpdateIdx%2!=0)
+            break;
+
+        int nGood = Optimizer::PoseOptimization(&mCurrentFrame);
+        cv::Mat Twr;
+        if(mpReferenceKF)
+            Twr = mpReferenceKF->GetPoseInverse();
+
+        if(mpMap->GetUpdateIdx()==nUpdateIdx)
+        {
+            mpPoseRefKF = mpReferenceKF;
+            mTwrPose = Twr;
+            return nGood;
+        }
+    }
+
+    unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+    int nGood = Optimizer::PoseOptimization(&mCurrentFrame);
+    mpPoseRefKF = mpReferenceKF;
+    if(mpReferenceKF)
+        mTwrPose = mpReferenceKF->GetPoseInverse();
+    return nGood;
+}
+
 bool Tracking::TrackLocalMap()
 {
     // We have an estimation of the camera pose and some map points tracked in the frame.
@@ -937,7 +1033,8 @@ bool Tracking::TrackLocalMap()
     SearchLocalPoints();
 
     // Optimize Pose
-    Optimizer::PoseOptimization(&mCurrentFrame);
+    OptimizePose();
+
     mnMatchesInliers = 0;
 
     // Update MapPoints Statistics
@@ -1065,10 +1162,15 @@ void Tracking::CreateNewKeyFrame()
     if(!mpLocalMapper->SetNotStop(true))
         return;
 
+    // Get Map Mutex -> Map cannot be changed
+    unique_lock<mutex> lock(mpMap->mMutexMapUpdate);
+
     KeyFrame* pKF = new KeyFrame(mCurrentFrame,mpMap,mpKeyFrameDB);
 
     mpReferenceKF = pKF;
     mCurrentFrame.mpReferenceKF = pKF;
+    mpPoseRefKF = pKF;
+    mTwrPose = pKF->GetPoseInverse();
 
     if(mSensor!=System::MONOCULAR)
     {
@@ -1161,9 +1263,8 @@ void Tracking::SearchLocalPoints()
         }
     }
 
-    int nToMatch=0;
-
-    // Project points in frame and check its visibility
+    vector<MapPoint*> vpCandidates;
+    vpCandidates.reserve(mvpLocalMapPoints.size());
     for(vector<MapPoint*>::iterator vit=mvpLocalMapPoints.begin(), vend=mvpLocalMapPoints.end(); vit!=vend; vit++)
     {
         MapPoint* pMP = *vit;
@@ -1171,12 +1272,16 @@ void Tracking::SearchLocalPoints()
             continue;
         if(pMP->isBad())
             continue;
-        // Project (this fills MapPoint variables for matching)
-        if(mCurrentFrame.isInFrustum(pMP,0.5))
-        {
-            pMP->IncreaseVisible();
-            nToMatch++;
-        }
+        vpCandidates.push_back(pMP);
+    }
+
+    // Project points in frame and check its visibility (this fills MapPoint variables for matching)
+    const int nToMatch = mCurrentFrame.AreInFrustum(vpCandidates,0.5);
+
+    for(vector<MapPoint*>::iterator vit=vpCandidates.begin(), vend=vpCandidates.end(); vit!=vend; vit++)
+    {
+        if((*vit)->mbTrackInView)
+            (*vit)->IncreaseVisible();
     }
 
     if(nToMatch>0)
@@ -1197,14 +1302,30 @@ void Tracking::UpdateLocalMap()
     // This is for visualization
     mpMap->SetReferenceMapPoints(mvpLocalMapPoints);
 
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+
     // Update
-    UpdateLocalKeyFrames();
-    UpdateLocalPoints();
+    if(UpdateLocalKeyFrames())
+        UpdateLocalPoints();
+
+    std::chrono::steady_clock::time_point t2 = std::chrono::steady_clock::now();
+    mfLocalMapTime += std::chrono::duration_cast<std::chrono::duration<double> >(t2-t1).count();
+    mnLocalMapUpdates++;
+}
+
+void Tracking::PrintLocalMapStats()
+{
+    if(mnLocalMapUpdates==0)
+        return;
+
+    cout << "Local map update: " << 1000.0*mfLocalMapTime/mnLocalMapUpdates << " ms per frame, reused in "
+         << mnLocalMapReused << " of " << mnLocalMapUpdates << " frames" << endl;
 }
 
 void Tracking::UpdateLocalPoints()
 {
     mvpLocalMapPoints.clear();
+    mbLocalMapFromIndex = false;
 
     for(vector<KeyFrame*>::const_iterator itKF=mvpLocalKeyFrames.begin(), itEndKF=mvpLocalKeyFrames.end(); itKF!=itEndKF; itKF++)
     {
@@ -1225,13 +1346,64 @@ void Tracking::UpdateLocalPoints()
             }
         }
     }
+
+    // The covisibility graph gives few points (e.g. long corridors, revisits of old areas).
+    // Add the map points in the viewing frustum of the predicted pose.
+    if(mvpLocalMapPoints.size()<static_cast<size_t>(mCurrentFrame.N) && !mCurrentFrame.mTcw.empty())
+    {
+        const cv::Matx33f Rcw = mCurrentFrame.mTcw.rowRange(0,3).colRange(0,3);
+        const cv::Vec3f tcw = mCurrentFrame.mTcw.rowRange(0,3).col(3);
+
+        // Search up to twice the depth of the points matched so far
+        float maxDepth = 0;
+        for(int i=0; i<mCurrentFrame.N; i++)
+        {
+            MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
+            if(!pMP)
+                continue;
+            const cv::Vec3f x3Dc = Rcw*pMP->GetWorldPos3f()+tcw;
+            maxDepth = max(maxDepth,x3Dc[2]);
+        }
+
+        if(maxDepth>0)
+        {
+            mbLocalMapFromIndex = true;
+            const vector<MapPoint*> vpMPs = mpMap->GetMapPointsInFrustum(mCurrentFrame.mTcw,mCurrentFrame.fx,mCurrentFrame.fy,
+                                                                         mCurrentFrame.cx,mCurrentFrame.cy,
+                                                                         mCurrentFrame.mnMinX,mCurrentFrame.mnMaxX,
+                                                                         mCurrentFrame.mnMinY,mCurrentFrame.mnMaxY,2*maxDepth);
+            for(vector<MapPoint*>::const_iterator itMP=vpMPs.begin(), itEndMP=vpMPs.end(); itMP!=itEndMP; itMP++)
+            {
+                MapPoint* pMP = *itMP;
+                if(pMP->mnTrackReferenceForFrame==mCurrentFrame.mnId)
+                    continue;
+                if(!pMP->isBad())
+                {
+                    mvpLocalMapPoints.push_back(pMP);
+                    pMP->mnTrackReferenceForFrame=mCurrentFrame.mnId;
+                }
+            }
+        }
+    }
 }
 
 
-void Tracking::UpdateLocalKeyFrames()
+// Votes for each keyframe observing a map point
+struct KeyFrameCounter
+{
+    KeyFrameCounter(map<KeyFrame*,int> &counter):mCounter(counter){}
+    void operator()(KeyFrame* pKF, size_t)
+    {
+        mCounter[pKF]++;
+    }
+    map<KeyFrame*,int> &mCounter;
+};
+
+bool Tracking::UpdateLocalKeyFrames()
 {
     // Each map point vote for the keyframes in which it has been observed
     map<KeyFrame*,int> keyframeCounter;
+    KeyFrameCounter counter(keyframeCounter);
     for(int i=0; i<mCurrentFrame.N; i++)
     {
         if(mCurrentFrame.mvpMapPoints[i])
@@ -1239,9 +1411,7 @@ void Tracking::UpdateLocalKeyFrames()
             MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
             if(!pMP->isBad())
             {
-                const map<KeyFrame*,size_t> observations = pMP->GetObservations();
-                for(map<KeyFrame*,size_t>::const_iterator it=observations.begin(), itend=observations.end(); it!=itend; it++)
-                    keyframeCounter[it->first]++;
+                pMP->ForEachObservation(counter);
             }
             else
             {
@@ -1250,14 +1420,15 @@ void Tracking::UpdateLocalKeyFrames()
         }
     }
 
+    // No votes: the local keyframes of the last frame are kept, their points are collected again
     if(keyframeCounter.empty())
-        return;
+        return true;
 
     int max=0;
     KeyFrame* pKFmax= static_cast<KeyFrame*>(NULL);
 
-    mvpLocalKeyFrames.clear();
-    mvpLocalKeyFrames.reserve(3*keyframeCounter.size());
+    vector<KeyFrame*> vpVotedKFs;
+    vpVotedKFs.reserve(keyframeCounter.size());
 
     // All keyframes that observe a map point are included in the local map. Also check which keyframe shares most points
     for(map<KeyFrame*,int>::const_iterator it=keyframeCounter.begin(), itEnd=keyframeCounter.end(); it!=itEnd; it++)
@@ -1273,8 +1444,43 @@ void Tracking::UpdateLocalKeyFrames()
             pKFmax=pKF;
         }
 
-        mvpLocalKeyFrames.push_back(it->first);
-        pKF->mnTrackReferenceForFrame = mCurrentFrame.mnId;
+        vpVotedKFs.push_back(pKF);
+    }
+
+    if(pKFmax)
+    {
+        mpReferenceKF = pKFmax;
+        mCurrentFrame.mpReferenceKF = mpReferenceKF;
+    }
+
+    // Same voted keyframes and none of the local keyframes changed: the expansion below and the local
+    // points would be the same. The map points added from the spatial index depend on the pose, they are recomputed.
+    if(vpVotedKFs==mvpLastVotedKeyFrames && !mbLocalMapFromIndex && !mvpLocalKeyFrames.empty() &&
+       mvnLocalKeyFrameChangeIdx.size()==mvpLocalKeyFrames.size())
+    {
+        bool bChanged = false;
+        for(size_t i=0; i<mvpLocalKeyFrames.size() && !bChanged; i++)
+            bChanged = mvpLocalKeyFrames[i]->GetChangeIdx()!=mvnLocalKeyFrameChangeIdx[i] || mvpLocalKeyFrames[i]->isBad();
+
+        if(!bChanged)
+        {
+            mnLocalMapReused++;
+            return false;
+        }
+    }
+
+    mvpLastVotedKeyFrames = vpVotedKFs;
+
+    // The change index of each local keyframe is read before its links and points,
+    // a change while building the local map is seen in the next frame
+    mvpLocalKeyFrames = vpVotedKFs;
+    mvpLocalKeyFrames.reserve(3*vpVotedKFs.size());
+    mvnLocalKeyFrameChangeIdx.clear();
+    mvnLocalKeyFrameChangeIdx.reserve(3*vpVotedKFs.size());
+    for(vector<KeyFrame*>::const_iterator itKF=vpVotedKFs.begin(), itEndKF=vpVotedKFs.end(); itKF!=itEndKF; itKF++)
+    {
+        (*itKF)->mnTrackReferenceForFrame = mCurrentFrame.mnId;
+        mvnLocalKeyFrameChangeIdx.push_back((*itKF)->GetChangeIdx());
     }
 
 
@@ -1296,6 +1502,7 @@ void Tracking::UpdateLocalKeyFrames()
             {
                 if(pNeighKF->mnTrackReferenceForFrame!=mCurrentFrame.mnId)
                 {
+                    mvnLocalKeyFrameChangeIdx.push_back(pNeighKF->GetChangeIdx());
                     mvpLocalKeyFrames.push_back(pNeighKF);
                     pNeighKF->mnTrackReferenceForFrame=mCurrentFrame.mnId;
                     break;
@@ -1311,6 +1518,7 @@ void Tracking::UpdateLocalKeyFrames()
             {
                 if(pChildKF->mnTrackReferenceForFrame!=mCurrentFrame.mnId)
                 {
+                    mvnLocalKeyFrameChangeIdx.push_back(pChildKF->GetChangeIdx());
                     mvpLocalKeyFrames.push_back(pChildKF);
                     pChildKF->mnTrackReferenceForFrame=mCurrentFrame.mnId;
                     break;
@@ -1323,6 +1531,7 @@ void Tracking::UpdateLocalKeyFrames()
         {
             if(pParent->mnTrackReferenceForFrame!=mCurrentFrame.mnId)
             {
+                mvnLocalKeyFrameChangeIdx.push_back(pParent->GetChangeIdx());
                 mvpLocalKeyFrames.push_back(pParent);
                 pParent->mnTrackReferenceForFrame=mCurrentFrame.mnId;
                 break;
@@ -1331,11 +1540,7 @@ void Tracking::UpdateLocalKeyFrames()
 
     }
 
-    if(pKFmax)
-    {
-        mpReferenceKF = pKFmax;
-        mCurrentFrame.mpReferenceKF = mpReferenceKF;
-    }
+    return true;
 }
 
 bool Tracking::Relocalization()
@@ -1354,72 +1559,79 @@ bool Tracking::Relocalization()
 
     // We perform first an ORB matching with each candidate
     // If enough matches are found we setup a PnP solver
-    ORBmatcher matcher(0.75,true);
+    // Candidates are processed in parallel, each one only writes its own slot
+    vector<PnPsolver*> vpPnPsolvers(nKFs,static_cast<PnPsolver*>(NULL));
+    vector<vector<MapPoint*> > vvpMapPointMatches(nKFs);
+    vector<int> vbDiscarded(nKFs,true);
 
-    vector<PnPsolver*> vpPnPsolvers;
-    vpPnPsolvers.resize(nKFs);
+    mThreadPool.ParallelFor(nKFs,[&](int i)
+    {
+        KeyFrame* pKF = vpCandidateKFs[i];
+        if(pKF->isBad())
+            return;
 
-    vector<vector<MapPoint*> > vvpMapPointMatches;
-    vvpMapPointMatches.resize(nKFs);
+        ORBmatcher matcher(0.75,true);
+        int nmatches = matcher.SearchByBoW(pKF,mCurrentFrame,vvpMapPointMatches[i]);
+        if(nmatches<15)
+            return;
 
-    vector<bool> vbDiscarded;
-    vbDiscarded.resize(nKFs);
+        PnPsolver* pSolver = new PnPsolver(mCurrentFrame,vvpMapPointMatches[i]);
+        pSolver->SetRansacParameters(0.99,10,300,4,0.5,5.991);
+        // Deterministic seed, independent of the scheduling of the threads
+        pSolver->SetSeed(mCurrentFrame.mnId*1000003ul+pKF->mnId);
+        vpPnPsolvers[i] = pSolver;
+        vbDiscarded[i] = false;
+    });
 
     int nCandidates=0;
-
     for(int i=0; i<nKFs; i++)
-    {
-        KeyFrame* pKF = vpCandidateKFs[i];
-        if(pKF->isBad())
-            vbDiscarded[i] = true;
-        else
-        {
-            int nmatches = matcher.SearchByBoW(pKF,mCurrentFrame,vvpMapPointMatches[i]);
-            if(nmatches<15)
-            {
-                vbDiscarded[i] = true;
-                continue;
-            }
-            else
-            {
-                PnPsolver* pSolver = new PnPsolver(mCurrentFrame,vvpMapPointMatches[i]);
-                pSolver->SetRansacParameters(0.99,10,300,4,0.5,5.991);
-                vpPnPsolvers[i] = pSolver;
-                nCandidates++;
-            }
-        }
-    }
+        if(!vbDiscarded[i])
+            nCandidates++;
 
     // Alternatively perform some iterations of P4P RANSAC
     // Until we found a camera pose supported by enough inliers
+    // Each round runs 5 iterations of every remaining candidate in parallel. The poses found
+    // are then refined serially in candidate order, the first one with enough inliers is taken.
     bool bMatch = false;
     ORBmatcher matcher2(0.9,true);
 
+    vector<cv::Mat> vTcw(nKFs);
+    vector<vector<bool> > vvbInliers(nKFs);
+    vector<int> vbNoMore(nKFs);
+
     while(nCandidates>0 && !bMatch)
     {
-        for(int i=0; i<nKFs; i++)
+        mThreadPool.ParallelFor(nKFs,[&](int i)
         {
+            vTcw[i] = cv::Mat();
             if(vbDiscarded[i])
-                continue;
+                return;
 
             // Perform 5 Ransac Iterations
-            vector<bool> vbInliers;
             int nInliers;
             bool bNoMore;
+            vTcw[i] = vpPnPsolvers[i]->iterate(5,bNoMore,vvbInliers[i],nInliers);
+            vbNoMore[i] = bNoMore;
+        });
 
-            PnPsolver* pSolver = vpPnPsolvers[i];
-            cv::Mat Tcw = pSolver->iterate(5,bNoMore,vbInliers,nInliers);
+        for(int i=0; i<nKFs; i++)
+        {
+            if(vbDiscarded[i])
+                continue;
 
             // If Ransac reachs max. iterations discard keyframe
-            if(bNoMore)
+            if(vbNoMore[i])
             {
                 vbDiscarded[i]=true;
                 nCandidates--;
             }
 
             // If a Camera Pose is computed, optimize
+            cv::Mat &Tcw = vTcw[i];
             if(!Tcw.empty())
             {
+                const vector<bool> &vbInliers = vvbInliers[i];
+
                 Tcw.copyTo(mCurrentFrame.mTcw);
 
                 set<MapPoint*> sFound;
@@ -1437,7 +1649,7 @@ bool Tracking::Relocalization()
                         mCurrentFrame.mvpMapPoints[j]=NULL;
                 }
 
-                int nGood = Optimizer::PoseOptimization(&mCurrentFrame);
+                int nGood = OptimizePose();
 
                 if(nGood<10)
                     continue;
@@ -1453,7 +1665,7 @@ bool Tracking::Relocalization()
 
                     if(nadditional+nGood>=50)
                     {
-                        nGood = Optimizer::PoseOptimization(&mCurrentFrame);
+                        nGood = OptimizePose();
 
                         // If many inliers but still not enough, search by projection again in a narrower window
                         // the camera has been already optimized with many points
@@ -1468,7 +1680,7 @@ bool Tracking::Relocalization()
                             // Final optimization
                             if(nGood+nadditional>=50)
                             {
-                                nGood = Optimizer::PoseOptimization(&mCurrentFrame);
+                                nGood = OptimizePose();
 
                                 for(int io =0; io<mCurrentFrame.N; io++)
                                     if(mCurrentFrame.mvbOutlier[io])
@@ -1489,6 +1701,9 @@ bool Tracking::Relocalization()
         }
     }
 
+    for(int i=0; i<nKFs; i++)
+        delete vpPnPsolvers[i];
+
     if(!bMatch)
     {
         return false;
@@ -1545,6 +1760,14 @@ void Tracking::Reset()
     mlFrameTimes.clear();
     mlbLost.clear();
 
+    // The MapPoints were deleted with the map
+    mvpLocalMapPoints.clear();
+    mvpLocalKeyFrames.clear();
+    mvpLastVotedKeyFrames.clear();
+    mvnLocalKeyFrameChangeIdx.clear();
+    fill(mCurrentFrame.mvpMapPoints.begin(),mCurrentFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
+    fill(mLastFrame.mvpMapPoints.begin(),mLastFrame.mvpMapPoints.end(),static_cast<MapPoint*>(NULL));
+
     if(mpViewer)
         mpViewer->Release();
 }
@@ -56,6 +56,9 @@ void Viewer::Run()
     mbFinished = false;
     mbStopped = false;
 
+    Map* pMap = mpMapDrawer->mpMap;
+    const int nMapParticipant = pMap->RegisterParticipant();
+
     pangolin::CreateWindowAndBind("ORB-SLAM2: Map Viewer",1024,768);
 
     // 3D Mouse handler requires depth testing to be enabled
@@ -134,6 +137,9 @@ void Viewer::Run()
 
         pangolin::FinishFrame();
 
+        // The drawers do not keep MapPoints from one frame to the next
+        pMap->QuiescentState(nMapParticipant);
+
         cv::Mat im = mpFrameDrawer->DrawFrame();
         cv::imshow("ORB-SLAM2: Current Frame",im);
         cv::waitKey(mT);
@@ -165,6 +171,8 @@ void Viewer::Run()
             break;
     }
 
+    pMap->UnregisterParticipant(nMapParticipant);
+
     SetFinish();
 }
 